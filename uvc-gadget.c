@@ -34,20 +34,31 @@
  * with this program; if not, write to the Free Software Foundation, Inc.,
  */
 
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
-#include <sys/select.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <time.h>
@@ -58,14 +69,662 @@
 #include <linux/videodev2.h>
 #include <linux/fb.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#if defined(__arm__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+#endif
+
 #include "uvc-gadget.h"
 
+/* ---------------------------------------------------------------------------
+ * Logging
+ */
+
+static void log_output(const char * text, size_t length)
+{
+    ssize_t ret;
+
+    while (length > 0) {
+        ret = write(STDOUT_FILENO, text, length);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return;
+        }
+        text += ret;
+        length -= ret;
+    }
+}
+
+static void log_wakeup()
+{
+    uint64_t value = 1;
+    ssize_t ret;
+
+    ret = write(logger.wakeup_fd, &value, sizeof value);
+    (void)(ret);
+}
+
+/*
+ * Parse the conversion specification after a '%', returns the character
+ * after it or NULL when the argument can't be stored for later, e.g. for
+ * a '*' width or %n.
+ */
+static const char * log_spec_parse(const char * format, char * conversion, enum log_arg_size * size)
+{
+    const char * start = format;
+
+    format += strspn(format, "-+ #0");
+    format += strspn(format, "0123456789");
+    if (*format == '.') {
+        format++;
+        format += strspn(format, "0123456789");
+    }
+
+    *size = LOG_ARG_INT;
+    switch (*format) {
+    case 'h':
+        format += (format[1] == 'h') ? 2 : 1;
+        break;
+    case 'l':
+        *size = (format[1] == 'l') ? LOG_ARG_LLONG : LOG_ARG_LONG;
+        format += (format[1] == 'l') ? 2 : 1;
+        break;
+    case 'z':
+        *size = LOG_ARG_SIZE;
+        format++;
+        break;
+    case 'j':
+        *size = LOG_ARG_INTMAX;
+        format++;
+        break;
+    case 't':
+        *size = LOG_ARG_PTRDIFF;
+        format++;
+        break;
+    }
+
+    *conversion = *format;
+    if (!*format || !strchr("diouxXcsfFeEgGaAp", *format) || format - start + 2 > LOG_SPEC_MAX) {
+        return NULL;
+    }
+    return format + 1;
+}
+
+static long long log_arg_signed(va_list * args, enum log_arg_size size)
+{
+    switch (size) {
+    case LOG_ARG_LONG:      return va_arg(*args, long);
+    case LOG_ARG_LLONG:     return va_arg(*args, long long);
+    case LOG_ARG_SIZE:      return va_arg(*args, ssize_t);
+    case LOG_ARG_INTMAX:    return va_arg(*args, intmax_t);
+    case LOG_ARG_PTRDIFF:   return va_arg(*args, ptrdiff_t);
+    default:                return va_arg(*args, int);
+    }
+}
+
+static unsigned long long log_arg_unsigned(va_list * args, enum log_arg_size size)
+{
+    switch (size) {
+    case LOG_ARG_LONG:      return va_arg(*args, unsigned long);
+    case LOG_ARG_LLONG:     return va_arg(*args, unsigned long long);
+    case LOG_ARG_SIZE:      return va_arg(*args, size_t);
+    case LOG_ARG_INTMAX:    return va_arg(*args, uintmax_t);
+    case LOG_ARG_PTRDIFF:   return va_arg(*args, ptrdiff_t);
+    default:                return va_arg(*args, unsigned int);
+    }
+}
+
+/* Store the arguments of a message for the drain thread, false when it must be formatted now */
+static bool log_args_store(struct log_record * record, const char * format, va_list * args)
+{
+    union log_arg * arg = record->args;
+    enum log_arg_size size;
+    const char * string;
+    size_t length;
+    char conversion;
+
+    record->format = format;
+    record->length = 0;
+
+    while ((format = strchr(format, '%')) != NULL) {
+        if (format[1] == '%') {
+            format += 2;
+            continue;
+        }
+
+        format = log_spec_parse(format + 1, &conversion, &size);
+        if (!format || arg == &record->args[LOG_ARGS_MAX]) {
+            return false;
+        }
+
+        switch (conversion) {
+        case 'd':
+        case 'i':
+            arg->i = log_arg_signed(args, size);
+            break;
+
+        case 's':
+            /* Strings like strerror() results may not outlive the call, they are copied. */
+            string = va_arg(*args, const char *);
+            string = (string) ? string : "(null)";
+            length = min(strlen(string), LOG_RECORD_SIZE - 1 - record->length);
+            memcpy(record->text + record->length, string, length);
+            record->text[record->length + length] = '\0';
+            arg->offset = record->length;
+            record->length += (record->length + length < LOG_RECORD_SIZE - 1) ? length + 1 : length;
+            break;
+
+        case 'p':
+            arg->p = va_arg(*args, void *);
+            break;
+
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            arg->d = va_arg(*args, double);
+            break;
+
+        default:
+            arg->u = log_arg_unsigned(args, size);
+            break;
+        }
+        arg++;
+    }
+    return true;
+}
+
+/* Format one stored argument with its conversion specification */
+static int log_format_arg(char * out, size_t size, const char * spec, char conversion,
+    enum log_arg_size arg_size, const union log_arg * arg, const char * strings)
+{
+    switch (conversion) {
+    case 'd':
+    case 'i':
+        switch (arg_size) {
+        case LOG_ARG_LONG:      return snprintf(out, size, spec, (long) arg->i);
+        case LOG_ARG_LLONG:     return snprintf(out, size, spec, (long long) arg->i);
+        case LOG_ARG_SIZE:      return snprintf(out, size, spec, (ssize_t) arg->i);
+        case LOG_ARG_INTMAX:    return snprintf(out, size, spec, (intmax_t) arg->i);
+        case LOG_ARG_PTRDIFF:   return snprintf(out, size, spec, (ptrdiff_t) arg->i);
+        default:                return snprintf(out, size, spec, (int) arg->i);
+        }
+
+    case 's':
+        return snprintf(out, size, spec, strings + arg->offset);
+
+    case 'p':
+        return snprintf(out, size, spec, arg->p);
+
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        return snprintf(out, size, spec, arg->d);
+
+    default:
+        switch (arg_size) {
+        case LOG_ARG_LONG:      return snprintf(out, size, spec, (unsigned long) arg->u);
+        case LOG_ARG_LLONG:     return snprintf(out, size, spec, (unsigned long long) arg->u);
+        case LOG_ARG_SIZE:      return snprintf(out, size, spec, (size_t) arg->u);
+        case LOG_ARG_INTMAX:    return snprintf(out, size, spec, (uintmax_t) arg->u);
+        case LOG_ARG_PTRDIFF:   return snprintf(out, size, spec, (ptrdiff_t) arg->u);
+        default:                return snprintf(out, size, spec, (unsigned int) arg->u);
+        }
+    }
+}
+
+/* Format a stored message like vsnprintf() would have, returns the length it needed */
+static size_t log_format(const struct log_record * record, char * out, size_t size)
+{
+    const union log_arg * arg = record->args;
+    const char * format = record->format;
+    const char * end;
+    enum log_arg_size arg_size;
+    char spec[LOG_SPEC_MAX];
+    char conversion;
+    size_t used = 0;
+    size_t length;
+    int ret;
+
+    while (*format) {
+        end = strchrnul(format, '%');
+        length = end - format;
+        if (*end == '%' && end[1] == '%') {
+            length++;
+            end += 2;
+        }
+
+        /* Text up to the next conversion, a %% is kept as one %. */
+        if (used < size) {
+            memcpy(out + used, format, min(length, size - 1 - used));
+        }
+        used += length;
+        format = end;
+
+        if (*format != '%') {
+            continue;
+        }
+
+        end = log_spec_parse(format + 1, &conversion, &arg_size);
+        memcpy(spec, format, end - format);
+        spec[end - format] = '\0';
+        format = end;
+
+        ret = log_format_arg((used < size) ? out + used : NULL, (used < size) ? size - used : 0,
+            spec, conversion, arg_size, arg++, record->text);
+        used += max(ret, 0);
+    }
+
+    if (size) {
+        out[min(used, size - 1)] = '\0';
+    }
+    return used;
+}
+
+/* Format a message into a free record, or straight to stdout when no thread drains them */
+static void __attribute__((format(printf, 1, 2))) log_write(const char * format, ...)
+{
+    struct log_record * record;
+    char line[LOG_RECORD_SIZE];
+    unsigned int pos;
+    unsigned int sequence;
+    bool deferred;
+    va_list args;
+    int length;
+
+    /* Counted before the check, log_stop() waits for this record. */
+    atomic_fetch_add(&logger.writers, 1);
+
+    if (!atomic_load(&logger.running)) {
+        atomic_fetch_sub(&logger.writers, 1);
+        va_start(args, format);
+        length = vsnprintf(line, sizeof(line), format, args);
+        va_end(args);
+        log_output(line, clamp(length, 0, LOG_RECORD_SIZE - 1));
+        return;
+    }
+
+    pos = atomic_load_explicit(&logger.head, memory_order_relaxed);
+    for (;;) {
+        record = &logger.records[pos & (LOG_RING_SIZE - 1)];
+        sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+
+        if (sequence == pos) {
+            if (atomic_compare_exchange_weak_explicit(&logger.head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if ((int) (sequence - pos) < 0) {
+            /* Full, the drain thread is behind. Never wait for it. */
+            atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+            atomic_fetch_sub(&logger.writers, 1);
+            return;
+        } else {
+            pos = atomic_load_explicit(&logger.head, memory_order_relaxed);
+        }
+    }
+
+    /* The drain thread formats the message, unless the caller must. */
+    va_start(args, format);
+    deferred = log_args_store(record, format, &args);
+    va_end(args);
+
+    if (!deferred) {
+        va_start(args, format);
+        length = vsnprintf(record->text, LOG_RECORD_SIZE, format, args);
+        va_end(args);
+
+        if (length >= LOG_RECORD_SIZE) {
+            length = LOG_RECORD_SIZE - 1;
+            record->text[length - 1] = '\n';
+        }
+        record->format = NULL;
+        record->length = max(length, 0);
+    }
+
+    atomic_store(&record->sequence, pos + 1);
+    atomic_fetch_sub(&logger.writers, 1);
+
+    /* The ring was empty and the drain thread went to sleep. */
+    if (atomic_exchange(&logger.sleeping, false)) {
+        log_wakeup();
+    }
+}
+
+/* True when the oldest record is complete */
+static bool log_ring_ready()
+{
+    return atomic_load(&logger.records[logger.tail & (LOG_RING_SIZE - 1)].sequence) == logger.tail + 1;
+}
+
+/* Format or copy the oldest complete record, returns its length or 0 when the ring is empty */
+static size_t log_ring_pop(char * text)
+{
+    struct log_record * record = &logger.records[logger.tail & (LOG_RING_SIZE - 1)];
+    size_t length;
+
+    if (!log_ring_ready()) {
+        return 0;
+    }
+
+    if (record->format) {
+        /* Strings that filled the record were cut as well. */
+        length = log_format(record, text, LOG_RECORD_SIZE);
+        if (length >= LOG_RECORD_SIZE || record->length >= LOG_RECORD_SIZE - 1) {
+            length = min(length, LOG_RECORD_SIZE - 1);
+            text[length - 1] = '\n';
+        }
+    } else {
+        length = record->length;
+        memcpy(text, record->text, length);
+    }
+    atomic_store_explicit(&record->sequence, logger.tail + LOG_RING_SIZE, memory_order_release);
+    logger.tail++;
+    return length;
+}
+
+static void * log_thread_main(void * arg)
+{
+    char batch[LOG_BATCH_SIZE];
+    unsigned int dropped;
+    uint64_t value;
+    size_t length;
+    size_t used;
+    bool stop;
+    bool idle;
+    ssize_t ret;
+    (void)(arg);
+
+    /* Linux applies the nice value of setpriority() to the calling thread only. */
+    if (setpriority(PRIO_PROCESS, 0, LOG_THREAD_NICE) < 0) {
+        log_write("LOG: Unable to lower thread priority: %s (%d).\n", strerror(errno), errno);
+    }
+
+    for (;;) {
+        /* After stop no record is claimed once the writers are gone, what they published is drained. */
+        stop = atomic_load(&logger.stop);
+        idle = stop && atomic_load(&logger.writers) == 0;
+        used = 0;
+
+        while (used + LOG_RECORD_SIZE <= sizeof(batch) && (length = log_ring_pop(batch + used)) > 0) {
+            used += length;
+        }
+
+        dropped = atomic_exchange_explicit(&logger.dropped, 0, memory_order_relaxed);
+        if (dropped) {
+            log_output(batch, used);
+            used = snprintf(batch, sizeof(batch), "LOG: %u messages dropped\n", dropped);
+        }
+
+        if (used) {
+            log_output(batch, used);
+            continue;
+        }
+
+        if (idle) {
+            break;
+        }
+
+        /* A writer still fills its record. */
+        if (stop) {
+            sched_yield();
+            continue;
+        }
+
+        /* Sleep until a producer finds the flag set, checking the ring again once it is visible. */
+        atomic_store(&logger.sleeping, true);
+        if (!log_ring_ready() && !atomic_load(&logger.stop)) {
+            ret = read(logger.wakeup_fd, &value, sizeof value);
+            (void)(ret);
+        }
+        atomic_store(&logger.sleeping, false);
+    }
+    return NULL;
+}
+
+static int log_start()
+{
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init(&logger.records[i].sequence, i);
+    }
+    atomic_init(&logger.head, 0);
+    logger.tail = 0;
+    atomic_init(&logger.dropped, 0);
+    atomic_init(&logger.writers, 0);
+    atomic_init(&logger.sleeping, false);
+    atomic_init(&logger.stop, false);
+
+    logger.wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (logger.wakeup_fd < 0) {
+        ret = -errno;
+        log_write("LOG: eventfd failed: %s (%d).\n", strerror(-ret), -ret);
+        return ret;
+    }
+
+    ret = pthread_create(&logger.thread, NULL, log_thread_main, NULL);
+    if (ret != 0) {
+        log_write("LOG: Unable to start thread: %s (%d).\n", strerror(ret), ret);
+        close(logger.wakeup_fd);
+        logger.wakeup_fd = -1;
+        return -ret;
+    }
+
+    atomic_store_explicit(&logger.running, true, memory_order_release);
+    return 0;
+}
+
+/* Write out every pending record, later messages go straight to stdout */
+static void log_stop()
+{
+    if (!atomic_load_explicit(&logger.running, memory_order_acquire)) {
+        return;
+    }
+
+    atomic_store(&logger.running, false);
+    atomic_store(&logger.stop, true);
+    log_wakeup();
+    pthread_join(logger.thread, NULL);
+
+    close(logger.wakeup_fd);
+    logger.wakeup_fd = -1;
+}
+
 volatile sig_atomic_t terminate = 0;
 
 void term(int signum)
 {
+    uint64_t value = 1;
+    ssize_t ret;
+    unsigned int i;
     (void)(signum); /* avoid warning: unused parameter 'signum' */
     terminate = 1;
+
+    /* Wake up the event loop of every pipeline, write() is async-signal-safe. */
+    for (i = 0; i < npipelines; i++) {
+        if (pipelines[i]->terminate_fd >= 0) {
+            ret = write(pipelines[i]->terminate_fd, &value, sizeof value);
+            (void)(ret);
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Event loop
+ */
+
+static int event_loop_add(struct event_loop * loop, struct event_source * source, uint32_t events)
+{
+    struct epoll_event ev;
+    CLEAR(ev);
+
+    ev.events   = events;
+    ev.data.ptr = source;
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fd, &ev) < 0) {
+        log_error("EVENT LOOP: Unable to add %s: %s (%d).\n", source->name, strerror(errno), errno);
+        return -EINVAL;
+    }
+
+    source->events     = events;
+    source->registered = true;
+    return 0;
+}
+
+static int event_loop_update(struct event_loop * loop, struct event_source * source, uint32_t events)
+{
+    struct epoll_event ev;
+
+    if (!source->registered) {
+        return event_loop_add(loop, source, events);
+    }
+
+    if (source->events == events) {
+        return 0;
+    }
+
+    CLEAR(ev);
+    ev.events   = events;
+    ev.data.ptr = source;
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, source->fd, &ev) < 0) {
+        log_error("EVENT LOOP: Unable to update %s: %s (%d).\n", source->name, strerror(errno), errno);
+        return -EINVAL;
+    }
+
+    source->events = events;
+    return 0;
+}
+
+static void event_loop_wakeup(struct event_loop * loop)
+{
+    uint64_t value = 1;
+    ssize_t ret;
+
+    ret = write(loop->wakeup.fd, &value, sizeof value);
+    (void)(ret);
+}
+
+static void event_loop_wakeup_handler(struct event_source * source, uint32_t events)
+{
+    uint64_t value;
+    ssize_t ret;
+    (void)(events);
+
+    ret = read(source->fd, &value, sizeof value);
+    (void)(ret);
+}
+
+static int event_loop_init(struct event_loop * loop)
+{
+    CLEAR(*loop);
+    loop->wakeup.fd = -1;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        log_error("EVENT LOOP: epoll_create1 failed: %s (%d).\n", strerror(errno), errno);
+        return -EINVAL;
+    }
+
+    loop->wakeup.name    = "WAKEUP";
+    loop->wakeup.handler = event_loop_wakeup_handler;
+    loop->wakeup.fd      = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wakeup.fd < 0) {
+        log_error("EVENT LOOP: eventfd failed: %s (%d).\n", strerror(errno), errno);
+        close(loop->epoll_fd);
+        loop->epoll_fd = -1;
+        return -EINVAL;
+    }
+
+    return event_loop_add(loop, &loop->wakeup, EPOLLIN);
+}
+
+static void event_loop_close(struct event_loop * loop)
+{
+    if (loop->wakeup.fd >= 0) {
+        close(loop->wakeup.fd);
+        loop->wakeup.fd = -1;
+    }
+
+    if (loop->epoll_fd >= 0) {
+        close(loop->epoll_fd);
+        loop->epoll_fd = -1;
+    }
+}
+
+static int event_loop_dispatch(struct event_loop * loop, int timeout)
+{
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    struct event_source * source;
+    int nevents;
+    int i;
+
+    nevents = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+
+    for (i = 0; i < nevents; i++) {
+        source = events[i].data.ptr;
+        if (source->registered && source->handler) {
+            source->handler(source, events[i].events);
+        }
+    }
+    return nevents;
+}
+
+static int event_timer_open(struct event_source * timer, const char * name,
+    event_handler handler, void * data)
+{
+    CLEAR(*timer);
+    timer->name    = name;
+    timer->handler = handler;
+    timer->data    = data;
+
+    timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer->fd < 0) {
+        log_error("EVENT LOOP: timerfd_create failed for %s: %s (%d).\n", name, strerror(errno), errno);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Arm a timer, value_ns of 0 disarms it, interval_ns of 0 makes it one-shot */
+static int event_timer_arm(struct event_source * timer, uint64_t value_ns, uint64_t interval_ns)
+{
+    struct itimerspec spec;
+    CLEAR(spec);
+
+    spec.it_value.tv_sec     = value_ns / 1000000000ULL;
+    spec.it_value.tv_nsec    = value_ns % 1000000000ULL;
+    spec.it_interval.tv_sec  = interval_ns / 1000000000ULL;
+    spec.it_interval.tv_nsec = interval_ns % 1000000000ULL;
+
+    if (timerfd_settime(timer->fd, 0, &spec, NULL) < 0) {
+        log_error("EVENT LOOP: timerfd_settime failed for %s: %s (%d).\n",
+            timer->name, strerror(errno), errno);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static uint64_t event_timer_read(struct event_source * timer)
+{
+    uint64_t expirations = 0;
+
+    if (read(timer->fd, &expirations, sizeof expirations) != sizeof expirations) {
+        return 0;
+    }
+    return expirations;
+}
+
+static void event_timer_close(struct event_source * timer)
+{
+    if (timer->fd >= 0) {
+        close(timer->fd);
+        timer->fd = -1;
+    }
 }
 
 static int sys_gpio_write(unsigned int type, char pin[], char value[])
@@ -94,11 +753,11 @@ static int sys_gpio_write(unsigned int type, char pin[], char value[])
             break;
     }
 
-    printf("GPIO WRITE: Path: %s, Value: %s\n", path, value);
+    log_debug("GPIO WRITE: Path: %s, Value: %s\n", path, value);
 
     sys_file = fopen(path, "w");
     if (!sys_file) {
-        printf("GPIO ERROR: File write failed: %s (%d).\n", strerror(errno), errno);
+        log_error("GPIO ERROR: File write failed: %s (%d).\n", strerror(errno), errno);
         return -1;
     }
 
@@ -125,11 +784,11 @@ static int sys_led_write(unsigned int type, char value[])
             break;
     }
 
-    printf("LED WRITE: Path: %s, Value: %s\n", path, value);
+    log_debug("LED WRITE: Path: %s, Value: %s\n", path, value);
 
     sys_file = fopen(path, "w");
     if (!sys_file) {
-        printf("LED ERROR: File write failed: %s (%d).\n", strerror(errno), errno);
+        log_error("LED ERROR: File write failed: %s (%d).\n", strerror(errno), errno);
         return -1;
     }
 
@@ -142,26 +801,26 @@ static int sys_led_write(unsigned int type, char value[])
 static void streaming_status_enable()
 {
     int ret;
-    if (!settings.streaming_status_enabled && settings.streaming_status_pin) {
-        ret = sys_gpio_write(GPIO_EXPORT, settings.streaming_status_pin, NULL);
+    if (!pipeline->settings.streaming_status_enabled && pipeline->settings.streaming_status_pin) {
+        ret = sys_gpio_write(GPIO_EXPORT, pipeline->settings.streaming_status_pin, NULL);
         if (ret < 0) {
             return;
         }
 
-        ret = sys_gpio_write(GPIO_DIRECTION, settings.streaming_status_pin, GPIO_DIRECTION_OUT);
+        ret = sys_gpio_write(GPIO_DIRECTION, pipeline->settings.streaming_status_pin, GPIO_DIRECTION_OUT);
         if (ret < 0) {
             return;
         }
 
-        ret = sys_gpio_write(GPIO_VALUE, settings.streaming_status_pin, GPIO_VALUE_OFF);
+        ret = sys_gpio_write(GPIO_VALUE, pipeline->settings.streaming_status_pin, GPIO_VALUE_OFF);
         if (ret < 0) {
             return;
         }
 
-        settings.streaming_status_enabled = true;
+        pipeline->settings.streaming_status_enabled = true;
     }
 
-    if (settings.streaming_status_onboard) {
+    if (pipeline->settings.streaming_status_onboard) {
         ret = sys_led_write(LED_TRIGGER, LED_TRIGGER_NONE);
         if (ret < 0) {
             return;
@@ -171,7 +830,7 @@ static void streaming_status_enable()
         if (ret < 0) {
             return;
         }
-        settings.streaming_status_onboard_enabled = true;
+        pipeline->settings.streaming_status_onboard_enabled = true;
     }
     return;
 }
@@ -181,11 +840,11 @@ static void streaming_status_value(bool state)
     char * gpio_value = (state) ? GPIO_VALUE_ON : GPIO_VALUE_OFF;
     char * led_value = (state) ? LED_BRIGHTNESS_HIGH : LED_BRIGHTNESS_LOW;
 
-    if (settings.streaming_status_enabled) {
-        sys_gpio_write(GPIO_VALUE, settings.streaming_status_pin, gpio_value);
+    if (pipeline->settings.streaming_status_enabled) {
+        sys_gpio_write(GPIO_VALUE, pipeline->settings.streaming_status_pin, gpio_value);
     }
 
-    if (settings.streaming_status_onboard_enabled) {
+    if (pipeline->settings.streaming_status_onboard_enabled) {
         sys_led_write(LED_BRIGHTNESS, led_value);
     }
 }
@@ -283,88 +942,94 @@ static int v4l2_open(char * devname, unsigned int nbufs)
     struct v4l2_capability cap;
     const char * type_name = "DEVICE_V4L2";
 
-    printf("%s: Opening %s device\n", type_name, devname);
+    log_info("%s: Opening %s device\n", type_name, devname);
 
-    v4l2_dev.fd = open(devname, O_RDWR | O_NONBLOCK, 0);
-    if (v4l2_dev.fd == -1) {
-        printf("%s: Device open failed: %s (%d).\n", type_name, strerror(errno), errno);
+    pipeline->v4l2_dev.fd = open(devname, O_RDWR | O_NONBLOCK, 0);
+    if (pipeline->v4l2_dev.fd == -1) {
+        log_error("%s: Device open failed: %s (%d).\n", type_name, strerror(errno), errno);
         return -EINVAL;
     }
 
-    if (ioctl(v4l2_dev.fd, VIDIOC_QUERYCAP, &cap) < 0) {
-        printf("%s: VIDIOC_QUERYCAP failed: %s (%d).\n", type_name, strerror(errno), errno);
+    if (ioctl(pipeline->v4l2_dev.fd, VIDIOC_QUERYCAP, &cap) < 0) {
+        log_error("%s: VIDIOC_QUERYCAP failed: %s (%d).\n", type_name, strerror(errno), errno);
         goto err;
     }
 
     if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-        printf("%s: %s is no video capture device\n", type_name, devname);
+        log_error("%s: %s is no video capture device\n", type_name, devname);
         goto err;
     }
 
     if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-        printf("%s: %s does not support streaming i/o\n", type_name, devname);
+        log_error("%s: %s does not support streaming i/o\n", type_name, devname);
         goto err;
     }
 
-    printf("%s: Device is %s on bus %s\n", type_name, cap.card, cap.bus_info);
+    log_info("%s: Device is %s on bus %s\n", type_name, cap.card, cap.bus_info);
 
-    v4l2_dev.device_type      = DEVICE_TYPE_UVC;
-    v4l2_dev.device_type_name = type_name;
-    v4l2_dev.buffer_type      = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    v4l2_dev.memory_type      = V4L2_MEMORY_MMAP;
-    v4l2_dev.nbufs            = nbufs;
+    pipeline->v4l2_dev.device_type      = DEVICE_TYPE_UVC;
+    pipeline->v4l2_dev.device_type_name = type_name;
+    pipeline->v4l2_dev.buffer_type      = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    pipeline->v4l2_dev.memory_type      = V4L2_MEMORY_MMAP;
+    pipeline->v4l2_dev.nbufs            = nbufs;
     return 1;
 
 err:
-    close(v4l2_dev.fd);
-    v4l2_dev.fd = -1;
+    close(pipeline->v4l2_dev.fd);
+    pipeline->v4l2_dev.fd = -1;
     return -EINVAL;
 }
 
-static int uvc_open( char * devname, unsigned int nbufs)
+static int uvc_open(struct v4l2_device * dev, unsigned int index, char * devname, unsigned int nbufs)
 {
+    static const char * type_names[UVC_OUTPUT_MAX] = {
+        "DEVICE_UVC", "DEVICE_UVC1", "DEVICE_UVC2", "DEVICE_UVC3"
+    };
     struct v4l2_capability cap;
-    const char * type_name = "DEVICE_UVC";
+    const char * type_name = type_names[index];
 
-    printf("%s: Opening %s device\n", type_name, devname);
+    log_info("%s: Opening %s device\n", type_name, devname);
 
-    uvc_dev.fd = open(devname, O_RDWR | O_NONBLOCK, 0);
-    if (uvc_dev.fd == -1) {
-        printf("%s: Device open failed: %s (%d).\n", type_name, strerror(errno), errno);
+    dev->fd = open(devname, O_RDWR | O_NONBLOCK, 0);
+    if (dev->fd == -1) {
+        log_error("%s: Device open failed: %s (%d).\n", type_name, strerror(errno), errno);
         return -EINVAL;
     }
 
-    if (ioctl(uvc_dev.fd, VIDIOC_QUERYCAP, &cap) < 0) {
-        printf("%s: VIDIOC_QUERYCAP failed: %s (%d).\n", type_name, strerror(errno), errno);
+    if (ioctl(dev->fd, VIDIOC_QUERYCAP, &cap) < 0) {
+        log_error("%s: VIDIOC_QUERYCAP failed: %s (%d).\n", type_name, strerror(errno), errno);
         goto err;
     }
 
     if (!(cap.capabilities & V4L2_CAP_VIDEO_OUTPUT)) {
-        printf("%s: %s is no video output device\n", type_name, devname);
+        log_error("%s: %s is no video output device\n", type_name, devname);
         goto err;
     }
 
-    printf("%s: Device is %s on bus %s\n", type_name, cap.card, cap.bus_info);
+    log_info("%s: Device is %s on bus %s\n", type_name, cap.card, cap.bus_info);
 
-    uvc_dev.device_type      = DEVICE_TYPE_UVC;
-    uvc_dev.device_type_name = type_name;
-    uvc_dev.buffer_type      = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-    uvc_dev.memory_type      = V4L2_MEMORY_USERPTR;
-    uvc_dev.nbufs            = nbufs;
+    dev->device_type      = DEVICE_TYPE_UVC;
+    dev->device_type_name = type_name;
+    dev->buffer_type      = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    dev->memory_type      = V4L2_MEMORY_USERPTR;
+    dev->nbufs            = nbufs;
+    dev->index            = index;
     return 1;
 
 err:
-    close(uvc_dev.fd);
-    uvc_dev.fd = -1;
+    close(dev->fd);
+    dev->fd = -1;
     return -EINVAL;
 }
 
 static void fb_show_info()
 {
-    printf("FB: Resolution: %dx%d\n", fb_dev.fb_width, fb_dev.fb_height);
-    printf("FB: Bits per pixel: %d\n", fb_dev.fb_bpp);
-    printf("FB: Line length: %d\n", fb_dev.fb_line_length);
-    printf("FB: Memory size: %d\n", fb_dev.fb_mem_size);
+    log_info("FB: Resolution: %dx%d\n", pipeline->fb_dev.fb_xres, pipeline->fb_dev.fb_yres);
+    log_info("FB: Bits per pixel: %d\n", pipeline->fb_dev.fb_bpp);
+    log_info("FB: Line length: %d\n", pipeline->fb_dev.fb_line_length);
+    log_info("FB: Memory size: %d\n", pipeline->fb_dev.fb_mem_size);
+    log_info("FB: Streamed area: %dx%d+%d+%d\n", pipeline->fb_dev.fb_width, pipeline->fb_dev.fb_height,
+        pipeline->fb_dev.fb_crop_x, pipeline->fb_dev.fb_crop_y);
 }
 
 static int fb_get_settings()
@@ -372,38 +1037,86 @@ static int fb_get_settings()
     struct fb_var_screeninfo fb_info;
     struct fb_fix_screeninfo mode_info;
 
-    if (ioctl(fb_dev.fd, FBIOGET_VSCREENINFO, &fb_info) < 0) {
-        printf("FB: Can't get framebuffer info: %s (%d).\n", strerror(errno), errno);
+    if (ioctl(pipeline->fb_dev.fd, FBIOGET_VSCREENINFO, &fb_info) < 0) {
+        log_error("FB: Can't get framebuffer info: %s (%d).\n", strerror(errno), errno);
         return -EINVAL;
     }
 
-    if (ioctl(fb_dev.fd, FBIOGET_FSCREENINFO, &mode_info)) {
-        printf("FB: Can't get framebuffer screen info: %s (%d).\n", strerror(errno), errno);
+    if (ioctl(pipeline->fb_dev.fd, FBIOGET_FSCREENINFO, &mode_info)) {
+        log_error("FB: Can't get framebuffer screen info: %s (%d).\n", strerror(errno), errno);
         return -EINVAL;
     }
 
-    fb_dev.fb_screen_size = fb_info.xres * fb_info.yres * fb_info.bits_per_pixel / 8;
-    fb_dev.fb_mem_size    = mode_info.smem_len;
-    fb_dev.fb_bpp         = fb_info.bits_per_pixel;
-    fb_dev.fb_line_length = mode_info.line_length;
-    fb_dev.fb_width       = fb_info.xres;
-    fb_dev.fb_height      = fb_info.yres;
+    pipeline->fb_dev.fb_screen_size = fb_info.xres * fb_info.yres * fb_info.bits_per_pixel / 8;
+    pipeline->fb_dev.fb_mem_size    = mode_info.smem_len;
+    pipeline->fb_dev.fb_bpp         = fb_info.bits_per_pixel;
+    pipeline->fb_dev.fb_line_length = mode_info.line_length;
+    pipeline->fb_dev.fb_xres        = fb_info.xres;
+    pipeline->fb_dev.fb_yres        = fb_info.yres;
+    pipeline->fb_dev.fb_xoffset     = fb_info.xoffset;
+    pipeline->fb_dev.fb_yoffset     = fb_info.yoffset;
+
+    if (!pipeline->fb_dev.fb_line_length) {
+        pipeline->fb_dev.fb_line_length = fb_info.xres_virtual * fb_info.bits_per_pixel / 8;
+    }
+
+    /* Stream the whole visible screen unless a crop rectangle is set. */
+    pipeline->fb_dev.fb_crop_x = pipeline->settings.fb_crop_x;
+    pipeline->fb_dev.fb_crop_y = pipeline->settings.fb_crop_y;
+    pipeline->fb_dev.fb_width  = (pipeline->settings.fb_crop_width) ? pipeline->settings.fb_crop_width : fb_info.xres & ~1U;
+    pipeline->fb_dev.fb_height = (pipeline->settings.fb_crop_height) ? pipeline->settings.fb_crop_height : fb_info.yres;
 
     fb_show_info();
+
+    if (pipeline->fb_dev.fb_crop_x + pipeline->fb_dev.fb_width > pipeline->fb_dev.fb_xres ||
+        pipeline->fb_dev.fb_crop_y + pipeline->fb_dev.fb_height > pipeline->fb_dev.fb_yres
+    ) {
+        log_error("FB: Crop rectangle is outside of the screen\n");
+        return -EINVAL;
+    }
     return 1;
 }
 
+/*
+ * Follow panning of the virtual resolution, e.g. double buffering by page
+ * flipping, and return the first pixel of the streamed area.
+ */
+static const uint8_t * fb_frame_origin()
+{
+    struct fb_var_screeninfo fb_info;
+    unsigned int bytes_pp = pipeline->fb_dev.fb_bpp / 8;
+    unsigned int x;
+    unsigned int y;
+
+    if (ioctl(pipeline->fb_dev.fd, FBIOGET_VSCREENINFO, &fb_info) == 0) {
+        x = fb_info.xoffset + pipeline->fb_dev.fb_crop_x;
+        y = fb_info.yoffset + pipeline->fb_dev.fb_crop_y;
+
+        if ((unsigned long long) (y + pipeline->fb_dev.fb_height - 1) * pipeline->fb_dev.fb_line_length +
+            (x + pipeline->fb_dev.fb_width) * bytes_pp <= pipeline->fb_dev.fb_mem_size
+        ) {
+            pipeline->fb_dev.fb_xoffset = fb_info.xoffset;
+            pipeline->fb_dev.fb_yoffset = fb_info.yoffset;
+        }
+    }
+
+    x = pipeline->fb_dev.fb_xoffset + pipeline->fb_dev.fb_crop_x;
+    y = pipeline->fb_dev.fb_yoffset + pipeline->fb_dev.fb_crop_y;
+
+    return (const uint8_t *) pipeline->fb_dev.fb_memory + y * pipeline->fb_dev.fb_line_length + x * bytes_pp;
+}
+
 static int fb_open(char * devname)
 {
-    printf("FB: Opening %s device\n", devname);
+    log_info("FB: Opening %s device\n", devname);
 
-    fb_dev.fd = open(devname, O_RDWR);
-    if (fb_dev.fd < 0) {
-        printf("FB: Device open failed: %s (%d).\n", strerror(errno), errno);
+    pipeline->fb_dev.fd = open(devname, O_RDWR);
+    if (pipeline->fb_dev.fd < 0) {
+        log_error("FB: Device open failed: %s (%d).\n", strerror(errno), errno);
         goto err;
     }
 
-    fb_dev.device_type = DEVICE_TYPE_FRAMEBUFFER;
+    pipeline->fb_dev.device_type = DEVICE_TYPE_FRAMEBUFFER;
 
     if (fb_get_settings() < 0) {
         goto err;
@@ -412,22 +1125,22 @@ static int fb_open(char * devname)
     return 1;
 
 err:
-    close(fb_dev.fd);
-    fb_dev.fd = -1;
+    close(pipeline->fb_dev.fd);
+    pipeline->fb_dev.fd = -1;
     return -EINVAL;
 }
 
 static int fb_mmap_open() 
 {
-    fb_dev.fb_memory = mmap(0,
-        fb_dev.fb_mem_size, PROT_READ | PROT_WRITE,
+    pipeline->fb_dev.fb_memory = mmap(0,
+        pipeline->fb_dev.fb_mem_size, PROT_READ | PROT_WRITE,
         MAP_SHARED,
-        fb_dev.fd,
+        pipeline->fb_dev.fd,
         0
     );
-    if (fb_dev.fb_memory == MAP_FAILED) {
-        printf("FB: Can't get framebuffer mmap: %s (%d).\n", strerror(errno), errno);
-        fb_dev.fb_memory = NULL;
+    if (pipeline->fb_dev.fb_memory == MAP_FAILED) {
+        log_error("FB: Can't get framebuffer mmap: %s (%d).\n", strerror(errno), errno);
+        pipeline->fb_dev.fb_memory = NULL;
         return -EINVAL;
     }
 
@@ -436,9 +1149,9 @@ static int fb_mmap_open()
 
 static void fb_mmap_close() 
 {
-    if (fb_dev.fb_memory) {
-        munmap(fb_dev.fb_memory, 0);
-        fb_dev.fb_memory = NULL;
+    if (pipeline->fb_dev.fb_memory) {
+        munmap(pipeline->fb_dev.fb_memory, pipeline->fb_dev.fb_mem_size);
+        pipeline->fb_dev.fb_memory = NULL;
     }
 }
 
@@ -446,36 +1159,91 @@ static void fb_mmap_close()
  * V4L2 streaming related
  */
 
+static void v4l2_unexport_bufs(struct v4l2_device * dev)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->nbufs; ++i) {
+        if (dev->mem[i].dmabuf_fd >= 0) {
+            close(dev->mem[i].dmabuf_fd);
+            dev->mem[i].dmabuf_fd = -1;
+        }
+    }
+}
+
+/* Export every mapped buffer as a DMABUF file descriptor for zero-copy sharing */
+static int v4l2_export_bufs(struct v4l2_device * dev)
+{
+    struct v4l2_exportbuffer expbuf;
+    unsigned int i;
+
+    /* Buffers kept from the previous streaming session are still exported. */
+    if (dev->nbufs && dev->mem[0].dmabuf_fd >= 0) {
+        return 0;
+    }
+
+    for (i = 0; i < dev->nbufs; ++i) {
+        CLEAR(expbuf);
+        expbuf.type  = dev->buffer_type;
+        expbuf.index = i;
+        expbuf.flags = O_RDWR | O_CLOEXEC;
+
+        if (ioctl(dev->fd, VIDIOC_EXPBUF, &expbuf) < 0) {
+            log_error("%s: VIDIOC_EXPBUF failed for buf %u: %s (%d).\n",
+                dev->device_type_name, i, strerror(errno), errno);
+            v4l2_unexport_bufs(dev);
+            return -EINVAL;
+        }
+
+        dev->mem[i].dmabuf_fd = expbuf.fd;
+    }
+
+    log_info("%s: %u buffers exported as DMABUF\n", dev->device_type_name, dev->nbufs);
+    return 0;
+}
+
 static void v4l2_uninit_device()
 {
     unsigned int i;
-    if (!v4l2_dev.mem) {
+    if (!pipeline->v4l2_dev.mem) {
         return;
     }
-    printf("%s: Uninit device\n", v4l2_dev.device_type_name);
+    log_info("%s: Uninit device\n", pipeline->v4l2_dev.device_type_name);
 
-    for (i = 0; i < v4l2_dev.nbufs; ++i) {
-        if (munmap(v4l2_dev.mem[i].start, v4l2_dev.mem[i].length) < 0) {
-            printf("%s: munmap failed\n", v4l2_dev.device_type_name);
+    v4l2_unexport_bufs(&pipeline->v4l2_dev);
+
+    for (i = 0; i < pipeline->v4l2_dev.nbufs; ++i) {
+        if (munmap(pipeline->v4l2_dev.mem[i].start, pipeline->v4l2_dev.mem[i].length) < 0) {
+            log_error("%s: munmap failed\n", pipeline->v4l2_dev.device_type_name);
             return;
         }
     }
-    free(v4l2_dev.mem);
-    v4l2_dev.mem = NULL;
+    free(pipeline->v4l2_dev.mem);
+    pipeline->v4l2_dev.mem = NULL;
 }
 
-static void uvc_uninit_device()
+static void uvc_uninit_device(struct v4l2_device * dev)
 {
     unsigned int i;
-    if (settings.source_device == DEVICE_TYPE_FRAMEBUFFER && uvc_dev.dummy_buf) {
-        printf("%s: Uninit device\n", uvc_dev.device_type_name);
 
-        for (i = 0; i < uvc_dev.nbufs; ++i) {
-            free(uvc_dev.dummy_buf[i].start);
-            uvc_dev.dummy_buf[i].start = NULL;
+    if (dev->index == 0) {
+        free(pipeline->fb_dev.fb_yuyv.start);
+        pipeline->fb_dev.fb_yuyv.start = NULL;
+        free(pipeline->fb_dev.fb_yuyv.tile_hash);
+        pipeline->fb_dev.fb_yuyv.tile_hash = NULL;
+    }
+
+    if (dev->dummy_buf) {
+        log_info("%s: Uninit device\n", dev->device_type_name);
+
+        for (i = 0; i < dev->nbufs; ++i) {
+            free(dev->dummy_buf[i].start);
+            dev->dummy_buf[i].start = NULL;
+            free(dev->dummy_buf[i].tile_hash);
+            dev->dummy_buf[i].tile_hash = NULL;
         }
-        free(uvc_dev.dummy_buf);
-        uvc_dev.dummy_buf = NULL;
+        free(dev->dummy_buf);
+        dev->dummy_buf = NULL;
     }
 }
 
@@ -487,22 +1255,22 @@ static int v4l2_video_stream_control(struct v4l2_device * dev, enum video_stream
     if (action == STREAM_ON) {
         ret = ioctl(dev->fd, VIDIOC_STREAMON, &type);
         if (ret < 0) {
-            printf("%s: STREAM ON failed: %s (%d).\n", dev->device_type_name, strerror(errno), errno);
+            log_error("%s: STREAM ON failed: %s (%d).\n", dev->device_type_name, strerror(errno), errno);
             return ret;
         }
 
-        printf("%s: STREAM ON success\n", dev->device_type_name);
+        log_info("%s: STREAM ON success\n", dev->device_type_name);
         dev->is_streaming = 1;
-        uvc_shutdown_requested = false;
+        dev->uvc_shutdown_requested = false;
 
     } else if (dev->is_streaming) {
         ret = ioctl(dev->fd, VIDIOC_STREAMOFF, &type);
         if (ret < 0) {
-            printf("%s: STREAM OFF failed: %s (%d).\n", dev->device_type_name, strerror(errno), errno);
+            log_error("%s: STREAM OFF failed: %s (%d).\n", dev->device_type_name, strerror(errno), errno);
             return ret;
         }
 
-        printf("%s: STREAM OFF success\n", dev->device_type_name);
+        log_info("%s: STREAM OFF success\n", dev->device_type_name);
         dev->is_streaming = 0;
     }
     return 0;
@@ -510,12 +1278,29 @@ static int v4l2_video_stream_control(struct v4l2_device * dev, enum video_stream
 
 static int v4l2_video_stream(enum video_stream_action action)
 {
-    return v4l2_video_stream_control(&v4l2_dev, action);
+    return v4l2_video_stream_control(&pipeline->v4l2_dev, action);
+}
+
+static int uvc_video_stream(struct v4l2_device * dev, enum video_stream_action action)
+{
+    return v4l2_video_stream_control(dev, action);
 }
 
-static int uvc_video_stream(enum video_stream_action action)
+static const char * v4l2_memory_type_name(unsigned int memory_type)
 {
-    return v4l2_video_stream_control(&uvc_dev, action);
+    switch (memory_type) {
+    case V4L2_MEMORY_MMAP:
+        return "memory mapping";
+
+    case V4L2_MEMORY_USERPTR:
+        return "user pointer i/o";
+
+    case V4L2_MEMORY_DMABUF:
+        return "dmabuf i/o";
+
+    default:
+        return "unknown i/o";
+    }
 }
 
 static int v4l2_init_buffers(struct v4l2_device * dev, struct v4l2_requestbuffers * req,
@@ -528,12 +1313,12 @@ static int v4l2_init_buffers(struct v4l2_device * dev, struct v4l2_requestbuffer
 
     ret = ioctl(dev->fd, VIDIOC_REQBUFS, req);
     if (ret < 0) {
-        if (ret == -EINVAL) {
-            printf("%s: Does not support %s\n", dev->device_type_name,
-                (dev->memory_type == V4L2_MEMORY_USERPTR) ? "user pointer i/o" : "memory mapping");
+        if (errno == EINVAL) {
+            log_error("%s: Does not support %s\n", dev->device_type_name,
+                v4l2_memory_type_name(dev->memory_type));
 
         } else {
-            printf("%s: VIDIOC_REQBUFS error: %s (%d).\n",
+            log_error("%s: VIDIOC_REQBUFS error: %s (%d).\n",
                 dev->device_type_name, strerror(errno), errno);
 
         }
@@ -542,6 +1327,22 @@ static int v4l2_init_buffers(struct v4l2_device * dev, struct v4l2_requestbuffer
     return count;
 }
 
+/* Touch every page of a frame buffer so that streaming never waits for a page fault */
+static void buffer_prefault(void * start, size_t length)
+{
+    volatile uint8_t * page = start;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t offset;
+
+    if (!pipeline->settings.mlock || !start) {
+        return;
+    }
+
+    for (offset = 0; offset < length; offset += page_size) {
+        page[offset] = 0;
+    }
+}
+
 static int v4l2_reqbufs_mmap(struct v4l2_device * dev, struct v4l2_requestbuffers req)
 {
     int ret;
@@ -550,7 +1351,7 @@ static int v4l2_reqbufs_mmap(struct v4l2_device * dev, struct v4l2_requestbuffer
     /* Map the buffers. */
     dev->mem = calloc(req.count, sizeof dev->mem[0]);
     if (!dev->mem) {
-        printf("%s: Out of memory\n", dev->device_type_name);
+        log_error("%s: Out of memory\n", dev->device_type_name);
         ret = -ENOMEM;
         goto err;
     }
@@ -558,13 +1359,14 @@ static int v4l2_reqbufs_mmap(struct v4l2_device * dev, struct v4l2_requestbuffer
     for (i = 0; i < req.count; ++i) {
         CLEAR(dev->mem[i].buf);
 
+        dev->mem[i].dmabuf_fd  = -1;
         dev->mem[i].buf.type   = dev->buffer_type;
         dev->mem[i].buf.memory = V4L2_MEMORY_MMAP;
         dev->mem[i].buf.index  = i;
 
         ret = ioctl(dev->fd, VIDIOC_QUERYBUF, &(dev->mem[i].buf));
         if (ret < 0) {
-            printf("%s: VIDIOC_QUERYBUF failed for buf %d: %s (%d).\n",
+            log_error("%s: VIDIOC_QUERYBUF failed for buf %d: %s (%d).\n",
                 dev->device_type_name, i, strerror(errno), errno);
 
             ret = -EINVAL;
@@ -580,7 +1382,7 @@ static int v4l2_reqbufs_mmap(struct v4l2_device * dev, struct v4l2_requestbuffer
             );
 
         if (MAP_FAILED == dev->mem[i].start) {
-            printf("%s: Unable to map buffer %u: %s (%d).\n",
+            log_error("%s: Unable to map buffer %u: %s (%d).\n",
                 dev->device_type_name, i, strerror(errno), errno);
 
             dev->mem[i].length = 0;
@@ -589,7 +1391,8 @@ static int v4l2_reqbufs_mmap(struct v4l2_device * dev, struct v4l2_requestbuffer
         }
 
         dev->mem[i].length = dev->mem[i].buf.length;
-        printf("%s: Buffer %u mapped at address %p, length %d.\n",
+        buffer_prefault(dev->mem[i].start, dev->mem[i].length);
+        log_debug("%s: Buffer %u mapped at address %p, length %d.\n",
             dev->device_type_name, i, dev->mem[i].start, dev->mem[i].length);
     }
 
@@ -597,6 +1400,7 @@ static int v4l2_reqbufs_mmap(struct v4l2_device * dev, struct v4l2_requestbuffer
 
 err_free:
     free(dev->mem);
+    dev->mem = NULL;
 err:
     return ret;
 }
@@ -604,30 +1408,78 @@ err:
 static int v4l2_reqbufs_userptr(struct v4l2_device * dev, struct v4l2_requestbuffers req)
 {
     unsigned int payload_size;
+    unsigned int ntiles = 0;
     unsigned int i;
 
-    if (dev->device_type == DEVICE_TYPE_UVC && settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
-        /* Allocate buffers to hold dummy data pattern. */
-        dev->dummy_buf = calloc(req.count, sizeof dev->dummy_buf[0]);
-        if (!dev->dummy_buf) {
-            printf("%s: Out of memory\n", dev->device_type_name);
-            return -ENOMEM;
+    if (dev->device_type != DEVICE_TYPE_UVC) {
+        return 0;
+    }
+
+    if (pipeline->settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
+        payload_size = pipeline->fb_dev.fb_width * pipeline->fb_dev.fb_height * 2;
+
+        pipeline->fb_dev.fb_tiles_x = (pipeline->fb_dev.fb_width + FB_TILE_WIDTH - 1) / FB_TILE_WIDTH;
+        pipeline->fb_dev.fb_tiles_y = (pipeline->fb_dev.fb_height + FB_TILE_HEIGHT - 1) / FB_TILE_HEIGHT;
+        ntiles = pipeline->fb_dev.fb_tiles_x * pipeline->fb_dev.fb_tiles_y;
+
+        if (pipeline->jpeg.active) {
+            /* JPEG frames are converted into a YUYV staging frame first. */
+            pipeline->fb_dev.fb_yuyv.length = payload_size;
+            pipeline->fb_dev.fb_yuyv.start = malloc(payload_size);
+            pipeline->fb_dev.fb_yuyv.tile_hash = calloc(ntiles, sizeof pipeline->fb_dev.fb_yuyv.tile_hash[0]);
+            pipeline->fb_dev.fb_yuyv.tile_hash_valid = false;
+            if (!pipeline->fb_dev.fb_yuyv.start || !pipeline->fb_dev.fb_yuyv.tile_hash) {
+                log_error("%s: Out of memory\n", dev->device_type_name);
+                return -ENOMEM;
+            }
+            buffer_prefault(pipeline->fb_dev.fb_yuyv.start, payload_size);
         }
 
-        payload_size = fb_dev.fb_width * fb_dev.fb_height * 2;
+    } else if (pipeline->format_plan.convert) {
+        /* Converted frames can't borrow the capture buffers. */
+        payload_size = dev->pix.sizeimage;
 
-        for (i = 0; i < req.count; ++i) {
-            dev->dummy_buf[i].length = payload_size;
-            dev->dummy_buf[i].start  = malloc(payload_size);
-            if (!dev->dummy_buf[i].start) {
-                printf("%s: Out of memory\n", dev->device_type_name);
+        /* The staging frame is shared by every output and kept while capture runs. */
+        if (pipeline->format_plan.scale && pipeline->jpeg.active && !pipeline->format_plan.scaled.start) {
+            pipeline->format_plan.scaled.length = dev->pix.width * dev->pix.height * 2;
+            pipeline->format_plan.scaled.start = malloc(pipeline->format_plan.scaled.length);
+            if (!pipeline->format_plan.scaled.start) {
+                log_error("%s: Out of memory\n", dev->device_type_name);
                 return -ENOMEM;
             }
+            buffer_prefault(pipeline->format_plan.scaled.start, pipeline->format_plan.scaled.length);
         }
 
-        dev->mem = dev->dummy_buf;
+    } else {
+        return 0;
+    }
+
+    /* Allocate buffers to hold dummy data pattern. */
+    dev->dummy_buf = calloc(req.count, sizeof dev->dummy_buf[0]);
+    if (!dev->dummy_buf) {
+        log_error("%s: Out of memory\n", dev->device_type_name);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < req.count; ++i) {
+        dev->dummy_buf[i].length = payload_size;
+        dev->dummy_buf[i].start  = malloc(payload_size);
+        if (!dev->dummy_buf[i].start) {
+            log_error("%s: Out of memory\n", dev->device_type_name);
+            return -ENOMEM;
+        }
+        buffer_prefault(dev->dummy_buf[i].start, payload_size);
 
+        if (ntiles) {
+            dev->dummy_buf[i].tile_hash = calloc(ntiles, sizeof dev->dummy_buf[i].tile_hash[0]);
+            if (!dev->dummy_buf[i].tile_hash) {
+                log_error("%s: Out of memory\n", dev->device_type_name);
+                return -ENOMEM;
+            }
+        }
     }
+
+    dev->mem = dev->dummy_buf;
     return 0;
 }
 
@@ -651,7 +1503,7 @@ static int v4l2_reqbufs(struct v4l2_device * dev, int nbufs)
 
     if (dev->memory_type == V4L2_MEMORY_MMAP) {
         if (req.count < 2) {
-            printf("%s: Insufficient buffer memory.\n", dev->device_type_name);
+            log_error("%s: Insufficient buffer memory.\n", dev->device_type_name);
             return -EINVAL;
         }
 
@@ -661,9 +1513,11 @@ static int v4l2_reqbufs(struct v4l2_device * dev, int nbufs)
         }
     }
 
-    if (dev->memory_type == V4L2_MEMORY_USERPTR && settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
+    if (dev->memory_type == V4L2_MEMORY_USERPTR &&
+        (pipeline->settings.source_device == DEVICE_TYPE_FRAMEBUFFER || pipeline->format_plan.convert)
+    ) {
         if (req.count < 2) {
-            printf("%s: Insufficient buffer memory.\n", dev->device_type_name);
+            log_error("%s: Insufficient buffer memory.\n", dev->device_type_name);
             return -EINVAL;
         }
 
@@ -674,19 +1528,31 @@ static int v4l2_reqbufs(struct v4l2_device * dev, int nbufs)
     }
 
     dev->nbufs = req.count;
-    printf("%s: %u buffers allocated.\n", dev->device_type_name, req.count);
+    log_info("%s: %u buffers allocated.\n", dev->device_type_name, req.count);
 
     return ret;
 }
 
 static int v4l2_request_bufs(int nbufs)
 {
-    return v4l2_reqbufs(&v4l2_dev, nbufs);
+    return v4l2_reqbufs(&pipeline->v4l2_dev, nbufs);
+}
+
+static int uvc_request_bufs(struct v4l2_device * dev, int nbufs)
+{
+    return v4l2_reqbufs(dev, nbufs);
 }
 
-static int uvc_request_bufs(int nbufs)
+/* Unmap and free the capture buffers, they are otherwise reused by the next STREAMON */
+static void v4l2_release_bufs()
 {
-    return v4l2_reqbufs(&uvc_dev, nbufs);
+    pipeline->v4l2_dev.bufs_cached = false;
+    if (!pipeline->v4l2_dev.mem) {
+        return;
+    }
+
+    v4l2_uninit_device();
+    v4l2_request_bufs(0);
 }
 
 static int uvc_video_qbuf()
@@ -694,7 +1560,7 @@ static int uvc_video_qbuf()
     unsigned int i;
     int ret;
 
-    if (settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
+    if (pipeline->settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
         for (i = 0; i < uvc_dev.nbufs; ++i) {
             struct v4l2_buffer buf;
 
@@ -707,7 +1573,7 @@ static int uvc_video_qbuf()
 
             ret = ioctl(uvc_dev.fd, VIDIOC_QBUF, &buf);
             if (ret < 0) {
-                printf("UVC: VIDIOC_QBUF failed : %s (%d).\n", strerror(errno), errno);
+                log_error("UVC: VIDIOC_QBUF failed : %s (%d).\n", strerror(errno), errno);
                 return ret;
             }
 
@@ -731,527 +1597,3880 @@ static int v4l2_qbuf_mmap(struct v4l2_device * dev)
 
         ret = ioctl(dev->fd, VIDIOC_QBUF, &(dev->mem[i].buf));
         if (ret < 0) {
-            printf("%s: VIDIOC_QBUF failed : %s (%d).\n",
+            log_error("%s: VIDIOC_QBUF failed : %s (%d).\n",
                 dev->device_type_name, strerror(errno), errno);
 
             return ret;
         }
         dev->qbuf_count++;
+        pipeline->buffer_pool.state[i] = BUFFER_STATE_CAPTURE;
     }
     return 0;
 }
 
-static void v4l2_uvc_video_process()
-{
-    struct v4l2_buffer vbuf;
-    struct v4l2_buffer ubuf;
+/* ---------------------------------------------------------------------------
+ * RGB to YUYV conversion kernels
+ *
+ * Every kernel converts a run of pixel pairs and must produce output that
+ * is bit-identical to the scalar rgb2yvyu() reference. The grayscale
+ * kernels compute luma only and write neutral chroma.
+ */
 
-    if (uvc_dev.is_streaming && v4l2_dev.dqbuf_count >= v4l2_dev.qbuf_count) {
-        return;
-    }
+#define rgb2y(r, g, b) ((uint8_t)((r >> 2) + (g >> 1) + (b >> 3) + 16))
+
+#define RGB2YUYV_SCALAR(name, bytes_pp, load)                                   \
+static void rgb2yuyv_scalar_##name(const uint8_t * src, uint8_t * dst,          \
+    unsigned int pairs)                                                         \
+{                                                                               \
+    uint8_t r1, g1, b1;                                                         \
+    uint8_t r2, g2, b2;                                                         \
+    unsigned int yvyu;                                                          \
+                                                                                \
+    while (pairs--) {                                                           \
+        load(src, r1, g1, b1);                                                  \
+        load(src + bytes_pp, r2, g2, b2);                                       \
+        yvyu = rgb2yvyu(r1, g1, b1, r2, g2, b2);                                \
+        memcpy(dst, &yvyu, 4);                                                  \
+        src += 2 * bytes_pp;                                                    \
+        dst += 4;                                                               \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+static void rgb2gray_scalar_##name(const uint8_t * src, uint8_t * dst,          \
+    unsigned int pairs)                                                         \
+{                                                                               \
+    uint8_t r, g, b;                                                            \
+                                                                                \
+    for (pairs *= 2; pairs--; src += bytes_pp, dst += 2) {                      \
+        load(src, r, g, b);                                                     \
+        dst[0] = rgb2y(r, g, b);                                                \
+        dst[1] = 0x80;                                                          \
+    }                                                                           \
+}
 
-    /* Dequeue spent buffer from V4L2 domain. */
-    CLEAR(vbuf);
-    vbuf.type   = v4l2_dev.buffer_type;
-    vbuf.memory = v4l2_dev.memory_type;
+#define load_rgb565(p, r, g, b)                                                 \
+    do {                                                                        \
+        b = ((p)[0] & 0x1f) << 3;                                               \
+        g = ((((p)[1] & 0x7) << 3) | ((p)[0] & 0xE0) >> 5) << 2;                \
+        r = ((p)[1] & 0xF8);                                                    \
+    } while (0)
 
-    if (ioctl(v4l2_dev.fd, VIDIOC_DQBUF, &vbuf) < 0) {
-        printf("%s: Unable to dequeue buffer: %s (%d).\n",
-            v4l2_dev.device_type_name, strerror(errno), errno);
-        return;
-    }
+#define load_rgb(p, r, g, b)                                                    \
+    do {                                                                        \
+        r = (p)[0];                                                             \
+        g = (p)[1];                                                             \
+        b = (p)[2];                                                             \
+    } while (0)
 
-    v4l2_dev.dqbuf_count++;
+RGB2YUYV_SCALAR(16, 2, load_rgb565)
+RGB2YUYV_SCALAR(24, 3, load_rgb)
+RGB2YUYV_SCALAR(32, 4, load_rgb)
 
-    /* Queue video buffer to UVC domain. */
-    CLEAR(ubuf);
-    ubuf.type      = uvc_dev.buffer_type;
-    ubuf.memory    = uvc_dev.memory_type;
-    ubuf.m.userptr = (unsigned long) v4l2_dev.mem[vbuf.index].start;
-    ubuf.length    = v4l2_dev.mem[vbuf.index].length;
-    ubuf.index     = vbuf.index;
-    ubuf.bytesused = vbuf.bytesused;
-
-    if (ioctl(uvc_dev.fd, VIDIOC_QBUF, &ubuf) < 0) {
-        /* Check for a USB disconnect/shutdown event. */
-        if (errno == ENODEV) {
-            uvc_shutdown_requested = true;
-            printf("UVC: Possible USB shutdown requested from Host, seen during VIDIOC_QBUF\n");
-        }
-        return;
+#if defined(__x86_64__) || defined(__i386__)
+
+/*
+ * r, g and b hold one pixel per 16 bit lane, so every 32 bit lane is one
+ * pixel pair. Returns the YVYU dword of each pair, the same integer math
+ * as rgb2yvyu() with the mult_* tables unrolled, or Y with neutral
+ * chroma for every pixel when gray is set.
+ */
+__attribute__((target("sse2"), always_inline))
+static inline __m128i rgb2yuyv_sse2_pairs(__m128i r, __m128i g, __m128i b, bool gray)
+{
+    const __m128i low = _mm_set1_epi32(0x0000FFFF);
+    __m128i y;
+    __m128i r12;
+    __m128i g12;
+    __m128i b12;
+    __m128i u;
+    __m128i v;
+
+    y = _mm_add_epi16(_mm_add_epi16(_mm_srli_epi16(r, 2), _mm_srli_epi16(g, 1)),
+        _mm_add_epi16(_mm_srli_epi16(b, 3), _mm_set1_epi16(16)));
+
+    if (gray) {
+        return _mm_or_si128(y, _mm_set1_epi16(0x8000));
     }
 
-    uvc_dev.qbuf_count++;
+    r12 = _mm_srli_epi32(_mm_add_epi32(_mm_and_si128(r, low), _mm_srli_epi32(r, 16)), 1);
+    g12 = _mm_srli_epi32(_mm_add_epi32(_mm_and_si128(g, low), _mm_srli_epi32(g, 16)), 1);
+    b12 = _mm_srli_epi32(_mm_add_epi32(_mm_and_si128(b, low), _mm_srli_epi32(b, 16)), 1);
 
-    if (!uvc_dev.is_streaming) {
-        uvc_video_stream(STREAM_ON);
-        settings.blink_on_startup = 0;
-        streaming_status_value(uvc_dev.is_streaming);
-    }
+    v = _mm_sub_epi16(_mm_mullo_epi16(r12, _mm_set1_epi32(112)), _mm_mullo_epi16(g12, _mm_set1_epi32(94)));
+    v = _mm_sub_epi16(v, _mm_add_epi16(_mm_mullo_epi16(b12, _mm_set1_epi32(18)), _mm_set1_epi32(128)));
+    v = _mm_add_epi16(_mm_srai_epi16(v, 8), _mm_set1_epi32(128));
+
+    u = _mm_sub_epi16(_mm_mullo_epi16(b12, _mm_set1_epi32(112)), _mm_mullo_epi16(r12, _mm_set1_epi32(38)));
+    u = _mm_sub_epi16(u, _mm_mullo_epi16(g12, _mm_set1_epi32(74)));
+    u = _mm_and_si128(_mm_add_epi16(_mm_srai_epi16(u, 8), _mm_set1_epi32(128)), _mm_set1_epi32(0xFF));
+
+    return _mm_or_si128(_mm_or_si128(y, _mm_slli_epi32(v, 8)), _mm_slli_epi32(u, 24));
 }
 
-/* ---------------------------------------------------------------------------
- * V4L2 generic stuff
- */
+/* Two vectors of RGBX dwords (8 pixels) to 4 YVYU pairs */
+__attribute__((target("sse2"), always_inline))
+static inline __m128i rgb2yuyv_sse2_dwords(__m128i p0, __m128i p1, bool gray)
+{
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    __m128i r = _mm_packs_epi32(_mm_and_si128(p0, mask), _mm_and_si128(p1, mask));
+    __m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), mask),
+        _mm_and_si128(_mm_srli_epi32(p1, 8), mask));
+    __m128i b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), mask),
+        _mm_and_si128(_mm_srli_epi32(p1, 16), mask));
+
+    return rgb2yuyv_sse2_pairs(r, g, b, gray);
+}
 
-static int v4l2_get_format(struct v4l2_device * dev)
+static inline uint32_t load_u32(const uint8_t * src)
 {
-    struct v4l2_format fmt;
-    int ret;
+    uint32_t value;
+    memcpy(&value, src, sizeof value);
+    return value;
+}
 
-    CLEAR(fmt);
-    fmt.type = dev->buffer_type;
+__attribute__((target("sse2"), always_inline))
+static inline void rgb2yuyv_sse2_16_run(const uint8_t * src, uint8_t * dst, unsigned int pairs,
+    bool gray)
+{
+    __m128i p;
+    __m128i r;
+    __m128i g;
+    __m128i b;
+
+    for (; pairs >= 4; pairs -= 4, src += 16, dst += 16) {
+        p = _mm_loadu_si128((const __m128i *) src);
+        b = _mm_slli_epi16(_mm_and_si128(p, _mm_set1_epi16(0x1F)), 3);
+        g = _mm_slli_epi16(_mm_and_si128(_mm_srli_epi16(p, 5), _mm_set1_epi16(0x3F)), 2);
+        r = _mm_and_si128(_mm_srli_epi16(p, 8), _mm_set1_epi16(0xF8));
+        _mm_storeu_si128((__m128i *) dst, rgb2yuyv_sse2_pairs(r, g, b, gray));
+    }
+    (gray) ? rgb2gray_scalar_16(src, dst, pairs) : rgb2yuyv_scalar_16(src, dst, pairs);
+}
 
-    ret = ioctl(dev->fd, VIDIOC_G_FMT, &fmt);
-    if (ret < 0) {
-        return ret;
+__attribute__((target("sse2"), always_inline))
+static inline void rgb2yuyv_sse2_24_run(const uint8_t * src, uint8_t * dst, unsigned int pairs,
+    bool gray)
+{
+    __m128i p0;
+    __m128i p1;
+
+    /* The dword loads read one byte past the 4 pairs, keep a pair in reserve. */
+    for (; pairs > 4; pairs -= 4, src += 24, dst += 16) {
+        p0 = _mm_set_epi32(load_u32(src + 9), load_u32(src + 6), load_u32(src + 3), load_u32(src));
+        p1 = _mm_set_epi32(load_u32(src + 21), load_u32(src + 18), load_u32(src + 15), load_u32(src + 12));
+        _mm_storeu_si128((__m128i *) dst, rgb2yuyv_sse2_dwords(p0, p1, gray));
     }
+    (gray) ? rgb2gray_scalar_24(src, dst, pairs) : rgb2yuyv_scalar_24(src, dst, pairs);
+}
 
-    printf("%s: Getting current format: %c%c%c%c %ux%u\n",
-        dev->device_type_name, pixfmtstr(fmt.fmt.pix.pixelformat),
-        fmt.fmt.pix.width, fmt.fmt.pix.height);
+__attribute__((target("sse2"), always_inline))
+static inline void rgb2yuyv_sse2_32_run(const uint8_t * src, uint8_t * dst, unsigned int pairs,
+    bool gray)
+{
+    __m128i p0;
+    __m128i p1;
 
-    return 0;
+    for (; pairs >= 4; pairs -= 4, src += 32, dst += 16) {
+        p0 = _mm_loadu_si128((const __m128i *) src);
+        p1 = _mm_loadu_si128((const __m128i *) (src + 16));
+        _mm_storeu_si128((__m128i *) dst, rgb2yuyv_sse2_dwords(p0, p1, gray));
+    }
+    (gray) ? rgb2gray_scalar_32(src, dst, pairs) : rgb2yuyv_scalar_32(src, dst, pairs);
 }
 
-static int v4l2_set_format(struct v4l2_device * dev, struct v4l2_format * fmt)
+/* Same lane layout as rgb2yuyv_sse2_pairs() on 256 bit vectors */
+__attribute__((target("avx2"), always_inline))
+static inline __m256i rgb2yuyv_avx2_pairs(__m256i r, __m256i g, __m256i b, bool gray)
 {
-    int ret;
-
-    ret = ioctl(dev->fd, VIDIOC_S_FMT, fmt);
-    if (ret < 0) {
-        printf("%s: Unable to set format %s (%d).\n",
-            dev->device_type_name, strerror(errno), errno);
-        return ret;
+    const __m256i low = _mm256_set1_epi32(0x0000FFFF);
+    __m256i y;
+    __m256i r12;
+    __m256i g12;
+    __m256i b12;
+    __m256i u;
+    __m256i v;
+
+    y = _mm256_add_epi16(_mm256_add_epi16(_mm256_srli_epi16(r, 2), _mm256_srli_epi16(g, 1)),
+        _mm256_add_epi16(_mm256_srli_epi16(b, 3), _mm256_set1_epi16(16)));
+
+    if (gray) {
+        return _mm256_or_si256(y, _mm256_set1_epi16(0x8000));
     }
 
-    printf("%s: Setting format to: %c%c%c%c %ux%u\n",
-        dev->device_type_name, pixfmtstr(fmt->fmt.pix.pixelformat),
-        fmt->fmt.pix.width, fmt->fmt.pix.height);
+    r12 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_and_si256(r, low), _mm256_srli_epi32(r, 16)), 1);
+    g12 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_and_si256(g, low), _mm256_srli_epi32(g, 16)), 1);
+    b12 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_and_si256(b, low), _mm256_srli_epi32(b, 16)), 1);
 
-    return 0;
+    v = _mm256_sub_epi16(_mm256_mullo_epi16(r12, _mm256_set1_epi32(112)),
+        _mm256_mullo_epi16(g12, _mm256_set1_epi32(94)));
+    v = _mm256_sub_epi16(v, _mm256_add_epi16(_mm256_mullo_epi16(b12, _mm256_set1_epi32(18)),
+        _mm256_set1_epi32(128)));
+    v = _mm256_add_epi16(_mm256_srai_epi16(v, 8), _mm256_set1_epi32(128));
+
+    u = _mm256_sub_epi16(_mm256_mullo_epi16(b12, _mm256_set1_epi32(112)),
+        _mm256_mullo_epi16(r12, _mm256_set1_epi32(38)));
+    u = _mm256_sub_epi16(u, _mm256_mullo_epi16(g12, _mm256_set1_epi32(74)));
+    u = _mm256_and_si256(_mm256_add_epi16(_mm256_srai_epi16(u, 8), _mm256_set1_epi32(128)),
+        _mm256_set1_epi32(0xFF));
+
+    return _mm256_or_si256(_mm256_or_si256(y, _mm256_slli_epi32(v, 8)), _mm256_slli_epi32(u, 24));
 }
 
-static int v4l2_apply_format(struct v4l2_device * dev, unsigned int pixelformat,
-    unsigned int width, unsigned int height)
+/* Two vectors of RGBX dwords (16 pixels) to 8 YVYU pairs */
+__attribute__((target("avx2"), always_inline))
+static inline __m256i rgb2yuyv_avx2_dwords(__m256i p0, __m256i p1, bool gray)
 {
-    struct v4l2_format fmt;
-    int ret = -EINVAL;
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    __m256i r = _mm256_packs_epi32(_mm256_and_si256(p0, mask), _mm256_and_si256(p1, mask));
+    __m256i g = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 8), mask),
+        _mm256_and_si256(_mm256_srli_epi32(p1, 8), mask));
+    __m256i b = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 16), mask),
+        _mm256_and_si256(_mm256_srli_epi32(p1, 16), mask));
+
+    /* packs works per 128 bit lane, put the pixel pairs back in order */
+    return _mm256_permute4x64_epi64(rgb2yuyv_avx2_pairs(r, g, b, gray), _MM_SHUFFLE(3, 1, 2, 0));
+}
 
-    if (dev->is_streaming || !dev->fd) {
-        return ret;
+__attribute__((target("avx2"), always_inline))
+static inline void rgb2yuyv_avx2_16_run(const uint8_t * src, uint8_t * dst, unsigned int pairs,
+    bool gray)
+{
+    __m256i p;
+    __m256i r;
+    __m256i g;
+    __m256i b;
+
+    for (; pairs >= 8; pairs -= 8, src += 32, dst += 32) {
+        p = _mm256_loadu_si256((const __m256i *) src);
+        b = _mm256_slli_epi16(_mm256_and_si256(p, _mm256_set1_epi16(0x1F)), 3);
+        g = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(p, 5), _mm256_set1_epi16(0x3F)), 2);
+        r = _mm256_and_si256(_mm256_srli_epi16(p, 8), _mm256_set1_epi16(0xF8));
+        _mm256_storeu_si256((__m256i *) dst, rgb2yuyv_avx2_pairs(r, g, b, gray));
     }
+    rgb2yuyv_sse2_16_run(src, dst, pairs, gray);
+}
 
-    CLEAR(fmt);
-    fmt.type                = dev->buffer_type;
-    fmt.fmt.pix.width       = width;
-    fmt.fmt.pix.height      = height;
-    fmt.fmt.pix.sizeimage   = get_frame_size(pixelformat, width, height);
-    fmt.fmt.pix.pixelformat = pixelformat;
-    fmt.fmt.pix.field       = V4L2_FIELD_ANY;
+/* Spread 8 packed RGB pixels (24 bytes) into RGBX dwords */
+__attribute__((target("avx2"), always_inline))
+static inline __m256i rgb2yuyv_avx2_load24(const uint8_t * src)
+{
+    const __m256i shuffle = _mm256_setr_epi8(
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    __m256i p = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) src)),
+        _mm_loadu_si128((const __m128i *) (src + 12)), 1);
+
+    return _mm256_shuffle_epi8(p, shuffle);
+}
 
-    ret = v4l2_set_format(dev, &fmt);
-    if (ret < 0) {
-        return ret;
+__attribute__((target("avx2"), always_inline))
+static inline void rgb2yuyv_avx2_24_run(const uint8_t * src, uint8_t * dst, unsigned int pairs,
+    bool gray)
+{
+    __m256i p0;
+    __m256i p1;
+
+    /* The 16 byte loads read 4 bytes past the 8 pairs, keep a pair in reserve. */
+    for (; pairs > 8; pairs -= 8, src += 48, dst += 32) {
+        p0 = rgb2yuyv_avx2_load24(src);
+        p1 = rgb2yuyv_avx2_load24(src + 24);
+        _mm256_storeu_si256((__m256i *) dst, rgb2yuyv_avx2_dwords(p0, p1, gray));
     }
+    rgb2yuyv_sse2_24_run(src, dst, pairs, gray);
+}
 
-    return v4l2_get_format(dev);
+__attribute__((target("avx2"), always_inline))
+static inline void rgb2yuyv_avx2_32_run(const uint8_t * src, uint8_t * dst, unsigned int pairs,
+    bool gray)
+{
+    __m256i p0;
+    __m256i p1;
+
+    for (; pairs >= 8; pairs -= 8, src += 64, dst += 32) {
+        p0 = _mm256_loadu_si256((const __m256i *) src);
+        p1 = _mm256_loadu_si256((const __m256i *) (src + 32));
+        _mm256_storeu_si256((__m256i *) dst, rgb2yuyv_avx2_dwords(p0, p1, gray));
+    }
+    rgb2yuyv_sse2_32_run(src, dst, pairs, gray);
 }
 
-static void v4l2_set_ctrl_value(struct control_mapping_pair ctrl, unsigned int ctrl_v4l2, int v4l2_ctrl_value)
+#define RGB2YUYV_X86(isa, name)                                                 \
+__attribute__((target(#isa)))                                                   \
+static void rgb2yuyv_##isa##_##name(const uint8_t * src, uint8_t * dst,         \
+    unsigned int pairs)                                                         \
+{                                                                               \
+    rgb2yuyv_##isa##_##name##_run(src, dst, pairs, false);                      \
+}                                                                               \
+                                                                                \
+__attribute__((target(#isa)))                                                   \
+static void rgb2gray_##isa##_##name(const uint8_t * src, uint8_t * dst,         \
+    unsigned int pairs)                                                         \
+{                                                                               \
+    rgb2yuyv_##isa##_##name##_run(src, dst, pairs, true);                       \
+}
+
+RGB2YUYV_X86(sse2, 16)
+RGB2YUYV_X86(sse2, 24)
+RGB2YUYV_X86(sse2, 32)
+RGB2YUYV_X86(avx2, 16)
+RGB2YUYV_X86(avx2, 24)
+RGB2YUYV_X86(avx2, 32)
+
+#endif /* __x86_64__ || __i386__ */
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+/* Even and odd pixels of 8 pairs in separate vectors, stored as 32 bytes of YVYU */
+static inline __attribute__((always_inline)) void rgb2yuyv_neon_pairs(uint8_t * dst,
+    uint16x8_t r1, uint16x8_t g1, uint16x8_t b1,
+    uint16x8_t r2, uint16x8_t g2, uint16x8_t b2, bool gray)
 {
-    struct v4l2_queryctrl queryctrl;
-    struct v4l2_control control;
-    CLEAR(queryctrl);
+    const uint16x8_t offset = vdupq_n_u16(16);
+    int16x8_t r12;
+    int16x8_t g12;
+    int16x8_t b12;
+    int16x8_t u;
+    int16x8_t v;
+    uint8x8x4_t yvyu;
+
+    yvyu.val[0] = vmovn_u16(vaddq_u16(vaddq_u16(vshrq_n_u16(r1, 2), vshrq_n_u16(g1, 1)),
+        vaddq_u16(vshrq_n_u16(b1, 3), offset)));
+    yvyu.val[2] = vmovn_u16(vaddq_u16(vaddq_u16(vshrq_n_u16(r2, 2), vshrq_n_u16(g2, 1)),
+        vaddq_u16(vshrq_n_u16(b2, 3), offset)));
+
+    if (gray) {
+        yvyu.val[1] = vdup_n_u8(0x80);
+        yvyu.val[3] = vdup_n_u8(0x80);
+        vst4_u8(dst, yvyu);
+        return;
+    }
 
-    queryctrl.id = ctrl_v4l2;
-    if (ioctl(v4l2_dev.fd, VIDIOC_QUERYCTRL, &queryctrl) == -1) {
-        if (errno != EINVAL) {
-            printf("%s: %s VIDIOC_QUERYCTRL failed: %s (%d).\n",
-                uvc_dev.device_type_name, ctrl.v4l2_name, strerror(errno), errno);
+    r12 = vreinterpretq_s16_u16(vhaddq_u16(r1, r2));
+    g12 = vreinterpretq_s16_u16(vhaddq_u16(g1, g2));
+    b12 = vreinterpretq_s16_u16(vhaddq_u16(b1, b2));
 
-        } else {
-            printf("%s: %s is not supported: %s (%d).\n",
-                uvc_dev.device_type_name, ctrl.v4l2_name, strerror(errno), errno);
+    v = vmulq_n_s16(r12, 112);
+    v = vmlsq_n_s16(v, g12, 94);
+    v = vmlsq_n_s16(v, b12, 18);
+    v = vsubq_s16(v, vdupq_n_s16(128));
+    yvyu.val[1] = vmovn_u16(vreinterpretq_u16_s16(vaddq_s16(vshrq_n_s16(v, 8), vdupq_n_s16(128))));
 
-        }
+    u = vmulq_n_s16(b12, 112);
+    u = vmlsq_n_s16(u, r12, 38);
+    u = vmlsq_n_s16(u, g12, 74);
+    yvyu.val[3] = vmovn_u16(vreinterpretq_u16_s16(vaddq_s16(vshrq_n_s16(u, 8), vdupq_n_s16(128))));
 
-    } else if (queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) {
-        printf("%s: %s is disabled.\n", uvc_dev.device_type_name, ctrl.v4l2_name);
+    vst4_u8(dst, yvyu);
+}
 
-    } else {
-        CLEAR(control);
-        control.id = ctrl.v4l2;
-        control.value = v4l2_ctrl_value;
+/* 16 planar 8 bit samples to 8 even and 8 odd 16 bit samples */
+#define neon_even(x) vandq_u16(vreinterpretq_u16_u8(x), vdupq_n_u16(0xFF))
+#define neon_odd(x) vshrq_n_u16(vreinterpretq_u16_u8(x), 8)
 
-        if (ioctl(v4l2_dev.fd, VIDIOC_S_CTRL, &control) == -1) {
-            printf("%s: %s VIDIOC_S_CTRL failed: %s (%d).\n",
-                uvc_dev.device_type_name, ctrl.v4l2_name, strerror(errno), errno);
-            return;
-        }
-        printf("%s: %s changed value (V4L2: %d, UVC: %d)\n",
-            uvc_dev.device_type_name, ctrl.v4l2_name, v4l2_ctrl_value, ctrl.value);
+static inline __attribute__((always_inline)) void rgb2yuyv_neon_16_run(const uint8_t * src,
+    uint8_t * dst, unsigned int pairs, bool gray)
+{
+    uint16x8x2_t p;
+
+    for (; pairs >= 8; pairs -= 8, src += 32, dst += 32) {
+        p = vld2q_u16((const uint16_t *) src);
+        rgb2yuyv_neon_pairs(dst,
+            vandq_u16(vshrq_n_u16(p.val[0], 8), vdupq_n_u16(0xF8)),
+            vshlq_n_u16(vandq_u16(vshrq_n_u16(p.val[0], 5), vdupq_n_u16(0x3F)), 2),
+            vshlq_n_u16(vandq_u16(p.val[0], vdupq_n_u16(0x1F)), 3),
+            vandq_u16(vshrq_n_u16(p.val[1], 8), vdupq_n_u16(0xF8)),
+            vshlq_n_u16(vandq_u16(vshrq_n_u16(p.val[1], 5), vdupq_n_u16(0x3F)), 2),
+            vshlq_n_u16(vandq_u16(p.val[1], vdupq_n_u16(0x1F)), 3), gray);
     }
+    (gray) ? rgb2gray_scalar_16(src, dst, pairs) : rgb2yuyv_scalar_16(src, dst, pairs);
 }
 
-static void v4l2_set_ctrl(struct control_mapping_pair ctrl)
+static inline __attribute__((always_inline)) void rgb2yuyv_neon_24_run(const uint8_t * src,
+    uint8_t * dst, unsigned int pairs, bool gray)
 {
-    int v4l2_ctrl_value = 0;
-    int v4l2_diff = ctrl.v4l2_maximum - ctrl.v4l2_minimum;
-    int ctrl_diff = ctrl.maximum - ctrl.minimum;
+    uint8x16x3_t p;
 
-    if (ctrl.value < ctrl.minimum) {
-        ctrl.value = ctrl.minimum;
+    for (; pairs >= 8; pairs -= 8, src += 48, dst += 32) {
+        p = vld3q_u8(src);
+        rgb2yuyv_neon_pairs(dst,
+            neon_even(p.val[0]), neon_even(p.val[1]), neon_even(p.val[2]),
+            neon_odd(p.val[0]), neon_odd(p.val[1]), neon_odd(p.val[2]), gray);
     }
+    (gray) ? rgb2gray_scalar_24(src, dst, pairs) : rgb2yuyv_scalar_24(src, dst, pairs);
+}
 
-    if (ctrl.value > ctrl.maximum) {
-        ctrl.value = ctrl.maximum;
+static inline __attribute__((always_inline)) void rgb2yuyv_neon_32_run(const uint8_t * src,
+    uint8_t * dst, unsigned int pairs, bool gray)
+{
+    uint8x16x4_t p;
+
+    for (; pairs >= 8; pairs -= 8, src += 64, dst += 32) {
+        p = vld4q_u8(src);
+        rgb2yuyv_neon_pairs(dst,
+            neon_even(p.val[0]), neon_even(p.val[1]), neon_even(p.val[2]),
+            neon_odd(p.val[0]), neon_odd(p.val[1]), neon_odd(p.val[2]), gray);
     }
+    (gray) ? rgb2gray_scalar_32(src, dst, pairs) : rgb2yuyv_scalar_32(src, dst, pairs);
+}
+
+#define RGB2YUYV_NEON(name)                                                     \
+static void rgb2yuyv_neon_##name(const uint8_t * src, uint8_t * dst,            \
+    unsigned int pairs)                                                         \
+{                                                                               \
+    rgb2yuyv_neon_##name##_run(src, dst, pairs, false);                         \
+}                                                                               \
+                                                                                \
+static void rgb2gray_neon_##name(const uint8_t * src, uint8_t * dst,            \
+    unsigned int pairs)                                                         \
+{                                                                               \
+    rgb2yuyv_neon_##name##_run(src, dst, pairs, true);                          \
+}
 
-    v4l2_ctrl_value = (ctrl.value - ctrl.minimum) * v4l2_diff / ctrl_diff + ctrl.v4l2_minimum;
+RGB2YUYV_NEON(16)
+RGB2YUYV_NEON(24)
+RGB2YUYV_NEON(32)
 
-    v4l2_set_ctrl_value(ctrl, ctrl.v4l2, v4l2_ctrl_value);
+#endif /* __ARM_NEON */
 
-    if (ctrl.v4l2 == V4L2_CID_RED_BALANCE) {
-        v4l2_set_ctrl_value(ctrl, V4L2_CID_BLUE_BALANCE, v4l2_ctrl_value);
-    }
-}
+#define rgb2yuyv_pick(isa, bpp)                                                 \
+    ((pipeline->settings.fb_grayscale) ? rgb2gray_##isa##_##bpp : rgb2yuyv_##isa##_##bpp)
 
-static void v4l2_apply_camera_control(struct control_mapping_pair * mapping,
-    struct v4l2_queryctrl queryctrl, struct v4l2_control control)
+#define rgb2yuyv_use(isa)                                                       \
+    do {                                                                        \
+        pipeline->rgb2yuyv.name  = #isa;                                        \
+        pipeline->rgb2yuyv.bpp16 = rgb2yuyv_pick(isa, 16);                      \
+        pipeline->rgb2yuyv.bpp24 = rgb2yuyv_pick(isa, 24);                      \
+        pipeline->rgb2yuyv.bpp32 = rgb2yuyv_pick(isa, 32);                      \
+    } while (0)
+
+static void rgb2yuyv_select_kernels()
 {
-    mapping->enabled       = true;
-    mapping->control_type  = queryctrl.type;
-    mapping->v4l2_minimum  = queryctrl.minimum;
-    mapping->v4l2_maximum  = queryctrl.maximum;
-    mapping->minimum        = 0;
-    mapping->maximum       = (0 - queryctrl.minimum) + queryctrl.maximum;
-    mapping->step          = queryctrl.step;
-    mapping->default_value = (0 - queryctrl.minimum) + queryctrl.default_value;
-    mapping->value         = (0 - queryctrl.minimum) + control.value;
-    
-    printf("V4L2: Supported control %s (%s = %s)\n", queryctrl.name,
-        mapping->v4l2_name, mapping->uvc_name);
+    rgb2yuyv_use(scalar);
 
-    printf("V4L2:   V4L2: min: %d, max: %d, step: %d, default: %d, value: %d\n",
-        queryctrl.minimum,
-        queryctrl.maximum,
-        queryctrl.step,
-        queryctrl.default_value,
-        control.value
-    );
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
 
-    printf("V4L2:   UVC: min: %d, max: %d, step: %d, default: %d, value: %d\n",
-        mapping->minimum,
-        mapping->maximum,
-        queryctrl.step,
-        mapping->default_value,
-        mapping->value
-    );
+    if (__builtin_cpu_supports("avx2")) {
+        rgb2yuyv_use(avx2);
+
+    } else if (__builtin_cpu_supports("sse2")) {
+        rgb2yuyv_use(sse2);
+    }
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#if defined(__arm__)
+    if (getauxval(AT_HWCAP) & HWCAP_NEON)
+#endif
+    {
+        rgb2yuyv_use(neon);
+    }
+#endif
+
+    log_info("FB: RGB to YUYV conversion: %s%s\n", pipeline->rgb2yuyv.name,
+        (pipeline->settings.fb_grayscale) ? " (grayscale)" : "");
 }
 
-static void v4l2_get_controls()
+/* ---------------------------------------------------------------------------
+ * Worker pool
+ */
+
+/*
+ * Thread attributes with an explicit scheduling policy, threads never
+ * inherit the policy of the pipeline thread. A real-time thread takes
+ * the policy and priority of the calling thread, the others SCHED_OTHER.
+ */
+static void thread_attr_init(pthread_attr_t * attr, bool realtime)
 {
-    int i;
-    struct v4l2_queryctrl queryctrl;
-    struct v4l2_control control;
-    unsigned int id;
-    const unsigned next_fl = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
-    CLEAR(queryctrl);
+    struct sched_param param;
+    int policy = SCHED_OTHER;
 
-    queryctrl.id = next_fl;
-    while (0 == ioctl (v4l2_dev.fd, VIDIOC_QUERYCTRL, &queryctrl)) {
+    CLEAR(param);
+    if (realtime) {
+        pthread_getschedparam(pthread_self(), &policy, &param);
+    }
 
-        id = queryctrl.id;
-        queryctrl.id |= next_fl;
+    pthread_attr_init(attr);
+    pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(attr, policy);
+    pthread_attr_setschedparam(attr, &param);
+}
 
-        if (queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) {
-            continue;
+static void * worker_thread_main(void * arg)
+{
+    struct worker_thread * worker = arg;
+    struct worker_pool * pool = worker->pool;
+    unsigned int generation = 0;
+    worker_job job;
+    void * data;
+
+    /* Jobs reach the state of the pipeline that owns the pool. */
+    pipeline = pool->pipeline;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->stop && pool->generation == generation) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->stop) {
+            break;
         }
+        generation = pool->generation;
+        job = pool->job;
+        data = pool->data;
+        pthread_mutex_unlock(&pool->lock);
 
-        for (i = 0; i < control_mapping_size; i++) {
-            if (control_mapping[i].v4l2 == id) {
-                control.id = queryctrl.id;
-                if (0 == ioctl (v4l2_dev.fd, VIDIOC_G_CTRL, &control)) {
-                    v4l2_apply_camera_control(&control_mapping[i], queryctrl, control);
-                }
-            }
+        job(worker->part, pool->nparts, data);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->remaining == 0) {
+            pthread_cond_signal(&pool->done);
         }
     }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
 }
 
-static void v4l2_close()
+/* Parse a CPU list like "1,2,3" or "1-3" */
+static int worker_parse_cpus(const char * list, int * cpus, unsigned int max)
 {
-    if (v4l2_dev.fd) {
-        close(v4l2_dev.fd);
-        v4l2_dev.fd = -1;
-    }
-}
-
-static void uvc_close()
+    unsigned int count = 0;
+    char * end;
+    long first;
+    long last;
+
+    while (*list) {
+        first = strtol(list, &end, 10);
+        if (end == list || first < 0 || first >= CPU_SETSIZE) {
+            return -EINVAL;
+        }
+        last = first;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first || last >= CPU_SETSIZE) {
+                return -EINVAL;
+            }
+        }
+        for (; first <= last && count < max; first++) {
+            cpus[count++] = first;
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end) {
+            return -EINVAL;
+        }
+        list = end;
+    }
+    return count;
+}
+
+static int worker_pool_start(struct worker_pool * pool, const char * name,
+    unsigned int nparts, const char * cpu_list)
+{
+    struct worker_thread * worker;
+    int cpus[WORKER_POOL_MAX];
+    int ncpus = 0;
+    cpu_set_t cpuset;
+    pthread_attr_t attr;
+    unsigned int i;
+    int ret;
+
+    if (nparts < 1) {
+        nparts = 1;
+    }
+    if (nparts > WORKER_POOL_MAX) {
+        nparts = WORKER_POOL_MAX;
+    }
+
+    if (cpu_list) {
+        ncpus = worker_parse_cpus(cpu_list, cpus, WORKER_POOL_MAX);
+        if (ncpus <= 0) {
+            log_error("%s: Invalid CPU list: %s\n", name, cpu_list);
+            return -EINVAL;
+        }
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->pipeline = pipeline;
+    pool->nparts = nparts;
+    pool->nthreads = 0;
+    pool->generation = 0;
+    pool->remaining = 0;
+    pool->stop = false;
+
+    /*
+     * Encoding keeps every worker busy, real-time workers on all CPUs would
+     * starve the rest of the system. They only get the real-time policy on
+     * the CPUs reserved for them with -a.
+     */
+    thread_attr_init(&attr, ncpus > 0);
+
+    for (i = 1; i < nparts; i++) {
+        worker = &pool->threads[pool->nthreads];
+        worker->pool = pool;
+        worker->part = i;
+
+        ret = pthread_create(&worker->thread, &attr, worker_thread_main, worker);
+        if (ret != 0) {
+            log_error("%s: Unable to start worker thread: %s (%d).\n", name, strerror(ret), ret);
+            break;
+        }
+        pool->nthreads++;
+
+        if (ncpus) {
+            CPU_ZERO(&cpuset);
+            CPU_SET(cpus[(i - 1) % ncpus], &cpuset);
+            ret = pthread_setaffinity_np(worker->thread, sizeof(cpuset), &cpuset);
+            if (ret != 0) {
+                log_error("%s: Unable to set CPU affinity: %s (%d).\n", name, strerror(ret), ret);
+            }
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+
+    /* Threads that failed to start leave their parts to the caller. */
+    pool->nparts = pool->nthreads + 1;
+
+    log_info("%s: Worker pool with %d parts started\n", name, pool->nparts);
+    return 0;
+}
+
+static void worker_pool_stop(struct worker_pool * pool)
+{
+    unsigned int i;
+
+    if (!pool->nparts) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i].thread, NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    pool->nthreads = 0;
+    pool->nparts = 0;
+}
+
+/* Run job on every part of the pool and wait until all of them finish */
+static void worker_pool_run(struct worker_pool * pool, worker_job job, void * data)
+{
+    if (pool->nthreads == 0) {
+        job(0, 1, data);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->data = data;
+    pool->remaining = pool->nthreads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    job(0, pool->nparts, data);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->remaining) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* ---------------------------------------------------------------------------
+ * Frame stage
+ */
+
+static void * frame_stage_main(void * arg)
+{
+    struct frame_stage * stage;
+    frame_stage_job job;
+
+    pipeline = arg;
+    stage = &pipeline->frame_stage;
+
+    pthread_mutex_lock(&stage->lock);
+    while (!stage->stop) {
+        if (!stage->job) {
+            pthread_cond_wait(&stage->wake, &stage->lock);
+            continue;
+        }
+
+        job = stage->job;
+        pthread_mutex_unlock(&stage->lock);
+
+        job(stage);
+
+        pthread_mutex_lock(&stage->lock);
+        stage->job = NULL;
+        stage->done = true;
+        pthread_cond_signal(&stage->idle);
+
+        /* The pipeline thread queues the result. */
+        event_loop_wakeup(&pipeline->processing.loop);
+    }
+    pthread_mutex_unlock(&stage->lock);
+    return NULL;
+}
+
+static int frame_stage_start()
+{
+    struct frame_stage * stage = &pipeline->frame_stage;
+    pthread_attr_t attr;
+    int ret;
+
+    CLEAR(*stage);
+    pthread_mutex_init(&stage->lock, NULL);
+    pthread_cond_init(&stage->wake, NULL);
+    pthread_cond_init(&stage->idle, NULL);
+
+    /* Every frame goes through the stage, it streams like the pipeline thread. */
+    thread_attr_init(&attr, true);
+    ret = pthread_create(&stage->thread, &attr, frame_stage_main, pipeline);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        log_error("FRAME STAGE: Unable to start thread: %s (%d).\n", strerror(ret), ret);
+        pthread_cond_destroy(&stage->idle);
+        pthread_cond_destroy(&stage->wake);
+        pthread_mutex_destroy(&stage->lock);
+        return -ret;
+    }
+
+    stage->running = true;
+    return 0;
+}
+
+/* A job still running is finished first, its result is dropped */
+static void frame_stage_stop()
+{
+    struct frame_stage * stage = &pipeline->frame_stage;
+
+    if (!stage->running) {
+        return;
+    }
+
+    pthread_mutex_lock(&stage->lock);
+    stage->stop = true;
+    pthread_cond_signal(&stage->wake);
+    pthread_mutex_unlock(&stage->lock);
+
+    pthread_join(stage->thread, NULL);
+    pthread_cond_destroy(&stage->idle);
+    pthread_cond_destroy(&stage->wake);
+    pthread_mutex_destroy(&stage->lock);
+    stage->running = false;
+    stage->busy = false;
+}
+
+/* Start a job on the frame stage, only one is in flight at a time */
+static void frame_stage_submit(frame_stage_job job)
+{
+    struct frame_stage * stage = &pipeline->frame_stage;
+
+    stage->busy = true;
+
+    if (!stage->running) {
+        job(stage);
+        stage->done = true;
+        event_loop_wakeup(&pipeline->processing.loop);
+        return;
+    }
+
+    pthread_mutex_lock(&stage->lock);
+    stage->job = job;
+    stage->done = false;
+    pthread_cond_signal(&stage->wake);
+    pthread_mutex_unlock(&stage->lock);
+}
+
+/* True once for every finished job, its result can then be queued */
+static bool frame_stage_collect()
+{
+    struct frame_stage * stage = &pipeline->frame_stage;
+    bool done;
+
+    if (!stage->busy) {
+        return false;
+    }
+
+    if (stage->running) {
+        pthread_mutex_lock(&stage->lock);
+    }
+    done = stage->done;
+    stage->done = false;
+    if (stage->running) {
+        pthread_mutex_unlock(&stage->lock);
+    }
+
+    stage->busy = !done;
+    return done;
+}
+
+/* Block until the job in flight finished, before the memory it uses goes away */
+static void frame_stage_wait()
+{
+    struct frame_stage * stage = &pipeline->frame_stage;
+
+    if (!stage->busy || !stage->running) {
+        return;
+    }
+
+    pthread_mutex_lock(&stage->lock);
+    while (!stage->done) {
+        pthread_cond_wait(&stage->idle, &stage->lock);
+    }
+    pthread_mutex_unlock(&stage->lock);
+}
+
+/* ---------------------------------------------------------------------------
+ * JPEG encoder
+ */
+
+static void jpeg_build_huffman(struct jpeg_huffman * table, const uint8_t * bits, const uint8_t * vals)
+{
+    unsigned int code = 0;
+    unsigned int length;
+    unsigned int i;
+    unsigned int k = 0;
+
+    for (length = 1; length <= 16; length++) {
+        for (i = 0; i < bits[length - 1]; i++, k++) {
+            table->code[vals[k]] = code++;
+            table->size[vals[k]] = length;
+        }
+        code <<= 1;
+    }
+}
+
+static void jpeg_init(unsigned int quality)
+{
+    static const float aan_scale[8] = {
+        1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+        1.0f, 0.785694958f, 0.541196100f, 0.275899379f
+    };
+    unsigned int scale = (quality < 50) ? 5000 / quality : 200 - quality * 2;
+    unsigned int luma;
+    unsigned int chroma;
+    unsigned int i;
+
+    pipeline->jpeg.quality = quality;
+    pipeline->jpeg.fitted = 0;
+
+    for (i = 0; i < 64; i++) {
+        luma = clamp((jpeg_std_qt_luma[i] * scale + 50) / 100, 1U, 255U);
+        chroma = clamp((jpeg_std_qt_chroma[i] * scale + 50) / 100, 1U, 255U);
+
+        pipeline->jpeg.fdtbl_luma[i] = 1.0f / (luma * aan_scale[i / 8] * aan_scale[i % 8] * 8.0f);
+        pipeline->jpeg.fdtbl_chroma[i] = 1.0f / (chroma * aan_scale[i / 8] * aan_scale[i % 8] * 8.0f);
+    }
+
+    for (i = 0; i < 64; i++) {
+        pipeline->jpeg.qt_luma[i] = clamp((jpeg_std_qt_luma[jpeg_zigzag[i]] * scale + 50) / 100, 1U, 255U);
+        pipeline->jpeg.qt_chroma[i] = clamp((jpeg_std_qt_chroma[jpeg_zigzag[i]] * scale + 50) / 100, 1U, 255U);
+    }
+
+    jpeg_build_huffman(&pipeline->jpeg.dc_luma, jpeg_dc_luma_bits, jpeg_dc_vals);
+    jpeg_build_huffman(&pipeline->jpeg.ac_luma, jpeg_ac_luma_bits, jpeg_ac_luma_vals);
+    jpeg_build_huffman(&pipeline->jpeg.dc_chroma, jpeg_dc_chroma_bits, jpeg_dc_vals);
+    jpeg_build_huffman(&pipeline->jpeg.ac_chroma, jpeg_ac_chroma_bits, jpeg_ac_chroma_vals);
+
+    log_info("JPEG: Encoder quality: %u\n", quality);
+}
+
+/* Slices are sized for the raw rows they encode, no sane frame compresses worse. */
+static int jpeg_setup(unsigned int width, unsigned int height)
+{
+    unsigned int mcu_rows = (height + 7) / 8;
+    unsigned int rows = (mcu_rows + pipeline->workers.nparts - 1) / pipeline->workers.nparts;
+    size_t capacity = (size_t) rows * 8 * width * 2 + 1024;
+    unsigned int i;
+
+    if (capacity <= pipeline->jpeg.slice_capacity) {
+        return 0;
+    }
+
+    for (i = 0; i < WORKER_POOL_MAX; i++) {
+        free(pipeline->jpeg.slice[i]);
+        pipeline->jpeg.slice[i] = NULL;
+    }
+    pipeline->jpeg.slice_capacity = 0;
+
+    for (i = 0; i < pipeline->workers.nparts; i++) {
+        pipeline->jpeg.slice[i] = malloc(capacity);
+        if (!pipeline->jpeg.slice[i]) {
+            log_error("JPEG: Out of memory\n");
+            return -ENOMEM;
+        }
+    }
+    pipeline->jpeg.slice_capacity = capacity;
+    return 0;
+}
+
+static void jpeg_close()
+{
+    unsigned int i;
+
+    for (i = 0; i < WORKER_POOL_MAX; i++) {
+        free(pipeline->jpeg.slice[i]);
+        pipeline->jpeg.slice[i] = NULL;
+    }
+    pipeline->jpeg.slice_capacity = 0;
+}
+
+static inline void jpeg_put_bits(struct jpeg_bits * bits, unsigned int value, unsigned int size)
+{
+    uint8_t byte;
+
+    bits->acc = (bits->acc << size) | (value & ((1U << size) - 1));
+    bits->nbits += size;
+
+    while (bits->nbits >= 8) {
+        bits->nbits -= 8;
+        byte = bits->acc >> bits->nbits;
+
+        if (bits->out + 2 > bits->end) {
+            bits->overflow = true;
+            continue;
+        }
+        *bits->out++ = byte;
+        if (byte == 0xFF) {
+            *bits->out++ = 0x00;
+        }
+    }
+}
+
+/* Pad the last byte with ones, as required before a marker */
+static void jpeg_flush_bits(struct jpeg_bits * bits)
+{
+    if (bits->nbits) {
+        jpeg_put_bits(bits, 0x7F, 8 - bits->nbits);
+    }
+}
+
+/* Float AAN forward DCT, the output is scaled by the AAN factors in fdtbl */
+static void jpeg_fdct(float * data)
+{
+    float tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+    float tmp10, tmp11, tmp12, tmp13;
+    float z1, z2, z3, z4, z5, z11, z13;
+    float * d;
+    unsigned int pass;
+    unsigned int i;
+    unsigned int step;
+
+    for (pass = 0; pass < 2; pass++) {
+        step = (pass == 0) ? 1 : 8;
+
+        for (i = 0; i < 8; i++) {
+            d = (pass == 0) ? data + i * 8 : data + i;
+
+            tmp0 = d[0 * step] + d[7 * step];
+            tmp7 = d[0 * step] - d[7 * step];
+            tmp1 = d[1 * step] + d[6 * step];
+            tmp6 = d[1 * step] - d[6 * step];
+            tmp2 = d[2 * step] + d[5 * step];
+            tmp5 = d[2 * step] - d[5 * step];
+            tmp3 = d[3 * step] + d[4 * step];
+            tmp4 = d[3 * step] - d[4 * step];
+
+            /* Even part */
+            tmp10 = tmp0 + tmp3;
+            tmp13 = tmp0 - tmp3;
+            tmp11 = tmp1 + tmp2;
+            tmp12 = tmp1 - tmp2;
+
+            d[0 * step] = tmp10 + tmp11;
+            d[4 * step] = tmp10 - tmp11;
+
+            z1 = (tmp12 + tmp13) * 0.707106781f;
+            d[2 * step] = tmp13 + z1;
+            d[6 * step] = tmp13 - z1;
+
+            /* Odd part */
+            tmp10 = tmp4 + tmp5;
+            tmp11 = tmp5 + tmp6;
+            tmp12 = tmp6 + tmp7;
+
+            z5 = (tmp10 - tmp12) * 0.382683433f;
+            z2 = 0.541196100f * tmp10 + z5;
+            z4 = 1.306562965f * tmp12 + z5;
+            z3 = tmp11 * 0.707106781f;
+
+            z11 = tmp7 + z3;
+            z13 = tmp7 - z3;
+
+            d[5 * step] = z13 + z2;
+            d[3 * step] = z13 - z2;
+            d[1 * step] = z11 + z4;
+            d[7 * step] = z11 - z4;
+        }
+    }
+}
+
+/* Magnitude category of a coefficient and its value bits */
+static inline unsigned int jpeg_category(int value, unsigned int * bits)
+{
+    unsigned int magnitude = (value < 0) ? -value : value;
+    unsigned int category = (magnitude) ? 32 - __builtin_clz(magnitude) : 0;
+
+    *bits = (value < 0) ? value - 1 : value;
+    return category;
+}
+
+static void jpeg_encode_block(struct jpeg_bits * bits, float * data, const float * fdtbl,
+    int * dc_pred, const struct jpeg_huffman * dc, const struct jpeg_huffman * ac)
+{
+    int coef[64];
+    unsigned int category;
+    unsigned int value;
+    unsigned int run = 0;
+    unsigned int i;
+    float q;
+
+    jpeg_fdct(data);
+
+    for (i = 0; i < 64; i++) {
+        q = data[jpeg_zigzag[i]] * fdtbl[jpeg_zigzag[i]];
+        coef[i] = (int) ((q < 0) ? q - 0.5f : q + 0.5f);
+    }
+
+    category = jpeg_category(coef[0] - *dc_pred, &value);
+    *dc_pred = coef[0];
+    jpeg_put_bits(bits, dc->code[category], dc->size[category]);
+    if (category) {
+        jpeg_put_bits(bits, value, category);
+    }
+
+    for (i = 1; i < 64; i++) {
+        if (coef[i] == 0) {
+            run++;
+            continue;
+        }
+
+        while (run >= 16) {
+            jpeg_put_bits(bits, ac->code[0xF0], ac->size[0xF0]);
+            run -= 16;
+        }
+
+        category = jpeg_category(coef[i], &value);
+        jpeg_put_bits(bits, ac->code[(run << 4) | category], ac->size[(run << 4) | category]);
+        jpeg_put_bits(bits, value, category);
+        run = 0;
+    }
+
+    if (run) {
+        jpeg_put_bits(bits, ac->code[0x00], ac->size[0x00]);
+    }
+}
+
+/*
+ * Encode one group of MCU rows into its slice. Edge MCUs repeat the last
+ * column and row of the frame.
+ */
+static void jpeg_encode_slice(unsigned int part, unsigned int nparts, void * data)
+{
+    struct jpeg_job * job = data;
+    unsigned int mcus_x = (job->width + 15) / 16;
+    unsigned int mcu_rows = (job->height + 7) / 8;
+    unsigned int first = mcu_rows * part / nparts;
+    unsigned int last = mcu_rows * (part + 1) / nparts;
+    struct jpeg_bits bits;
+    float y0[64], y1[64], cb[64], cr[64];
+    const uint8_t * row;
+    int dc_y;
+    int dc_cb;
+    int dc_cr;
+    unsigned int my;
+    unsigned int mx;
+    unsigned int x;
+    unsigned int y;
+    unsigned int px;
+
+    bits.out      = pipeline->jpeg.slice[part];
+    bits.end      = pipeline->jpeg.slice[part] + pipeline->jpeg.slice_capacity;
+    bits.acc      = 0;
+    bits.nbits    = 0;
+    bits.overflow = false;
+
+    for (my = first; my < last; my++) {
+        dc_y  = 0;
+        dc_cb = 0;
+        dc_cr = 0;
+
+        for (mx = 0; mx < mcus_x; mx++) {
+            for (y = 0; y < 8; y++) {
+                row = job->src + min(my * 8 + y, job->height - 1) * job->stride;
+
+                for (x = 0; x < 8; x++) {
+                    px = min(mx * 16 + x * 2, job->width - 2) * 2;
+
+                    y0[y * 8 + x] = row[min(mx * 16 + x, job->width - 1) * 2] - 128.0f;
+                    y1[y * 8 + x] = row[min(mx * 16 + 8 + x, job->width - 1) * 2] - 128.0f;
+                    cb[y * 8 + x] = row[px + 1] - 128.0f;
+                    cr[y * 8 + x] = row[px + 3] - 128.0f;
+                }
+            }
+
+            jpeg_encode_block(&bits, y0, pipeline->jpeg.fdtbl_luma, &dc_y, &pipeline->jpeg.dc_luma, &pipeline->jpeg.ac_luma);
+            jpeg_encode_block(&bits, y1, pipeline->jpeg.fdtbl_luma, &dc_y, &pipeline->jpeg.dc_luma, &pipeline->jpeg.ac_luma);
+            jpeg_encode_block(&bits, cb, pipeline->jpeg.fdtbl_chroma, &dc_cb, &pipeline->jpeg.dc_chroma, &pipeline->jpeg.ac_chroma);
+            jpeg_encode_block(&bits, cr, pipeline->jpeg.fdtbl_chroma, &dc_cr, &pipeline->jpeg.dc_chroma, &pipeline->jpeg.ac_chroma);
+        }
+
+        jpeg_flush_bits(&bits);
+
+        /* Every MCU row but the last one ends with a restart marker. */
+        if (my + 1 < mcu_rows) {
+            if (bits.out + 2 > bits.end) {
+                bits.overflow = true;
+                break;
+            }
+            *bits.out++ = 0xFF;
+            *bits.out++ = 0xD0 + (my & 7);
+        }
+    }
+
+    job->slice_size[part]     = bits.out - pipeline->jpeg.slice[part];
+    job->slice_overflow[part] = bits.overflow;
+}
+
+static uint8_t * jpeg_put_marker(uint8_t * out, uint8_t marker, unsigned int length)
+{
+    *out++ = 0xFF;
+    *out++ = marker;
+    *out++ = length >> 8;
+    *out++ = length & 0xFF;
+    return out;
+}
+
+static uint8_t * jpeg_put_huffman(uint8_t * out, uint8_t class_id, const uint8_t * bits,
+    const uint8_t * vals)
+{
+    unsigned int count = 0;
+    unsigned int i;
+
+    for (i = 0; i < 16; i++) {
+        count += bits[i];
+    }
+
+    *out++ = class_id;
+    memcpy(out, bits, 16);
+    memcpy(out + 16, vals, count);
+    return out + 16 + count;
+}
+
+static size_t jpeg_put_headers(uint8_t * out, unsigned int width, unsigned int height)
+{
+    uint8_t * start = out;
+
+    /* SOI */
+    *out++ = 0xFF;
+    *out++ = 0xD8;
+
+    out = jpeg_put_marker(out, 0xDB, 2 + 2 * 65);
+    *out++ = 0x00;
+    memcpy(out, pipeline->jpeg.qt_luma, 64);
+    out += 64;
+    *out++ = 0x01;
+    memcpy(out, pipeline->jpeg.qt_chroma, 64);
+    out += 64;
+
+    /* SOF0, Y sampled 2x1, Cb and Cr 1x1 */
+    out = jpeg_put_marker(out, 0xC0, 17);
+    *out++ = 8;
+    *out++ = height >> 8;
+    *out++ = height & 0xFF;
+    *out++ = width >> 8;
+    *out++ = width & 0xFF;
+    *out++ = 3;
+    *out++ = 1; *out++ = 0x21; *out++ = 0;
+    *out++ = 2; *out++ = 0x11; *out++ = 1;
+    *out++ = 3; *out++ = 0x11; *out++ = 1;
+
+    out = jpeg_put_marker(out, 0xC4, 2 + 4 * 17 + 2 * 12 + 2 * 162);
+    out = jpeg_put_huffman(out, 0x00, jpeg_dc_luma_bits, jpeg_dc_vals);
+    out = jpeg_put_huffman(out, 0x10, jpeg_ac_luma_bits, jpeg_ac_luma_vals);
+    out = jpeg_put_huffman(out, 0x01, jpeg_dc_chroma_bits, jpeg_dc_vals);
+    out = jpeg_put_huffman(out, 0x11, jpeg_ac_chroma_bits, jpeg_ac_chroma_vals);
+
+    /* One restart interval per MCU row */
+    out = jpeg_put_marker(out, 0xDD, 4);
+    *out++ = ((width + 15) / 16) >> 8;
+    *out++ = ((width + 15) / 16) & 0xFF;
+
+    out = jpeg_put_marker(out, 0xDA, 12);
+    *out++ = 3;
+    *out++ = 1; *out++ = 0x00;
+    *out++ = 2; *out++ = 0x11;
+    *out++ = 3; *out++ = 0x11;
+    *out++ = 0;
+    *out++ = 63;
+    *out++ = 0;
+
+    return out - start;
+}
+
+/*
+ * Encode a YUYV frame into dst, returns the JPEG size. A frame that does
+ * not fit is encoded again at a lower quality, which is kept for the
+ * following frames.
+ */
+static int jpeg_encode(const uint8_t * src, unsigned int stride, unsigned int width,
+    unsigned int height, uint8_t * dst, size_t capacity)
+{
+    struct jpeg_job job;
+    size_t size;
+    unsigned int i;
+
+    if (width < 2 || height < 1 || capacity < JPEG_HEADER_MAX) {
+        return -EINVAL;
+    }
+
+    if (jpeg_setup(width, height) < 0) {
+        return -ENOMEM;
+    }
+
+retry:
+    job.src    = src;
+    job.stride = stride;
+    job.width  = width;
+    job.height = height;
+
+    worker_pool_run(&pipeline->workers, jpeg_encode_slice, &job);
+
+    size = jpeg_put_headers(dst, width, height);
+
+    for (i = 0; i < pipeline->workers.nparts; i++) {
+        if (job.slice_overflow[i] || size + job.slice_size[i] + 2 > capacity) {
+            if (pipeline->jpeg.quality <= JPEG_QUALITY_MIN) {
+                return -ENOSPC;
+            }
+
+            log_warning("JPEG: Frame larger than %zu bytes, lowering the quality\n", capacity);
+            jpeg_init(max(pipeline->jpeg.quality / 2, JPEG_QUALITY_MIN));
+            goto retry;
+        }
+        memcpy(dst + size, pipeline->jpeg.slice[i], job.slice_size[i]);
+        size += job.slice_size[i];
+    }
+
+    /* EOI */
+    dst[size++] = 0xFF;
+    dst[size++] = 0xD9;
+
+    /* Step back towards the configured quality while frames leave room to spare. */
+    if (pipeline->jpeg.quality < pipeline->settings.jpeg_quality) {
+        pipeline->jpeg.fitted = (size <= capacity / 4 * 3) ? pipeline->jpeg.fitted + 1 : 0;
+        if (pipeline->jpeg.fitted >= JPEG_QUALITY_RESTORE_FRAMES) {
+            jpeg_init(min(pipeline->jpeg.quality + JPEG_QUALITY_STEP, pipeline->settings.jpeg_quality));
+        }
+    }
+    return size;
+}
+
+/* ---------------------------------------------------------------------------
+ * YUYV scaler
+ */
+
+/*
+ * Nearest neighbour resize of the rows of one stripe. Luma is picked per
+ * pixel, chroma is taken from the pair holding the first picked pixel so
+ * the component order of the source is kept.
+ */
+static void yuyv_scale_stripe(unsigned int part, unsigned int nparts, void * data)
+{
+    struct yuyv_scale_job * job = data;
+    unsigned int first = job->dst_height * part / nparts;
+    unsigned int last = job->dst_height * (part + 1) / nparts;
+    const uint8_t * src;
+    uint8_t * dst;
+    unsigned int x0;
+    unsigned int x1;
+    unsigned int x;
+    unsigned int y;
+
+    for (y = first; y < last; y++) {
+        src = job->src + (size_t) (y * (uint64_t) job->src_height / job->dst_height) * job->src_stride;
+        dst = job->dst + (size_t) y * job->dst_width * 2;
+
+        for (x = 0; x + 1 < job->dst_width; x += 2) {
+            x0 = x * (uint64_t) job->src_width / job->dst_width;
+            x1 = (x + 1) * (uint64_t) job->src_width / job->dst_width;
+
+            dst[0] = src[x0 * 2];
+            dst[1] = src[(x0 & ~1u) * 2 + 1];
+            dst[2] = src[x1 * 2];
+            dst[3] = src[(x0 & ~1u) * 2 + 3];
+            dst += 4;
+        }
+    }
+}
+
+static void yuyv_scale(const uint8_t * src, unsigned int src_stride, unsigned int src_width,
+    unsigned int src_height, uint8_t * dst, unsigned int dst_width, unsigned int dst_height)
+{
+    struct yuyv_scale_job job = {
+        .src        = src,
+        .src_stride = src_stride,
+        .src_width  = src_width & ~1u,
+        .src_height = src_height,
+        .dst        = dst,
+        .dst_width  = dst_width,
+        .dst_height = dst_height,
+    };
+
+    worker_pool_run(&pipeline->workers, yuyv_scale_stripe, &job);
+}
+
+/* ---------------------------------------------------------------------------
+ * Buffer handoff between capture and output threads
+ */
+
+static uint64_t monotonic_ns()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Log a missed streaming deadline with its monotonic timestamp, comparable
+ * with the kernel log. At most DEADLINE_LOG_MAX misses are logged per
+ * second, the rest are only counted.
+ */
+static void deadline_miss(const char * name, const char * what, uint64_t late)
+{
+    struct processing * processing = &pipeline->processing;
+    uint64_t now = monotonic_ns();
+
+    processing->deadline_misses++;
+
+    if (now - processing->deadline_window >= 1000000000ULL) {
+        if (processing->deadline_suppressed) {
+            log_warning("%s: %u more deadline misses not logged\n", name, processing->deadline_suppressed);
+        }
+        processing->deadline_window = now;
+        processing->deadline_logged = 0;
+        processing->deadline_suppressed = 0;
+    }
+
+    if (processing->deadline_logged == DEADLINE_LOG_MAX) {
+        processing->deadline_suppressed++;
+        return;
+    }
+    processing->deadline_logged++;
+
+    log_warning("%s: Deadline miss at %llu.%06llu: %s %llu.%llu ms late\n", name,
+        (unsigned long long) (now / 1000000000), (unsigned long long) (now % 1000000000 / 1000),
+        what, (unsigned long long) (late / 1000000), (unsigned long long) (late / 100000 % 10));
+}
+
+static void buffer_ring_reset(struct buffer_ring * ring)
+{
+    atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, 0, memory_order_relaxed);
+}
+
+/* Producer side, returns false when the ring is full */
+static bool buffer_ring_push(struct buffer_ring * ring, unsigned int index)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail >= BUFFER_RING_SIZE) {
+        return false;
+    }
+
+    ring->slots[head & (BUFFER_RING_SIZE - 1)] = index;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+/* Consumer side, returns false when the ring is empty */
+static bool buffer_ring_pop(struct buffer_ring * ring, unsigned int * index)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail) {
+        return false;
+    }
+
+    *index = ring->slots[tail & (BUFFER_RING_SIZE - 1)];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+/*
+ * Catch ownership bugs such as a buffer recycled twice: the buffer must be
+ * in one of the given states.
+ */
+static bool buffer_pool_check(unsigned int index, unsigned int states, const char * action)
+{
+    if (index < pipeline->buffer_pool.capture_nbufs &&
+        (states & BUFFER_STATE_BIT(pipeline->buffer_pool.state[index]))
+    ) {
+        return true;
+    }
+
+    log_error("BUFFER POOL: Buffer %u %s while %s\n", index, action,
+        (index < pipeline->buffer_pool.capture_nbufs) ?
+            buffer_state_names[pipeline->buffer_pool.state[index]] : "out of range");
+    return false;
+}
+
+/* ---------------------------------------------------------------------------
+ * Capture thread
+ */
+
+static void v4l2_capture_process()
+{
+    struct v4l2_buffer vbuf;
+
+    if (pipeline->v4l2_dev.dqbuf_count >= pipeline->v4l2_dev.qbuf_count) {
+        return;
+    }
+
+    /* Dequeue spent buffer from V4L2 domain. */
+    CLEAR(vbuf);
+    vbuf.type   = pipeline->v4l2_dev.buffer_type;
+    vbuf.memory = pipeline->v4l2_dev.memory_type;
+
+    if (ioctl(pipeline->v4l2_dev.fd, VIDIOC_DQBUF, &vbuf) < 0) {
+        log_error("%s: Unable to dequeue buffer: %s (%d).\n",
+            pipeline->v4l2_dev.device_type_name, strerror(errno), errno);
+        return;
+    }
+
+    pipeline->v4l2_dev.dqbuf_count++;
+    pipeline->buffer_pool.dequeued[vbuf.index] = monotonic_ns();
+
+    /* Latency is measured on the monotonic clock, stamp the frame here if the driver doesn't. */
+    if ((vbuf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        uint64_t now = monotonic_ns();
+
+        vbuf.timestamp.tv_sec  = now / 1000000000;
+        vbuf.timestamp.tv_usec = now % 1000000000 / 1000;
+    }
+
+    /* The buffer descriptor travels with its index to the output thread. */
+    pipeline->v4l2_dev.mem[vbuf.index].buf = vbuf;
+    pipeline->buffer_pool.state[vbuf.index] = BUFFER_STATE_READY;
+
+    if (!buffer_ring_push(&pipeline->capture.ready, vbuf.index)) {
+        log_warning("%s: Ready ring overflow, buffer %u dropped\n",
+            pipeline->v4l2_dev.device_type_name, vbuf.index);
+        return;
+    }
+    event_loop_wakeup(&pipeline->processing.loop);
+}
+
+static void v4l2_capture_requeue()
+{
+    struct v4l2_buffer vbuf;
+    unsigned int index;
+
+    while (buffer_ring_pop(&pipeline->capture.release, &index)) {
+        if (!buffer_pool_check(index, BUFFER_STATE_BIT(BUFFER_STATE_FREE), "requeued")) {
+            continue;
+        }
+
+        CLEAR(vbuf);
+        vbuf.type   = pipeline->v4l2_dev.buffer_type;
+        vbuf.memory = pipeline->v4l2_dev.memory_type;
+        vbuf.index  = index;
+
+        if (ioctl(pipeline->v4l2_dev.fd, VIDIOC_QBUF, &vbuf) < 0) {
+            log_error("%s: Unable to queue buffer: %s (%d).\n",
+                pipeline->v4l2_dev.device_type_name, strerror(errno), errno);
+            continue;
+        }
+
+        pipeline->buffer_pool.state[index] = BUFFER_STATE_CAPTURE;
+        pipeline->v4l2_dev.qbuf_count++;
+    }
+}
+
+static void capture_v4l2_handler(struct event_source * source, uint32_t events)
+{
+    (void)(source);
+
+    /* vb2 reports a queue error, e.g. an unplugged camera, on every poll from now on. */
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        log_error("%s: Capture queue error, stopping capture\n", pipeline->v4l2_dev.device_type_name);
+        atomic_store(&pipeline->capture.failed, true);
+        pipeline->capture.loop.stop = true;
+        event_loop_wakeup(&pipeline->processing.loop);
+        return;
+    }
+
+    if (events & EPOLLIN) {
+        v4l2_capture_process();
+    }
+}
+
+static void capture_wakeup_handler(struct event_source * source, uint32_t events)
+{
+    event_loop_wakeup_handler(source, events);
+    v4l2_capture_requeue();
+}
+
+static void * capture_thread_main(void * arg)
+{
+    pipeline = arg;
+
+    while (!pipeline->capture.loop.stop) {
+        if (event_loop_dispatch(&pipeline->capture.loop, -1) < 0 && errno != EINTR) {
+            log_error("CAPTURE: Event loop error %d, %s\n", errno, strerror(errno));
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int capture_thread_start()
+{
+    pthread_attr_t attr;
+    int ret;
+
+    if (pipeline->capture.running) {
+        return 0;
+    }
+
+    buffer_ring_reset(&pipeline->capture.ready);
+    buffer_ring_reset(&pipeline->capture.release);
+    atomic_store(&pipeline->capture.failed, false);
+
+    ret = event_loop_init(&pipeline->capture.loop);
+    if (ret < 0) {
+        return ret;
+    }
+    pipeline->capture.loop.wakeup.handler = capture_wakeup_handler;
+
+    CLEAR(pipeline->capture.v4l2);
+    pipeline->capture.v4l2.name    = "V4L2";
+    pipeline->capture.v4l2.fd      = pipeline->v4l2_dev.fd;
+    pipeline->capture.v4l2.handler = capture_v4l2_handler;
+
+    ret = event_loop_add(&pipeline->capture.loop, &pipeline->capture.v4l2, EPOLLIN);
+    if (ret < 0) {
+        event_loop_close(&pipeline->capture.loop);
+        return ret;
+    }
+
+    thread_attr_init(&attr, true);
+    ret = pthread_create(&pipeline->capture.thread, &attr, capture_thread_main, pipeline);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        log_error("CAPTURE: Unable to start thread: %s (%d).\n", strerror(ret), ret);
+        event_loop_close(&pipeline->capture.loop);
+        return -ret;
+    }
+
+    pipeline->capture.running = true;
+    log_info("CAPTURE: Thread started\n");
+    return 0;
+}
+
+static void capture_thread_stop()
+{
+    if (!pipeline->capture.running) {
+        return;
+    }
+
+    pipeline->capture.loop.stop = true;
+    event_loop_wakeup(&pipeline->capture.loop);
+    pthread_join(pipeline->capture.thread, NULL);
+
+    event_loop_close(&pipeline->capture.loop);
+    pipeline->capture.running = false;
+    log_info("CAPTURE: Thread stopped\n");
+}
+
+/* ---------------------------------------------------------------------------
+ * Buffer pool, maps capture buffers to UVC buffer slots
+ */
+
+static int buffer_pool_init(unsigned int capture_nbufs)
+{
+    unsigned int i;
+    unsigned int out;
+
+    if (capture_nbufs > BUFFER_POOL_SIZE) {
+        log_error("BUFFER POOL: Too many buffers (capture: %u, max: %u)\n",
+            capture_nbufs, BUFFER_POOL_SIZE);
+        return -EINVAL;
+    }
+
+    CLEAR(pipeline->buffer_pool);
+    pipeline->buffer_pool.capture_nbufs = capture_nbufs;
+
+    for (i = 0; i < BUFFER_POOL_SIZE; i++) {
+        pipeline->buffer_pool.state[i] = BUFFER_STATE_FREE;
+
+        for (out = 0; out < UVC_OUTPUT_MAX; out++) {
+            pipeline->buffer_pool.uvc[out].map[i]  = -1;
+            pipeline->buffer_pool.uvc[out].last[i] = -1;
+        }
+    }
+
+    for (out = 0; out < UVC_OUTPUT_MAX; out++) {
+        pipeline->buffer_pool.uvc[out].repeat_slot = -1;
+    }
+
+    log_info("BUFFER POOL: %u capture buffers\n", capture_nbufs);
+    return 0;
+}
+
+/* Hand a capture buffer back to the capture thread */
+static void buffer_pool_recycle(unsigned int index)
+{
+    if (!buffer_pool_check(index, BUFFER_STATE_BIT(BUFFER_STATE_READY) | BUFFER_STATE_BIT(BUFFER_STATE_UVC),
+            "recycled")) {
+        return;
+    }
+
+    pipeline->buffer_pool.state[index] = BUFFER_STATE_FREE;
+
+    if (!buffer_ring_push(&pipeline->capture.release, index)) {
+        log_warning("%s: Release ring overflow, buffer %u dropped\n",
+            pipeline->v4l2_dev.device_type_name, index);
+        return;
+    }
+    event_loop_wakeup(&pipeline->capture.loop);
+}
+
+/* Drop one reference on a capture buffer, the last one recycles it */
+static void buffer_pool_put(unsigned int index)
+{
+    if (--pipeline->buffer_pool.capture_refs[index] == 0) {
+        buffer_pool_recycle(index);
+    }
+}
+
+/* Pick a free UVC slot of an output, preferring the one that held this capture buffer last time */
+static int buffer_pool_acquire_slot(unsigned int out, unsigned int index)
+{
+    struct uvc_slots * slots = &pipeline->buffer_pool.uvc[out];
+    int slot = -1;
+    unsigned int i;
+
+    for (i = 0; i < slots->nbufs; i++) {
+        if (slots->map[i] != -1) {
+            continue;
+        }
+
+        if (slots->last[i] == (int) index) {
+            slot = i;
+            break;
+        }
+
+        if (slot == -1) {
+            slot = i;
+        }
+    }
+
+    if (slot >= 0) {
+        slots->map[slot]  = index;
+        slots->last[slot] = index;
+        slots->refs[slot] = 1;
+        pipeline->buffer_pool.state[index] = BUFFER_STATE_UVC;
+        pipeline->buffer_pool.capture_refs[index]++;
+    }
+    return slot;
+}
+
+/*
+ * Frees a UVC slot and drops its reference on the capture buffer it held.
+ * Returns that capture buffer, or BUFFER_POOL_DETACHED when the slot only
+ * held a copy of it.
+ */
+static int buffer_pool_release_slot(unsigned int out, unsigned int slot)
+{
+    struct uvc_slots * slots = &pipeline->buffer_pool.uvc[out];
+    int index;
+
+    if (slot >= slots->nbufs || slots->map[slot] == -1) {
+        return -1;
+    }
+
+    index = slots->map[slot];
+    slots->map[slot] = -1;
+    if (index != BUFFER_POOL_DETACHED) {
+        buffer_pool_put(index);
+    }
+    return index;
+}
+
+/* The UVC slot got a copy of the capture buffer, keep the slot busy without it */
+static void buffer_pool_detach_slot(unsigned int out, unsigned int slot)
+{
+    struct uvc_slots * slots = &pipeline->buffer_pool.uvc[out];
+    unsigned int index = slots->map[slot];
+
+    slots->map[slot] = BUFFER_POOL_DETACHED;
+    buffer_pool_put(index);
+}
+
+static void buffer_pool_pending_push(unsigned int index)
+{
+    /* The capture thread marks a buffer ready before handing it over. */
+    if (!buffer_pool_check(index, BUFFER_STATE_BIT(BUFFER_STATE_READY), "handed over")) {
+        return;
+    }
+
+    pipeline->buffer_pool.pending[pipeline->buffer_pool.npending++] = index;
+}
+
+static unsigned int buffer_pool_pending_pop()
+{
+    unsigned int index = pipeline->buffer_pool.pending[0];
+
+    pipeline->buffer_pool.npending--;
+    memmove(&pipeline->buffer_pool.pending[0], &pipeline->buffer_pool.pending[1],
+        pipeline->buffer_pool.npending * sizeof pipeline->buffer_pool.pending[0]);
+    return index;
+}
+
+/* Drop one reference on a UVC slot, the last one frees it */
+static int buffer_pool_unref_slot(unsigned int out, unsigned int slot)
+{
+    struct uvc_slots * slots = &pipeline->buffer_pool.uvc[out];
+
+    if (slot >= slots->nbufs || slots->map[slot] == -1) {
+        return -EINVAL;
+    }
+
+    if (--slots->refs[slot] > 0) {
+        return 0;
+    }
+
+    buffer_pool_release_slot(out, slot);
+    return 0;
+}
+
+/* Keep the newest completed frame referenced so it can be sent again, release the previous one */
+static void buffer_pool_hold_slot(unsigned int out, unsigned int slot)
+{
+    struct uvc_slots * slots = &pipeline->buffer_pool.uvc[out];
+    int held = slots->repeat_slot;
+
+    if (held >= 0 && slots->frame[held] >= slots->frame[slot]) {
+        return;
+    }
+
+    slots->refs[slot]++;
+    slots->repeat_slot = slot;
+
+    if (held >= 0) {
+        buffer_pool_unref_slot(out, held);
+    }
+}
+
+/* Start feeding a UVC output that began streaming */
+static void buffer_pool_attach(unsigned int out, unsigned int nbufs)
+{
+    pipeline->buffer_pool.uvc[out].nbufs = min(nbufs, BUFFER_POOL_SIZE);
+    pipeline->buffer_pool.uvc[out].repeat_slot = -1;
+}
+
+/* Take every capture buffer back from a UVC output that stopped streaming */
+static void buffer_pool_detach(unsigned int out)
+{
+    unsigned int slot;
+
+    for (slot = 0; slot < pipeline->buffer_pool.uvc[out].nbufs; slot++) {
+        buffer_pool_release_slot(out, slot);
+    }
+    pipeline->buffer_pool.uvc[out].nbufs = 0;
+    pipeline->buffer_pool.uvc[out].repeat_slot = -1;
+}
+
+/* Number of UVC outputs fed from the capture buffers, apart from the given one */
+static unsigned int buffer_pool_outputs(int except)
+{
+    unsigned int count = 0;
+    unsigned int out;
+
+    for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+        count += ((int) out != except && pipeline->buffer_pool.uvc[out].nbufs);
+    }
+    return count;
+}
+
+/* ---------------------------------------------------------------------------
+ * Statistics
+ */
+
+/* Time from one stage to the next, clamped at 0 for timestamps taken out of order */
+static uint64_t stats_elapsed(uint64_t from, uint64_t to)
+{
+    return (to > from) ? to - from : 0;
+}
+
+static void stats_histogram_add(struct stats_histogram * histogram, uint64_t latency)
+{
+    uint64_t us = (latency / 1000) >> STATS_BUCKET_SHIFT;
+    unsigned int bucket = (us) ? 64 - __builtin_clzll(us) : 0;
+
+    histogram->frames++;
+    histogram->total += latency;
+    histogram->max = max(histogram->max, latency);
+    histogram->window_max = max(histogram->window_max, latency);
+    histogram->buckets[min(bucket, STATS_BUCKETS - 1)]++;
+}
+
+/* Stamp a frame just queued on a UVC slot, all times are monotonic in ns */
+static void stats_frame_queued(struct v4l2_device * dev, unsigned int slot, uint64_t captured, uint64_t dequeued)
+{
+    struct uvc_slots * slots = &pipeline->buffer_pool.uvc[dev->index];
+    struct stats_output * output = &pipeline->stats.outputs[dev->index];
+
+    if (slot >= BUFFER_POOL_SIZE) {
+        return;
+    }
+
+    slots->timestamp[slot] = captured;
+    slots->dequeued[slot]  = dequeued;
+    slots->queued[slot]    = monotonic_ns();
+    output->queued_max = max(output->queued_max, (unsigned int) (dev->qbuf_count - dev->dqbuf_count));
+}
+
+/* Account a buffer completed by the UVC driver, repeated frames add no latency samples */
+static void stats_frame_done(struct v4l2_device * dev, const struct v4l2_buffer * ubuf, bool repeated)
+{
+    struct uvc_slots * slots = &pipeline->buffer_pool.uvc[dev->index];
+    struct stats_output * output = &pipeline->stats.outputs[dev->index];
+    struct stats_histogram * latency = pipeline->stats.latency;
+    uint64_t now = monotonic_ns();
+    uint64_t window;
+
+    output->frames++;
+    output->repeated += repeated;
+    output->bytes += ubuf->bytesused;
+    output->window_frames++;
+    output->window_bytes += ubuf->bytesused;
+
+    window = now - output->window_start;
+    if (window >= 1000000000ULL) {
+        output->frame_rate = output->window_frames * 1000000000ULL / window;
+        output->byte_rate = output->window_bytes * 1000000000ULL / window;
+        output->window_start = now;
+        output->window_frames = 0;
+        output->window_bytes = 0;
+    }
+
+    if (repeated || ubuf->index >= BUFFER_POOL_SIZE || !slots->queued[ubuf->index]) {
+        return;
+    }
+
+    stats_histogram_add(&latency[STATS_STAGE_CAPTURE],
+        stats_elapsed(slots->timestamp[ubuf->index], slots->dequeued[ubuf->index]));
+    stats_histogram_add(&latency[STATS_STAGE_PROCESS],
+        stats_elapsed(slots->dequeued[ubuf->index], slots->queued[ubuf->index]));
+    stats_histogram_add(&latency[STATS_STAGE_TRANSFER],
+        stats_elapsed(slots->queued[ubuf->index], now));
+    stats_histogram_add(&latency[STATS_STAGE_TOTAL],
+        stats_elapsed(slots->timestamp[ubuf->index], now));
+
+    slots->queued[ubuf->index] = 0;
+}
+
+static void __attribute__((format(printf, 4, 5)))
+stats_print(char * text, size_t size, size_t * used, const char * format, ...)
+{
+    va_list args;
+    int ret;
+
+    if (*used >= size) {
+        return;
+    }
+
+    va_start(args, format);
+    ret = vsnprintf(text + *used, size - *used, format, args);
+    va_end(args);
+
+    if (ret > 0) {
+        *used = min(*used + ret, size - 1);
+    }
+}
+
+/* Format the counters and histograms as text, returns its length */
+static size_t stats_snapshot(char * text, size_t size)
+{
+    struct stats * stats = &pipeline->stats;
+    struct stats_histogram * histogram;
+    struct stats_output * output;
+    struct v4l2_device * dev;
+    uint64_t now = monotonic_ns();
+    unsigned int stage;
+    unsigned int out;
+    unsigned int i;
+    size_t used = 0;
+
+    stats_print(text, size, &used, "pipeline: %u\n", pipeline->index);
+    stats_print(text, size, &used, "uptime: %llu ms\n",
+        (unsigned long long) ((now - stats->started) / 1000000));
+    stats_print(text, size, &used, "source: %s\n",
+        (pipeline->settings.source_device == DEVICE_TYPE_FRAMEBUFFER) ?
+            pipeline->settings.fb_devname : pipeline->settings.v4l2_devname);
+    stats_print(text, size, &used, "frames captured: %llu\n", (unsigned long long) stats->frames_captured);
+    stats_print(text, size, &used, "stale frames dropped: %llu\n", (unsigned long long) stats->stale_dropped);
+    if (pipeline->settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
+        stats_print(text, size, &used, "identical frames skipped: %llu\n",
+            (unsigned long long) stats->identical_skipped);
+    }
+    stats_print(text, size, &used, "deadline misses: %u\n", pipeline->processing.deadline_misses);
+    stats_print(text, size, &used, "capture pending: %u, max %u\n",
+        pipeline->buffer_pool.npending, stats->pending_max);
+
+    for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+        dev = &pipeline->uvc_devs[out];
+        output = &stats->outputs[out];
+
+        /* The rate of the last second is stale once completions stop. */
+        if (now - output->window_start > 2000000000ULL) {
+            output->frame_rate = 0;
+            output->byte_rate = 0;
+        }
+
+        stats_print(text, size, &used,
+            "output %s: %s, frames %llu, repeated %llu, skipped %llu, bytes %llu\n",
+            pipeline->settings.uvc_devnames[out], (dev->is_streaming) ? "streaming" : "idle",
+            (unsigned long long) output->frames, (unsigned long long) output->repeated,
+            (unsigned long long) output->skipped, (unsigned long long) output->bytes);
+        stats_print(text, size, &used, "output %s: queued %u, max %u, %llu fps, %llu bytes/s\n",
+            pipeline->settings.uvc_devnames[out],
+            (dev->is_streaming) ? (unsigned int) (dev->qbuf_count - dev->dqbuf_count) : 0,
+            output->queued_max, (unsigned long long) output->frame_rate,
+            (unsigned long long) output->byte_rate);
+    }
+
+    for (stage = 0; stage < STATS_STAGES; stage++) {
+        histogram = &stats->latency[stage];
+
+        stats_print(text, size, &used, "latency %s: frames %llu, avg %llu us, max %llu us\n",
+            stats_stage_names[stage], (unsigned long long) histogram->frames,
+            (unsigned long long) ((histogram->frames) ? histogram->total / histogram->frames / 1000 : 0),
+            (unsigned long long) (histogram->max / 1000));
+
+        stats_print(text, size, &used, "latency %s histogram:", stats_stage_names[stage]);
+        for (i = 0; i < STATS_BUCKETS; i++) {
+            stats_print(text, size, &used, " %llu", (unsigned long long) histogram->buckets[i]);
+        }
+        stats_print(text, size, &used, "\n");
+    }
+    return used;
+}
+
+/* Every client gets one snapshot, the connection is closed right after it */
+static void stats_socket_handler(struct event_source * source, uint32_t events)
+{
+    char text[STATS_SNAPSHOT_SIZE];
+    size_t length;
+    int fd;
+
+    (void)(events);
+
+    fd = accept4(source->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            log_warning("STATS: Unable to accept connection: %s (%d).\n", strerror(errno), errno);
+        }
+        return;
+    }
+
+    length = stats_snapshot(text, sizeof(text));
+
+    /* A fresh socket buffer holds the whole snapshot, a client that went away is not waited for. */
+    if (send(fd, text, length, MSG_NOSIGNAL) < 0) {
+        log_debug("STATS: Unable to send snapshot: %s (%d).\n", strerror(errno), errno);
+    }
+    close(fd);
+}
+
+static int stats_open()
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    const char * path = pipeline->settings.stats_socket;
+
+    pipeline->stats.started = monotonic_ns();
+
+    if (!path) {
+        return 0;
+    }
+
+    CLEAR(addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("STATS: Socket path too long: %s\n", path);
+        return -EINVAL;
+    }
+    strcpy(addr.sun_path, path);
+
+    /* A socket left behind by an earlier run would make bind() fail, other files are kept. */
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    pipeline->stats.socket.name    = "STATS";
+    pipeline->stats.socket.handler = stats_socket_handler;
+    pipeline->stats.socket.fd      = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (pipeline->stats.socket.fd < 0) {
+        log_error("STATS: Unable to create socket: %s (%d).\n", strerror(errno), errno);
+        return -EINVAL;
+    }
+
+    if (bind(pipeline->stats.socket.fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        log_error("STATS: Unable to bind %s: %s (%d).\n", path, strerror(errno), errno);
+        close(pipeline->stats.socket.fd);
+        pipeline->stats.socket.fd = -1;
+        return -EINVAL;
+    }
+    pipeline->stats.bound = true;
+
+    if (listen(pipeline->stats.socket.fd, STATS_SOCKET_BACKLOG) < 0) {
+        log_error("STATS: Unable to listen on %s: %s (%d).\n", path, strerror(errno), errno);
+        return -EINVAL;
+    }
+
+    log_info("STATS: Listening on %s\n", path);
+    return event_loop_add(&pipeline->processing.loop, &pipeline->stats.socket, EPOLLIN);
+}
+
+static void stats_close()
+{
+    if (pipeline->stats.socket.fd >= 0) {
+        close(pipeline->stats.socket.fd);
+        pipeline->stats.socket.fd = -1;
+    }
+
+    /* Only the socket bound by this pipeline is removed. */
+    if (pipeline->stats.bound) {
+        unlink(pipeline->settings.stats_socket);
+        pipeline->stats.bound = false;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Output thread
+ */
+
+static int uvc_dmabuf_fallback(struct v4l2_device * dev)
+{
+    unsigned int out;
+    bool shared = false;
+
+    uvc_request_bufs(dev, 0);
+
+    /* Other outputs may still import the exported capture buffers. */
+    for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+        shared |= (out != dev->index && pipeline->buffer_pool.uvc[out].nbufs &&
+            pipeline->uvc_devs[out].memory_type == V4L2_MEMORY_DMABUF);
+    }
+    if (!shared) {
+        v4l2_unexport_bufs(&pipeline->v4l2_dev);
+    }
+
+    log_warning("%s: Falling back to %s\n",
+        dev->device_type_name, v4l2_memory_type_name(V4L2_MEMORY_USERPTR));
+
+    dev->memory_type = V4L2_MEMORY_USERPTR;
+    return (uvc_request_bufs(dev, dev->nbufs) < 0) ? -EINVAL : 0;
+}
+
+/* Run the stages of the format plan on one captured YUYV frame, returns the payload size */
+static int uvc_v4l2_convert(struct v4l2_device * dev, const struct buffer * src, struct buffer * dst)
+{
+    const uint8_t * frame = src->start;
+    unsigned int stride = max(pipeline->v4l2_dev.pix.bytesperline, pipeline->v4l2_dev.pix.width * 2);
+    unsigned int width = pipeline->v4l2_dev.pix.width;
+    unsigned int height = pipeline->v4l2_dev.pix.height;
+    uint8_t * scaled;
+
+    if (pipeline->format_plan.scale) {
+        width = dev->pix.width;
+        height = dev->pix.height;
+        if ((size_t) width * height * 2 > ((pipeline->jpeg.active) ? pipeline->format_plan.scaled.length : dst->length)) {
+            return -ENOSPC;
+        }
+
+        scaled = (pipeline->jpeg.active) ? pipeline->format_plan.scaled.start : dst->start;
+        yuyv_scale(frame, stride, pipeline->v4l2_dev.pix.width, pipeline->v4l2_dev.pix.height, scaled, width, height);
+        if (!pipeline->jpeg.active) {
+            return width * height * 2;
+        }
+
+        frame = scaled;
+        stride = width * 2;
+    }
+
+    return jpeg_encode(frame, stride, width, height, dst->start,
+        min(dst->length, dev->pix.sizeimage));
+}
+
+/*
+ * Frame stage job: convert the capture buffer once and copy the payload
+ * into the slots of the other outputs.
+ */
+static void uvc_v4l2_convert_job(void * data)
+{
+    struct frame_stage * stage = data;
+    struct v4l2_device * dev;
+    struct buffer * dst;
+    const void * converted = NULL;
+    int size = 0;
+    unsigned int out;
+
+    for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+        if (stage->slot[out] < 0) {
+            continue;
+        }
+
+        dev = &pipeline->uvc_devs[out];
+        dst = &dev->mem[stage->slot[out]];
+
+        if (converted && (size_t) size <= dst->length) {
+            memcpy(dst->start, converted, size);
+            stage->size[out] = size;
+            continue;
+        }
+
+        stage->size[out] = uvc_v4l2_convert(dev, &pipeline->v4l2_dev.mem[stage->index], dst);
+        if (stage->size[out] < 0) {
+            log_error("%s: Frame conversion failed: %s (%d).\n",
+                dev->device_type_name, strerror(-stage->size[out]), -stage->size[out]);
+            continue;
+        }
+        converted = dst->start;
+        size = stage->size[out];
+    }
+}
+
+/* Queue a UVC slot, size is the payload converted into the slot, ignored when the capture buffer is sent */
+static int uvc_v4l2_qbuf(struct v4l2_device * dev, unsigned int index, unsigned int slot, int size)
+{
+    struct uvc_slots * slots = &pipeline->buffer_pool.uvc[dev->index];
+    struct v4l2_buffer ubuf;
+
+retry:
+    /* Queue video buffer to UVC domain. */
+    CLEAR(ubuf);
+    ubuf.type      = dev->buffer_type;
+    ubuf.memory    = dev->memory_type;
+    ubuf.length    = pipeline->v4l2_dev.mem[index].length;
+    ubuf.index     = slot;
+    ubuf.bytesused = pipeline->v4l2_dev.mem[index].buf.bytesused;
+
+    if (pipeline->format_plan.convert) {
+        /* UVC slots own their memory, the frame stage converted the frame into it. */
+        ubuf.length    = dev->mem[slot].length;
+        ubuf.bytesused = size;
+        ubuf.m.userptr = (unsigned long) dev->mem[slot].start;
+
+    } else if (dev->memory_type == V4L2_MEMORY_DMABUF) {
+        ubuf.m.fd = pipeline->v4l2_dev.mem[index].dmabuf_fd;
+    } else {
+        ubuf.m.userptr = (unsigned long) pipeline->v4l2_dev.mem[index].start;
+    }
+
+    if (ioctl(dev->fd, VIDIOC_QBUF, &ubuf) < 0) {
+        /* Check for a USB disconnect/shutdown event. */
+        if (errno == ENODEV) {
+            dev->uvc_shutdown_requested = true;
+            log_warning("%s: Possible USB shutdown requested from Host, seen during VIDIOC_QBUF\n",
+                dev->device_type_name);
+
+        } else if (dev->memory_type == V4L2_MEMORY_DMABUF && !dev->is_streaming) {
+            /* The DMABUF import is only checked by the first QBUF, retry as USERPTR. */
+            log_error("%s: DMABUF import failed: %s (%d).\n",
+                dev->device_type_name, strerror(errno), errno);
+
+            if (uvc_dmabuf_fallback(dev) == 0) {
+                goto retry;
+            }
+        }
+        return -EINVAL;
+    }
+
+    slots->buf[slot]      = ubuf;
+    slots->frame[slot]    = pipeline->buffer_pool.frame_sequence;
+    slots->repeated[slot] = false;
+
+    dev->qbuf_count++;
+    return 0;
+}
+
+/*
+ * Send the newest completed frame again on every output where the camera
+ * missed the host deadline. The UVC slot is queued as it is, nothing is
+ * copied. Frames are only repeated into an empty queue so they never add
+ * latency.
+ */
+static void uvc_v4l2_repeat_frame()
+{
+    struct v4l2_device * dev;
+    struct uvc_slots * slots;
+    struct v4l2_buffer ubuf;
+    unsigned int out;
+    int slot;
+
+    for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+        dev = &pipeline->uvc_devs[out];
+        slots = &pipeline->buffer_pool.uvc[out];
+        slot = slots->repeat_slot;
+
+        if (!dev->is_streaming || slot < 0 || slots->refs[slot] > 1 ||
+            dev->qbuf_count > dev->dqbuf_count
+        ) {
+            continue;
+        }
+
+        ubuf = slots->buf[slot];
+        if (ioctl(dev->fd, VIDIOC_QBUF, &ubuf) < 0) {
+            log_error("%s: Unable to repeat buffer %u: %s (%d).\n",
+                dev->device_type_name, slot, strerror(errno), errno);
+            continue;
+        }
+
+        slots->refs[slot]++;
+        slots->repeated[slot] = true;
+        dev->qbuf_count++;
+    }
+}
+
+/* Stamp a frame just queued on a UVC slot and start the output on its first frame */
+static void uvc_v4l2_slot_queued(struct v4l2_device * dev, unsigned int index, unsigned int slot)
+{
+    stats_frame_queued(dev, slot,
+        (uint64_t) pipeline->v4l2_dev.mem[index].buf.timestamp.tv_sec * 1000000000 +
+        (uint64_t) pipeline->v4l2_dev.mem[index].buf.timestamp.tv_usec * 1000,
+        pipeline->buffer_pool.dequeued[index]);
+
+    if (!dev->is_streaming) {
+        uvc_video_stream(dev, STREAM_ON);
+        pipeline->settings.blink_on_startup = 0;
+        streaming_status_value(dev->is_streaming);
+
+        log_info("%s: First frame queued %u ms after STREAMON\n", dev->device_type_name,
+            (unsigned int) ((monotonic_ns() - dev->streamon_time) / 1000000));
+    }
+}
+
+/* Account a frame queued to at least one output, the busy ones skipped it */
+static void uvc_v4l2_frame_queued(unsigned int busy_outputs)
+{
+    unsigned int out;
+
+    pipeline->stats.frames_captured++;
+
+    for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+        pipeline->stats.outputs[out].skipped += (busy_outputs >> out) & 1;
+    }
+
+    /* A fresh frame is queued, move the repeat deadline. */
+    if (pipeline->settings.frame_repeat) {
+        event_timer_arm(&pipeline->processing.repeat_timer, pipeline->processing.frame_interval * 3 / 2, 0);
+    }
+}
+
+/* Queue one capture buffer to a UVC output, returns -EBUSY when all its slots are in use */
+static int uvc_v4l2_deliver(struct v4l2_device * dev, unsigned int index)
+{
+    int slot;
+
+    slot = buffer_pool_acquire_slot(dev->index, index);
+    if (slot < 0) {
+        return -EBUSY;
+    }
+
+    if (uvc_v4l2_qbuf(dev, index, slot, 0) < 0) {
+        buffer_pool_release_slot(dev->index, slot);
+        return -EINVAL;
+    }
+
+    uvc_v4l2_slot_queued(dev, index, slot);
+    return 0;
+}
+
+/*
+ * Hand the oldest waiting capture buffer to the frame stage with a slot of
+ * every streaming output to convert it into. Returns -EBUSY while a frame
+ * is converted or every output is busy.
+ */
+static int uvc_v4l2_convert_submit()
+{
+    struct frame_stage * stage = &pipeline->frame_stage;
+    unsigned int index;
+    unsigned int out;
+    unsigned int queued;
+    int slot;
+
+    while (!stage->busy && pipeline->buffer_pool.npending > 0) {
+        index = pipeline->buffer_pool.pending[0];
+        queued = 0;
+        stage->busy_outputs = 0;
+
+        /* Hold the buffer until it is converted for every output. */
+        pipeline->buffer_pool.capture_refs[index] = 1;
+        pipeline->buffer_pool.frame_sequence++;
+
+        for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+            stage->slot[out] = -1;
+            if (!pipeline->buffer_pool.uvc[out].nbufs) {
+                continue;
+            }
+
+            slot = buffer_pool_acquire_slot(out, index);
+            if (slot < 0) {
+                stage->busy_outputs |= 1U << out;
+                continue;
+            }
+            stage->slot[out] = slot;
+            queued++;
+        }
+
+        /* Every output is busy, the frame waits. A busy output among others skips it. */
+        if (!queued && stage->busy_outputs) {
+            pipeline->buffer_pool.capture_refs[index] = 0;
+            pipeline->buffer_pool.state[index] = BUFFER_STATE_READY;
+            return -EBUSY;
+        }
+
+        buffer_pool_pending_pop();
+        if (!queued) {
+            buffer_pool_put(index);
+            continue;
+        }
+
+        stage->index = index;
+        frame_stage_submit(uvc_v4l2_convert_job);
+    }
+    return (stage->busy) ? -EBUSY : 0;
+}
+
+/* Queue a frame converted by the frame stage, the capture buffer goes back to the camera */
+static void uvc_v4l2_convert_done()
+{
+    struct frame_stage * stage = &pipeline->frame_stage;
+    struct v4l2_device * dev;
+    unsigned int queued = 0;
+    unsigned int out;
+    int slot;
+
+    for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+        slot = stage->slot[out];
+        if (slot < 0) {
+            continue;
+        }
+
+        dev = &pipeline->uvc_devs[out];
+        if (stage->size[out] < 0 || uvc_v4l2_qbuf(dev, stage->index, slot, stage->size[out]) < 0) {
+            buffer_pool_release_slot(out, slot);
+            continue;
+        }
+
+        uvc_v4l2_slot_queued(dev, stage->index, slot);
+        buffer_pool_detach_slot(out, slot);
+        queued++;
+    }
+
+    buffer_pool_put(stage->index);
+    if (queued) {
+        uvc_v4l2_frame_queued(stage->busy_outputs);
+    }
+}
+
+static void v4l2_uvc_video_process()
+{
+    uint64_t delay;
+    unsigned int index;
+    unsigned int out;
+    unsigned int queued;
+    unsigned int busy;
+    unsigned int busy_outputs;
+    int ret;
+
+    /* Buffers handed over by the capture thread wait for a free UVC slot. */
+    while (buffer_ring_pop(&pipeline->capture.ready, &index)) {
+        buffer_pool_pending_push(index);
+        pipeline->stats.pending_max = max(pipeline->stats.pending_max, pipeline->buffer_pool.npending);
+
+        /* A frame picked up later than one host frame period can no longer be sent on time. */
+        delay = monotonic_ns() - pipeline->buffer_pool.dequeued[index];
+        if (!pipeline->processing.standby && pipeline->processing.frame_interval &&
+            delay > pipeline->processing.frame_interval
+        ) {
+            deadline_miss(pipeline->v4l2_dev.device_type_name, "frame picked up",
+                delay - pipeline->processing.frame_interval);
+        }
+    }
+
+    /* In latest-frame mode only the newest frame waits, older ones go back to the camera. */
+    while ((pipeline->settings.latest_frame || pipeline->processing.standby) && pipeline->buffer_pool.npending > 1) {
+        buffer_pool_recycle(buffer_pool_pending_pop());
+        pipeline->stats.stale_dropped += !pipeline->processing.standby;
+    }
+
+    /* Without a host the newest frame is kept ready for STREAMON. */
+    if (pipeline->processing.standby) {
+        return;
+    }
+
+    if (pipeline->format_plan.convert) {
+        uvc_v4l2_convert_submit();
+        return;
+    }
+
+    while (pipeline->buffer_pool.npending > 0) {
+        index = pipeline->buffer_pool.pending[0];
+        queued = 0;
+        busy = 0;
+        busy_outputs = 0;
+
+        /* Hold the buffer while it is queued to every streaming output. */
+        pipeline->buffer_pool.capture_refs[index] = 1;
+        pipeline->buffer_pool.frame_sequence++;
+
+        for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+            if (!pipeline->buffer_pool.uvc[out].nbufs) {
+                continue;
+            }
+
+            ret = uvc_v4l2_deliver(&pipeline->uvc_devs[out], index);
+            queued += (ret == 0);
+            busy += (ret == -EBUSY);
+            busy_outputs |= (ret == -EBUSY) << out;
+        }
+
+        /* Every output is busy, the frame waits. A busy output among others skips it. */
+        if (!queued && busy) {
+            pipeline->buffer_pool.capture_refs[index] = 0;
+            pipeline->buffer_pool.state[index] = BUFFER_STATE_READY;
+            break;
+        }
+
+        buffer_pool_pending_pop();
+        buffer_pool_put(index);
+
+        if (queued) {
+            uvc_v4l2_frame_queued(busy_outputs);
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * V4L2 generic stuff
+ */
+
+static int v4l2_get_format(struct v4l2_device * dev)
+{
+    struct v4l2_format fmt;
+    int ret;
+
+    CLEAR(fmt);
+    fmt.type = dev->buffer_type;
+
+    ret = ioctl(dev->fd, VIDIOC_G_FMT, &fmt);
+    if (ret < 0) {
+        return ret;
+    }
+    dev->pix = fmt.fmt.pix;
+
+    log_debug("%s: Getting current format: %c%c%c%c %ux%u\n",
+        dev->device_type_name, pixfmtstr(fmt.fmt.pix.pixelformat),
+        fmt.fmt.pix.width, fmt.fmt.pix.height);
+
+    return 0;
+}
+
+static int v4l2_set_format(struct v4l2_device * dev, struct v4l2_format * fmt)
+{
+    int ret;
+
+    ret = ioctl(dev->fd, VIDIOC_S_FMT, fmt);
+    if (ret < 0) {
+        log_error("%s: Unable to set format %s (%d).\n",
+            dev->device_type_name, strerror(errno), errno);
+        return ret;
+    }
+
+    log_info("%s: Setting format to: %c%c%c%c %ux%u\n",
+        dev->device_type_name, pixfmtstr(fmt->fmt.pix.pixelformat),
+        fmt->fmt.pix.width, fmt->fmt.pix.height);
+
+    return 0;
+}
+
+static int v4l2_apply_format(struct v4l2_device * dev, unsigned int pixelformat,
+    unsigned int width, unsigned int height)
+{
+    struct v4l2_format fmt;
+    int ret = -EINVAL;
+
+    if (dev->is_streaming || !dev->fd) {
+        return ret;
+    }
+
+    CLEAR(fmt);
+    fmt.type                = dev->buffer_type;
+    fmt.fmt.pix.width       = width;
+    fmt.fmt.pix.height      = height;
+    fmt.fmt.pix.sizeimage   = get_frame_size(pixelformat, width, height);
+    fmt.fmt.pix.pixelformat = pixelformat;
+    fmt.fmt.pix.field       = V4L2_FIELD_ANY;
+
+    ret = v4l2_set_format(dev, &fmt);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return v4l2_get_format(dev);
+}
+
+static unsigned int v4l2_fract_to_interval(struct v4l2_fract fract)
+{
+    return (fract.denominator) ? (uint64_t) fract.numerator * 10000000 / fract.denominator : 0;
+}
+
+/*
+ * Set the capture rate closest to the interval (in 100 ns units) among the
+ * ones the driver enumerates for the current format, so the sensor doesn't
+ * produce frames the host never asked for.
+ */
+static int v4l2_apply_frame_interval(struct v4l2_device * dev, unsigned int interval)
+{
+    struct v4l2_frmivalenum frmival;
+    struct v4l2_streamparm parm;
+    struct v4l2_fract best = { interval, 10000000 };
+    unsigned int best_diff = UINT_MAX;
+    unsigned int minimum;
+    unsigned int maximum;
+    unsigned int step;
+    unsigned int value;
+    unsigned int diff;
+
+    if (!dev->fd || !interval) {
+        return -EINVAL;
+    }
+
+    CLEAR(parm);
+    parm.type = dev->buffer_type;
+
+    if (ioctl(dev->fd, VIDIOC_G_PARM, &parm) < 0 ||
+        !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)
+    ) {
+        log_warning("%s: Frame interval can't be set\n", dev->device_type_name);
+        return -ENOTSUP;
+    }
+
+    CLEAR(frmival);
+    frmival.pixel_format = dev->pix.pixelformat;
+    frmival.width = dev->pix.width;
+    frmival.height = dev->pix.height;
+
+    while (ioctl(dev->fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) == 0) {
+        if (frmival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+            value = v4l2_fract_to_interval(frmival.discrete);
+            diff = (value > interval) ? value - interval : interval - value;
+            if (value && diff < best_diff) {
+                best_diff = diff;
+                best = frmival.discrete;
+            }
+            frmival.index++;
+            continue;
+        }
+
+        /* Continuous and stepwise ranges, snapped to the step. */
+        minimum = v4l2_fract_to_interval(frmival.stepwise.min);
+        maximum = v4l2_fract_to_interval(frmival.stepwise.max);
+        step = (frmival.type == V4L2_FRMIVAL_TYPE_STEPWISE) ?
+            v4l2_fract_to_interval(frmival.stepwise.step) : 0;
+
+        value = clamp(interval, minimum, max(minimum, maximum));
+        if (step) {
+            value = min(minimum + (value - minimum + step / 2) / step * step, maximum);
+        }
+        best.numerator = value;
+        best.denominator = 10000000;
+        break;
+    }
+
+    CLEAR(parm);
+    parm.type = dev->buffer_type;
+    parm.parm.capture.timeperframe = best;
+
+    if (ioctl(dev->fd, VIDIOC_S_PARM, &parm) < 0) {
+        log_error("%s: Unable to set frame interval: %s (%d).\n",
+            dev->device_type_name, strerror(errno), errno);
+        return -errno;
+    }
+
+    value = v4l2_fract_to_interval(parm.parm.capture.timeperframe);
+    log_info("%s: Setting frame rate to: %u.%u fps (requested %u.%u fps)\n",
+        dev->device_type_name, (value) ? 10000000 / value : 0, (value) ? 100000000 / value % 10 : 0,
+        10000000 / interval, 100000000 / interval % 10);
+
+    return 0;
+}
+
+static void v4l2_set_ctrl_value(const struct control_mapping_pair * mapping, unsigned int uvc_value,
+    unsigned int ctrl_v4l2, int v4l2_ctrl_value)
+{
+    struct v4l2_control control;
+
+    CLEAR(control);
+    control.id = ctrl_v4l2;
+    control.value = v4l2_ctrl_value;
+
+    if (ioctl(pipeline->v4l2_dev.fd, VIDIOC_S_CTRL, &control) == -1) {
+        log_error("%s: %s VIDIOC_S_CTRL failed: %s (%d).\n",
+            uvc_dev.device_type_name, mapping->v4l2_name, strerror(errno), errno);
+        return;
+    }
+    log_debug("%s: %s changed value (V4L2: %d, UVC: %d)\n",
+        uvc_dev.device_type_name, mapping->v4l2_name, v4l2_ctrl_value, uvc_value);
+}
+
+/* Check the cached V4L2 flags before a control is set */
+static bool v4l2_ctrl_writable(const struct control_mapping_pair * mapping, unsigned int flags)
+{
+    if (flags & V4L2_CTRL_FLAG_DISABLED) {
+        log_warning("%s: %s is disabled.\n", uvc_dev.device_type_name, mapping->v4l2_name);
+        return false;
+    }
+
+    if (flags & V4L2_CTRL_FLAG_READ_ONLY) {
+        log_warning("%s: %s is read-only.\n", uvc_dev.device_type_name, mapping->v4l2_name);
+        return false;
+    }
+    return true;
+}
+
+/* V4L2 value of a control from its UVC value, clamped to the UVC range */
+static int v4l2_ctrl_from_uvc(struct control_state ctrl)
+{
+    int v4l2_diff = ctrl.v4l2_maximum - ctrl.v4l2_minimum;
+    int ctrl_diff = ctrl.maximum - ctrl.minimum;
+
+    if (ctrl.value < ctrl.minimum) {
+        ctrl.value = ctrl.minimum;
+    }
+
+    if (ctrl.value > ctrl.maximum) {
+        ctrl.value = ctrl.maximum;
+    }
+
+    return (ctrl.value - ctrl.minimum) * v4l2_diff / ctrl_diff + ctrl.v4l2_minimum;
+}
+
+static void v4l2_set_ctrl(unsigned int index)
+{
+    const struct control_mapping_pair * mapping = &control_mapping[index];
+    struct control_state * ctrl = &pipeline->controls[index];
+    int v4l2_ctrl_value = v4l2_ctrl_from_uvc(*ctrl);
+
+    if (!v4l2_ctrl_writable(mapping, ctrl->flags)) {
+        return;
+    }
+
+    v4l2_set_ctrl_value(mapping, ctrl->value, mapping->v4l2, v4l2_ctrl_value);
+
+    if (ctrl->secondary && v4l2_ctrl_writable(mapping, ctrl->secondary_flags)) {
+        v4l2_set_ctrl_value(mapping, ctrl->value, V4L2_CID_BLUE_BALANCE, v4l2_ctrl_value);
+    }
+}
+
+static void v4l2_apply_camera_control(unsigned int index,
+    struct v4l2_queryctrl queryctrl, struct v4l2_control control)
+{
+    const struct control_mapping_pair * mapping = &control_mapping[index];
+    struct control_state * ctrl = &pipeline->controls[index];
+
+    ctrl->enabled       = true;
+    ctrl->flags         = queryctrl.flags;
+    ctrl->control_type  = queryctrl.type;
+    ctrl->v4l2_minimum  = queryctrl.minimum;
+    ctrl->v4l2_maximum  = queryctrl.maximum;
+    ctrl->minimum       = 0;
+    ctrl->maximum       = (0 - queryctrl.minimum) + queryctrl.maximum;
+    ctrl->step          = queryctrl.step;
+    ctrl->default_value = (0 - queryctrl.minimum) + queryctrl.default_value;
+    ctrl->value         = (0 - queryctrl.minimum) + control.value;
+    
+    log_info("V4L2: Supported control %s (%s = %s)\n", queryctrl.name,
+        mapping->v4l2_name, mapping->uvc_name);
+
+    log_debug("V4L2:   V4L2: min: %d, max: %d, step: %d, default: %d, value: %d\n",
+        queryctrl.minimum,
+        queryctrl.maximum,
+        queryctrl.step,
+        queryctrl.default_value,
+        control.value
+    );
+
+    log_debug("V4L2:   UVC: min: %d, max: %d, step: %d, default: %d, value: %d\n",
+        ctrl->minimum,
+        ctrl->maximum,
+        queryctrl.step,
+        ctrl->default_value,
+        ctrl->value
+    );
+}
+
+/* Index every mapped control by its UVC unit type and selector */
+static void control_lookup_build()
+{
+    int i;
+
+    CLEAR(pipeline->control_lookup);
+
+    for (i = 0; i < control_mapping_size; i++) {
+        if (control_mapping[i].type < CONTROL_UNIT_TYPES && control_mapping[i].uvc < CONTROL_SELECTORS) {
+            pipeline->control_lookup[control_mapping[i].type][control_mapping[i].uvc] = i + 1;
+        }
+    }
+}
+
+/* Index of the control for a UVC unit type and selector, -1 if none is mapped */
+static int control_lookup(unsigned int type, unsigned int selector)
+{
+    if (type >= CONTROL_UNIT_TYPES || selector >= CONTROL_SELECTORS) {
+        return -1;
+    }
+    return (int) pipeline->control_lookup[type][selector] - 1;
+}
+
+/* Ask for V4L2_EVENT_CTRL when the driver or another process changes a control */
+static void v4l2_subscribe_control(unsigned int id)
+{
+    struct v4l2_event_subscription sub;
+
+    CLEAR(sub);
+    sub.type = V4L2_EVENT_CTRL;
+    sub.id   = id;
+
+    if (ioctl(pipeline->v4l2_dev.fd, VIDIOC_SUBSCRIBE_EVENT, &sub) < 0) {
+        log_error("V4L2: Unable to subscribe to control %08x events: %s (%d).\n", id, strerror(errno), errno);
+    }
+}
+
+/* Index of the control mapped to a V4L2 control, the blue balance belongs to red */
+static int control_find_v4l2(unsigned int id)
+{
+    int i;
+
+    if (id == V4L2_CID_BLUE_BALANCE) {
+        id = V4L2_CID_RED_BALANCE;
+    }
+
+    for (i = 0; i < control_mapping_size; i++) {
+        if (control_mapping[i].v4l2 == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void v4l2_get_controls()
+{
+    int i;
+    struct v4l2_queryctrl queryctrl;
+    struct v4l2_control control;
+    unsigned int id;
+    const unsigned next_fl = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+    CLEAR(queryctrl);
+
+    control_lookup_build();
+
+    queryctrl.id = next_fl;
+    while (0 == ioctl (pipeline->v4l2_dev.fd, VIDIOC_QUERYCTRL, &queryctrl)) {
+
+        id = queryctrl.id;
+        queryctrl.id |= next_fl;
+
+        if (queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) {
+            continue;
+        }
+
+        i = control_find_v4l2(id);
+        if (i < 0) {
+            continue;
+        }
+
+        if (id == V4L2_CID_BLUE_BALANCE) {
+            /* Set along with red balance, only its flags are kept. */
+            pipeline->controls[i].secondary = true;
+            pipeline->controls[i].secondary_flags = queryctrl.flags;
+            v4l2_subscribe_control(id);
+            continue;
+        }
+
+        control.id = queryctrl.id;
+        if (0 == ioctl (pipeline->v4l2_dev.fd, VIDIOC_G_CTRL, &control)) {
+            v4l2_apply_camera_control(i, queryctrl, control);
+            v4l2_subscribe_control(id);
+        }
+    }
+}
+
+/* Update the cached control from a V4L2_EVENT_CTRL, no query is needed */
+static void v4l2_control_event(const struct v4l2_event * event)
+{
+    const struct v4l2_event_ctrl * change = &event->u.ctrl;
+    struct control_state * ctrl;
+    int i = control_find_v4l2(event->id);
+
+    if (i < 0 || !pipeline->controls[i].enabled) {
+        return;
+    }
+    ctrl = &pipeline->controls[i];
+
+    if (event->id == V4L2_CID_BLUE_BALANCE) {
+        if (change->changes & V4L2_EVENT_CTRL_CH_FLAGS) {
+            ctrl->secondary_flags = change->flags;
+        }
+        return;
+    }
+
+    if (change->changes & V4L2_EVENT_CTRL_CH_FLAGS) {
+        ctrl->flags = change->flags;
+    }
+
+    if (change->changes & V4L2_EVENT_CTRL_CH_RANGE) {
+        ctrl->v4l2_minimum  = change->minimum;
+        ctrl->v4l2_maximum  = change->maximum;
+        ctrl->maximum       = (0 - change->minimum) + change->maximum;
+        ctrl->step          = change->step;
+        ctrl->default_value = (0 - change->minimum) + change->default_value;
+    }
+
+    if (change->changes & V4L2_EVENT_CTRL_CH_VALUE) {
+        ctrl->value = (0 - ctrl->v4l2_minimum) + change->value;
+        log_info("V4L2: %s changed by the camera (V4L2: %d, UVC: %d)\n",
+            control_mapping[i].v4l2_name, change->value, ctrl->value);
+    }
+}
+
+static void v4l2_dequeue_events()
+{
+    struct v4l2_event event;
+
+    CLEAR(event);
+    while (ioctl(pipeline->v4l2_dev.fd, VIDIOC_DQEVENT, &event) == 0) {
+        if (event.type == V4L2_EVENT_CTRL) {
+            v4l2_control_event(&event);
+        }
+        CLEAR(event);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Control worker
+ */
+
+/* Apply a batch of controls with one VIDIOC_S_EXT_CTRLS */
+static void control_worker_apply(struct v4l2_ext_control * batch, const unsigned int * index,
+    const unsigned int * uvc_value, unsigned int count)
+{
+    struct v4l2_ext_controls ctrls;
+    unsigned int i;
+
+    CLEAR(ctrls);
+    ctrls.which    = V4L2_CTRL_WHICH_CUR_VAL;
+    ctrls.count    = count;
+    ctrls.controls = batch;
+
+    if (ioctl(pipeline->v4l2_dev.fd, VIDIOC_S_EXT_CTRLS, &ctrls) == 0) {
+        for (i = 0; i < count; i++) {
+            if (i && index[i] == index[i - 1]) {
+                continue; /* blue balance follows red */
+            }
+            log_debug("%s: %s changed value (V4L2: %d, UVC: %d)\n", uvc_dev.device_type_name,
+                control_mapping[index[i]].v4l2_name, batch[i].value, uvc_value[i]);
+        }
+        return;
+    }
+
+    /* The batch is all or nothing, set them one by one to keep the valid ones. */
+    log_error("%s: VIDIOC_S_EXT_CTRLS failed for %u controls: %s (%d).\n",
+        uvc_dev.device_type_name, count, strerror(errno), errno);
+
+    for (i = 0; i < count; i++) {
+        v4l2_set_ctrl_value(&control_mapping[index[i]], uvc_value[i], batch[i].id, batch[i].value);
+    }
+}
+
+static void * control_worker_main(void * arg)
+{
+    struct control_worker * worker;
+    struct v4l2_ext_control batch[CONTROL_BATCH_MAX];
+    unsigned int index[CONTROL_BATCH_MAX];
+    unsigned int uvc_value[CONTROL_BATCH_MAX];
+    unsigned int coalesced;
+    unsigned int count;
+    int i;
+
+    pipeline = arg;
+    worker = &pipeline->control_worker;
+
+    pthread_mutex_lock(&worker->lock);
+    while (!worker->stop) {
+        if (!worker->npending) {
+            pthread_cond_wait(&worker->wake, &worker->lock);
+            continue;
+        }
+
+        /* Take the last value of every pending control. */
+        count = 0;
+        for (i = 0; i < control_mapping_size; i++) {
+            if (!worker->pending[i]) {
+                continue;
+            }
+            worker->pending[i] = false;
+
+            CLEAR(batch[count]);
+            batch[count].id    = control_mapping[i].v4l2;
+            batch[count].value = worker->v4l2_value[i];
+            index[count]       = i;
+            uvc_value[count]   = worker->uvc_value[i];
+            count++;
+
+            if (worker->secondary[i]) {
+                batch[count]    = batch[count - 1];
+                batch[count].id = V4L2_CID_BLUE_BALANCE;
+                index[count]    = i;
+                uvc_value[count] = worker->uvc_value[i];
+                count++;
+            }
+        }
+        coalesced = worker->coalesced;
+        worker->coalesced = 0;
+        worker->npending = 0;
+        pthread_mutex_unlock(&worker->lock);
+
+        if (coalesced) {
+            log_debug("%s: %u control updates coalesced\n", uvc_dev.device_type_name, coalesced);
+        }
+        control_worker_apply(batch, index, uvc_value, count);
+
+        pthread_mutex_lock(&worker->lock);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return NULL;
+}
+
+static int control_worker_start()
+{
+    struct control_worker * worker = &pipeline->control_worker;
+    pthread_attr_t attr;
+    int ret;
+
+    CLEAR(*worker);
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->wake, NULL);
+
+    /* Sensor writes may block, they never run at real-time priority. */
+    thread_attr_init(&attr, false);
+    ret = pthread_create(&worker->thread, &attr, control_worker_main, pipeline);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        log_error("CONTROLS: Unable to start worker thread: %s (%d).\n", strerror(ret), ret);
+        pthread_cond_destroy(&worker->wake);
+        pthread_mutex_destroy(&worker->lock);
+        return -ret;
+    }
+
+    worker->running = true;
+    return 0;
+}
+
+static void control_worker_stop()
+{
+    struct control_worker * worker = &pipeline->control_worker;
+
+    if (!worker->running) {
+        return;
+    }
+
+    pthread_mutex_lock(&worker->lock);
+    worker->stop = true;
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+
+    pthread_join(worker->thread, NULL);
+    pthread_cond_destroy(&worker->wake);
+    pthread_mutex_destroy(&worker->lock);
+    worker->running = false;
+}
+
+/* Hand the new value of a control to the worker, replacing one not applied yet */
+static void control_worker_queue(unsigned int index)
+{
+    struct control_worker * worker = &pipeline->control_worker;
+    const struct control_mapping_pair * mapping = &control_mapping[index];
+    struct control_state * ctrl = &pipeline->controls[index];
+
+    if (!worker->running) {
+        v4l2_set_ctrl(index);
+        return;
+    }
+
+    if (!v4l2_ctrl_writable(mapping, ctrl->flags)) {
+        return;
+    }
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->pending[index]) {
+        worker->coalesced++;
+    } else {
+        worker->pending[index] = true;
+        worker->npending++;
+    }
+    worker->v4l2_value[index] = v4l2_ctrl_from_uvc(*ctrl);
+    worker->uvc_value[index] = ctrl->value;
+    worker->secondary[index] = ctrl->secondary && v4l2_ctrl_writable(mapping, ctrl->secondary_flags);
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static void v4l2_close()
+{
+    if (pipeline->v4l2_dev.fd) {
+        close(pipeline->v4l2_dev.fd);
+        pipeline->v4l2_dev.fd = -1;
+    }
+}
+
+static void uvc_close()
+{
+    unsigned int out;
+
+    for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+        if (pipeline->uvc_devs[out].fd) {
+            close(pipeline->uvc_devs[out].fd);
+            pipeline->uvc_devs[out].fd = -1;
+        }
+    }
+}
+
+static void fb_close()
+{
+    if (pipeline->fb_dev.fd) {
+        close(pipeline->fb_dev.fd);
+        pipeline->fb_dev.fd = -1;
+    }
+}
+
+/* Fastest frame interval of a frame size in 100 ns units, 0 if the driver doesn't tell */
+static unsigned int v4l2_get_fastest_interval(unsigned int pixelformat, unsigned int width,
+    unsigned int height)
+{
+    struct v4l2_frmivalenum frmival;
+    unsigned int interval;
+    unsigned int fastest = 0;
+
+    CLEAR(frmival);
+    frmival.pixel_format = pixelformat;
+    frmival.width = width;
+    frmival.height = height;
+
+    while (ioctl(pipeline->v4l2_dev.fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) == 0) {
+        interval = v4l2_fract_to_interval((frmival.type == V4L2_FRMIVAL_TYPE_DISCRETE) ?
+            frmival.discrete : frmival.stepwise.min);
+        if (interval && (!fastest || interval < fastest)) {
+            fastest = interval;
+        }
+
+        if (frmival.type != V4L2_FRMIVAL_TYPE_DISCRETE) {
+            break;
+        }
+        frmival.index++;
+    }
+
+    return fastest;
+}
+
+/* Fill the negotiation table with every format, frame size and fastest interval of the camera */
+static void v4l2_get_available_formats()
+{
+    struct v4l2_fmtdesc fmtdesc;
+    struct v4l2_frmsizeenum frmsize;
+    struct capture_format * entry;
+
+    pipeline->capture_formats.count = 0;
+
+    CLEAR(fmtdesc);
+    fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    while (ioctl(pipeline->v4l2_dev.fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0) {
+        CLEAR(frmsize);
+        frmsize.pixel_format = fmtdesc.pixelformat;
+
+        while (ioctl(pipeline->v4l2_dev.fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) == 0) {
+            if (pipeline->capture_formats.count == FORMAT_TABLE_SIZE) {
+                log_warning("%s: Format table full, ignoring remaining frame sizes\n",
+                    pipeline->v4l2_dev.device_type_name);
+                return;
+            }
+
+            entry = &pipeline->capture_formats.entries[pipeline->capture_formats.count];
+            CLEAR(*entry);
+            entry->pixelformat = fmtdesc.pixelformat;
+
+            if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+                entry->width = frmsize.discrete.width;
+                entry->height = frmsize.discrete.height;
+
+            } else {
+                entry->stepwise = true;
+                entry->width = frmsize.stepwise.max_width;
+                entry->height = frmsize.stepwise.max_height;
+                entry->min_width = frmsize.stepwise.min_width;
+                entry->min_height = frmsize.stepwise.min_height;
+                entry->step_width = max(frmsize.stepwise.step_width, 1u);
+                entry->step_height = max(frmsize.stepwise.step_height, 1u);
+            }
+
+            if (entry->width && entry->height) {
+                entry->interval = v4l2_get_fastest_interval(entry->pixelformat,
+                    entry->width, entry->height);
+
+                log_info("%s: Supported format: %c%c%c%c %s%ux%u, %u.%u fps\n",
+                    pipeline->v4l2_dev.device_type_name, pixfmtstr(entry->pixelformat),
+                    (entry->stepwise) ? "up to " : "", entry->width, entry->height,
+                    (entry->interval) ? 10000000 / entry->interval : 0,
+                    (entry->interval) ? 100000000 / entry->interval % 10 : 0);
+
+                pipeline->capture_formats.count++;
+            }
+
+            if (frmsize.type != V4L2_FRMSIZE_TYPE_DISCRETE) {
+                break;
+            }
+            frmsize.index++;
+        }
+        fmtdesc.index++;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Format negotiation
+ */
+
+/* Whether the capture format can be streamed to the UVC format as it is */
+static bool format_plan_direct(unsigned int capture_format, unsigned int uvc_format)
+{
+    if (uvc_format == V4L2_PIX_FMT_MJPEG) {
+        return capture_format == V4L2_PIX_FMT_MJPEG || capture_format == V4L2_PIX_FMT_JPEG;
+    }
+    return capture_format == uvc_format;
+}
+
+static unsigned int format_plan_fit(unsigned int value, unsigned int minimum,
+    unsigned int maximum, unsigned int step)
+{
+    if (value <= minimum) {
+        return minimum;
+    }
+    if (value >= maximum) {
+        return maximum;
+    }
+    return min(minimum + (value - minimum + step - 1) / step * step, maximum);
+}
+
+/*
+ * Pick the cheapest capture format and size for the UVC frame. Upscaling
+ * is the last resort, then candidates are ranked by whether they keep up
+ * with the requested interval, by the stages they need (none, encoding,
+ * scaling, both) and by the number of pixels captured.
+ */
+static void format_plan_select(unsigned int uvc_format, unsigned int width,
+    unsigned int height, unsigned int interval)
+{
+    const struct capture_format * entry;
+    unsigned int capture_width;
+    unsigned int capture_height;
+    unsigned int stages;
+    uint64_t pixels;
+    uint64_t cost[4];
+    uint64_t best[4];
+    bool direct;
+    bool found = false;
+    unsigned int i;
+    unsigned int k;
+
+    for (i = 0; i < pipeline->capture_formats.count; i++) {
+        entry = &pipeline->capture_formats.entries[i];
+
+        direct = format_plan_direct(entry->pixelformat, uvc_format);
+        if (!direct && (entry->pixelformat != V4L2_PIX_FMT_YUYV || uvc_format != V4L2_PIX_FMT_MJPEG)) {
+            continue;
+        }
+
+        capture_width = entry->width;
+        capture_height = entry->height;
+        if (entry->stepwise) {
+            capture_width = format_plan_fit(width, entry->min_width, entry->width, entry->step_width);
+            capture_height = format_plan_fit(height, entry->min_height, entry->height, entry->step_height);
+        }
+
+        stages = (direct) ? 0 : 1;
+        if (capture_width != width || capture_height != height) {
+            /* Only raw frames can be scaled. */
+            if (entry->pixelformat != V4L2_PIX_FMT_YUYV) {
+                continue;
+            }
+            stages += 2;
+        }
+
+        pixels = (uint64_t) capture_width * capture_height;
+
+        cost[0] = capture_width < width || capture_height < height;
+        cost[1] = interval && entry->interval > interval;
+        cost[2] = stages;
+        cost[3] = (cost[0]) ? UINT64_MAX - pixels : pixels;
+
+        for (k = 0; found && k < 4 && cost[k] == best[k]; k++);
+        if (found && (k == 4 || cost[k] > best[k])) {
+            continue;
+        }
+
+        memcpy(best, cost, sizeof best);
+        found = true;
+        pipeline->format_plan.pixelformat = entry->pixelformat;
+        pipeline->format_plan.width = capture_width;
+        pipeline->format_plan.height = capture_height;
+    }
+
+    if (!found) {
+        pipeline->format_plan.pixelformat = (uvc_format == V4L2_PIX_FMT_MJPEG) ? V4L2_PIX_FMT_JPEG : uvc_format;
+        pipeline->format_plan.width = width;
+        pipeline->format_plan.height = height;
+
+        log_warning("FORMAT: No capture format matches %c%c%c%c %ux%u, requesting it directly\n",
+            pixfmtstr(uvc_format), width, height);
+    }
+}
+
+/* Set up the capture device and the conversion stages for the committed UVC frame */
+static void format_plan_commit(unsigned int uvc_format, unsigned int width,
+    unsigned int height, unsigned int interval)
+{
+    /* The frame in flight still uses the current plan. */
+    frame_stage_wait();
+    pipeline->jpeg.active = false;
+
+    /* A new format starts again from the configured quality. */
+    if (pipeline->jpeg.quality != pipeline->settings.jpeg_quality) {
+        jpeg_init(pipeline->settings.jpeg_quality);
+    }
+    pipeline->format_plan.scale = false;
+    pipeline->format_plan.convert = false;
+
+    if (pipeline->settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
+        pipeline->jpeg.active = (uvc_format == V4L2_PIX_FMT_MJPEG);
+
+        log_info("FORMAT: Framebuffer %ux%u -> convert%s -> UVC %c%c%c%c %ux%u\n",
+            pipeline->fb_dev.fb_width, pipeline->fb_dev.fb_height, (pipeline->jpeg.active) ? " -> encode" : "",
+            pixfmtstr(uvc_format), width, height);
+        return;
+    }
+
+    format_plan_select(uvc_format, width, height, interval);
+
+    /* Buffers kept from the last session are only reused while the capture format stays. */
+    if (pipeline->v4l2_dev.bufs_cached &&
+        pipeline->v4l2_dev.pix.pixelformat == pipeline->format_plan.pixelformat &&
+        pipeline->v4l2_dev.pix.width == pipeline->format_plan.width &&
+        pipeline->v4l2_dev.pix.height == pipeline->format_plan.height
+    ) {
+        log_info("%s: Keeping format %c%c%c%c %ux%u and its mapped buffers\n",
+            pipeline->v4l2_dev.device_type_name, pixfmtstr(pipeline->v4l2_dev.pix.pixelformat),
+            pipeline->v4l2_dev.pix.width, pipeline->v4l2_dev.pix.height);
+
+    } else {
+        v4l2_release_bufs();
+
+        CLEAR(pipeline->v4l2_dev.pix);
+        v4l2_apply_format(&pipeline->v4l2_dev, pipeline->format_plan.pixelformat, pipeline->format_plan.width, pipeline->format_plan.height);
+    }
+    v4l2_apply_frame_interval(&pipeline->v4l2_dev, interval);
+
+    /* The driver may adjust the request, plan with what it delivers. */
+    if (pipeline->v4l2_dev.pix.pixelformat == V4L2_PIX_FMT_YUYV) {
+        pipeline->jpeg.active = (uvc_format == V4L2_PIX_FMT_MJPEG);
+        pipeline->format_plan.scale = (pipeline->v4l2_dev.pix.width != width || pipeline->v4l2_dev.pix.height != height);
+        pipeline->format_plan.convert = (pipeline->jpeg.active || pipeline->format_plan.scale);
+
+    } else if (!format_plan_direct(pipeline->v4l2_dev.pix.pixelformat, uvc_format) ||
+        pipeline->v4l2_dev.pix.width != width || pipeline->v4l2_dev.pix.height != height
+    ) {
+        log_warning("FORMAT: Capture %c%c%c%c %ux%u can't be converted to %c%c%c%c %ux%u\n",
+            pixfmtstr(pipeline->v4l2_dev.pix.pixelformat), pipeline->v4l2_dev.pix.width, pipeline->v4l2_dev.pix.height,
+            pixfmtstr(uvc_format), width, height);
+    }
+
+    log_info("FORMAT: Capture %c%c%c%c %ux%u%s%s -> UVC %c%c%c%c %ux%u\n",
+        pixfmtstr(pipeline->v4l2_dev.pix.pixelformat), pipeline->v4l2_dev.pix.width, pipeline->v4l2_dev.pix.height,
+        (pipeline->format_plan.scale) ? " -> scale" : "", (pipeline->jpeg.active) ? " -> encode" : "",
+        pixfmtstr(uvc_format), width, height);
+}
+
+/* ---------------------------------------------------------------------------
+ * UVC streaming related
+ */
+
+/*
+ * Hash one framebuffer tile. Every step is a bijection of the running
+ * hash, so a tile differing in a single word never hashes the same.
+ */
+static uint64_t fb_tile_hash(const uint8_t * src, unsigned int len, unsigned int stride,
+    unsigned int rows)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    uint64_t word;
+    unsigned int i;
+
+    while (rows--) {
+        /* Framebuffer memory is often uncached, start fetching the next row early. */
+        __builtin_prefetch(src + stride);
+        for (i = 0; i + 8 <= len; i += 8) {
+            memcpy(&word, src + i, 8);
+            hash = (hash ^ word) * 0x100000001B3ULL;
+            hash ^= hash >> 32;
+        }
+        if (i < len) {
+            word = 0;
+            memcpy(&word, src + i, len - i);
+            hash = (hash ^ word) * 0x100000001B3ULL;
+            hash ^= hash >> 32;
+        }
+        src += stride;
+    }
+    return hash;
+}
+
+static void uvc_fb_convert_tile(const uint8_t * fb_pixels, uint8_t * uvc_pixels,
+    unsigned int width, unsigned int rows)
+{
+    unsigned int fb_stride = pipeline->fb_dev.fb_line_length;
+    unsigned int uvc_stride = pipeline->fb_dev.fb_width * 2;
+    rgb2yuyv_kernel kernel;
+
+    switch(pipeline->fb_dev.fb_bpp) {
+        case 16:
+            kernel = pipeline->rgb2yuyv.bpp16;
+            break;
+
+        case 24:
+            kernel = pipeline->rgb2yuyv.bpp24;
+            break;
+
+        case 32:
+            kernel = pipeline->rgb2yuyv.bpp32;
+            break;
+
+        default:
+            return;
+    }
+
+    while (rows--) {
+        kernel(fb_pixels, uvc_pixels, width / 2);
+        fb_pixels += fb_stride;
+        uvc_pixels += uvc_stride;
+    }
+}
+
+/*
+ * Convert one horizontal stripe of tiles into the UVC buffer, skipping
+ * the tiles whose contents did not change since the buffer was filled.
+ */
+static void uvc_fb_convert_stripe(unsigned int part, unsigned int nparts, void * data)
+{
+    struct fb_fill_job * fill = data;
+    struct buffer * ubuf = fill->ubuf;
+    unsigned int bytes_pp = pipeline->fb_dev.fb_bpp / 8;
+    unsigned int fb_stride = pipeline->fb_dev.fb_line_length;
+    unsigned int first = pipeline->fb_dev.fb_tiles_y * part / nparts;
+    unsigned int last = pipeline->fb_dev.fb_tiles_y * (part + 1) / nparts;
+    unsigned int converted = 0;
+    unsigned int tx;
+    unsigned int ty;
+    unsigned int x;
+    unsigned int y;
+    unsigned int width;
+    unsigned int rows;
+    const uint8_t * fb_pixels;
+    uint64_t * tile_hash;
+    uint64_t hash;
+
+    for (ty = first; ty < last; ty++) {
+        y = ty * FB_TILE_HEIGHT;
+        rows = pipeline->fb_dev.fb_height - y;
+        if (rows > FB_TILE_HEIGHT) {
+            rows = FB_TILE_HEIGHT;
+        }
+
+        for (tx = 0; tx < pipeline->fb_dev.fb_tiles_x; tx++) {
+            x = tx * FB_TILE_WIDTH;
+            width = pipeline->fb_dev.fb_width - x;
+            if (width > FB_TILE_WIDTH) {
+                width = FB_TILE_WIDTH;
+            }
+
+            fb_pixels = fill->origin + y * fb_stride + x * bytes_pp;
+            tile_hash = &ubuf->tile_hash[ty * pipeline->fb_dev.fb_tiles_x + tx];
+
+            hash = fb_tile_hash(fb_pixels, width * bytes_pp, fb_stride, rows);
+            if (ubuf->tile_hash_valid && *tile_hash == hash) {
+                continue;
+            }
+
+            uvc_fb_convert_tile(fb_pixels,
+                (uint8_t *) ubuf->start + (y * pipeline->fb_dev.fb_width + x) * 2, width, rows);
+            *tile_hash = hash;
+            converted++;
+        }
+    }
+
+    fill->part_converted[part] = converted;
+    atomic_fetch_add_explicit(&pipeline->fb_dev.fb_tiles_converted, converted, memory_order_relaxed);
+}
+
+/* Fill a UVC buffer from the framebuffer, returns true when the frame was identical and queued as is */
+static bool uvc_fb_fill_buffer(struct v4l2_buffer * buf)
+{
+    struct buffer * ubuf = &uvc_dev.mem[buf->index];
+    struct fb_fill_job fill;
+    unsigned int converted = 0;
+    unsigned int i;
+    int ret;
+
+    /* JPEG frames are converted into the staging frame and encoded from there. */
+    fill.ubuf   = (pipeline->jpeg.active) ? &pipeline->fb_dev.fb_yuyv : ubuf;
+    fill.origin = fb_frame_origin();
+
+    /* The tile pass is the only read of the framebuffer, it also tells whether anything changed. */
+    worker_pool_run(&pipeline->workers, uvc_fb_convert_stripe, &fill);
+    for (i = 0; i < pipeline->workers.nparts; i++) {
+        converted += fill.part_converted[i];
+    }
+    fill.ubuf->generation += (converted > 0);
+    fill.ubuf->tile_hash_valid = true;
+    buf->bytesused = pipeline->fb_dev.fb_height * pipeline->fb_dev.fb_width * 2;
+
+    /* An identical frame is queued as is, an encoded buffer may hold an older frame than the staging one. */
+    if (pipeline->jpeg.active) {
+        if (ubuf->tile_hash_valid && ubuf->generation == fill.ubuf->generation) {
+            buf->bytesused = ubuf->buf.bytesused;
+            return true;
+        }
+
+    } else if (!converted) {
+        return true;
+    }
+
+    if (pipeline->jpeg.active) {
+        ret = jpeg_encode(fill.ubuf->start, pipeline->fb_dev.fb_width * 2, pipeline->fb_dev.fb_width, pipeline->fb_dev.fb_height,
+            ubuf->start, min(ubuf->length, uvc_dev.pix.sizeimage));
+        if (ret < 0) {
+            log_error("%s: JPEG encoding failed: %s (%d).\n",
+                uvc_dev.device_type_name, strerror(-ret), -ret);
+            ubuf->tile_hash_valid = false;
+            buf->bytesused = 0;
+            return false;
+        }
+        buf->bytesused = ret;
+    }
+
+    ubuf->buf.bytesused = buf->bytesused;
+    ubuf->generation = fill.ubuf->generation;
+    ubuf->tile_hash_valid = true;
+    return false;
+}
+
+/* Frame stage job: read the framebuffer into the dequeued UVC buffer */
+static void uvc_fb_fill_job(void * data)
+{
+    struct frame_stage * stage = data;
+
+    stage->identical = uvc_fb_fill_buffer(&stage->ubuf);
+}
+
+static void uvc_fb_video_process()
+{
+    struct v4l2_buffer ubuf;
+    /*
+     * Return immediately if UVC video output device has not started
+     * streaming yet.
+     */
+    if (!uvc_dev.is_streaming) {
+        return;
+    }
+    /* Prepare a v4l2 buffer to be dequeued from UVC domain. */
+    CLEAR(ubuf);
+    ubuf.type   = uvc_dev.buffer_type;
+    ubuf.memory = uvc_dev.memory_type;
+
+    if (ioctl(uvc_dev.fd, VIDIOC_DQBUF, &ubuf) < 0) {
+        log_error("%s: Unable to dequeue buffer: %s (%d).\n",
+            uvc_dev.device_type_name, strerror(errno), errno);
+        return;
+    }
+
+    uvc_dev.dqbuf_count++;
+    stats_frame_done(&uvc_dev, &ubuf, false);
+
+    /* The framebuffer is read by the frame stage, that is its capture time. */
+    pipeline->frame_stage.ubuf  = ubuf;
+    pipeline->frame_stage.start = monotonic_ns();
+    frame_stage_submit(uvc_fb_fill_job);
+}
+
+/* Queue the UVC buffer the frame stage filled */
+static void uvc_fb_fill_done()
+{
+    struct frame_stage * stage = &pipeline->frame_stage;
+
+    if (ioctl(uvc_dev.fd, VIDIOC_QBUF, &stage->ubuf) < 0) {
+        log_error("%s: Unable to queue buffer: %s (%d).\n",
+            uvc_dev.device_type_name, strerror(errno), errno);
+        return;
+    }
+
+    uvc_dev.qbuf_count++;
+    stats_frame_queued(&uvc_dev, stage->ubuf.index, stage->start, stage->start);
+    pipeline->stats.identical_skipped += stage->identical;
+
+    if (pipeline->settings.show_fps) {
+        uvc_dev.buffers_processed++;
+    }
+}
+
+/* Queue the result of the frame stage */
+static void processing_frame_done()
+{
+    if (pipeline->settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
+        uvc_fb_fill_done();
+    } else {
+        uvc_v4l2_convert_done();
+    }
+}
+
+/* Finish the frame in flight and queue it, before the buffers it uses change */
+static void frame_stage_flush()
+{
+    frame_stage_wait();
+    if (frame_stage_collect()) {
+        processing_frame_done();
+    }
+}
+
+static void uvc_v4l2_video_process(struct v4l2_device * dev)
+{
+    struct uvc_slots * slots = &pipeline->buffer_pool.uvc[dev->index];
+    struct v4l2_buffer ubuf;
+    /*
+     * Do not dequeue buffers from UVC side until there are atleast
+     * 2 buffers available at UVC domain.
+     */
+    // dont know any detail,but in my case alway 1 buffer available
+    if (!dev->uvc_shutdown_requested && dev->dqbuf_count >= dev->qbuf_count) {
+        return;
+    }
+
+    /* Prepare a v4l2 buffer to be dequeued from UVC domain. */
+    CLEAR(ubuf);
+    ubuf.type   = dev->buffer_type;
+    ubuf.memory = dev->memory_type;
+
+    /* Dequeue the spent buffer from UVC domain */
+    if (ioctl(dev->fd, VIDIOC_DQBUF, &ubuf) < 0) {
+        log_error("%s: Unable to dequeue buffer: %s (%d).\n",
+            dev->device_type_name, strerror(errno), errno);
+        return;
+    }
+
+    dev->dqbuf_count++;
+
+    /*
+        * If the dequeued buffer was marked with state ERROR by the
+        * underlying UVC driver gadget, do not queue the same to V4l2
+        * and wait for a STREAMOFF event on UVC side corresponding to
+        * set_alt(0). So, now all buffers pending at UVC end will be
+        * dequeued one-by-one and we will enter a state where we once
+        * again wait for a set_alt(1) command from the USB host side.
+        */
+    if (ubuf.flags & V4L2_BUF_FLAG_ERROR) {
+        dev->uvc_shutdown_requested = true;
+        log_warning("%s: Possible USB shutdown requested from Host, seen during VIDIOC_DQBUF\n",
+            dev->device_type_name);
+        return;
+    }
+
+    stats_frame_done(dev, &ubuf, ubuf.index < slots->nbufs && slots->repeated[ubuf.index]);
+
+    if (pipeline->settings.frame_repeat && ubuf.index < slots->nbufs && slots->map[ubuf.index] != -1) {
+        buffer_pool_hold_slot(dev->index, ubuf.index);
+    }
+
+    /* The capture buffer goes back to the camera once no output references it. */
+    if (buffer_pool_unref_slot(dev->index, ubuf.index) < 0) {
+        log_error("%s: UVC buffer %u is not mapped to a capture buffer\n",
+            dev->device_type_name, ubuf.index);
+        return;
+    }
+
+    if (pipeline->settings.show_fps) {
+        dev->buffers_processed++;
+    }
+
+    /* A UVC slot is free again, queue the oldest waiting capture buffer. */
+    v4l2_uvc_video_process();
+}
+
+static int uvc_v4l2_request_bufs(struct v4l2_device * dev)
+{
+    dev->memory_type = V4L2_MEMORY_USERPTR;
+
+    if (pipeline->settings.dmabuf && pipeline->format_plan.convert) {
+        log_warning("%s: DMABUF is not used while converting frames\n", dev->device_type_name);
+
+    } else if (pipeline->settings.dmabuf) {
+        if (v4l2_export_bufs(&pipeline->v4l2_dev) == 0) {
+            dev->memory_type = V4L2_MEMORY_DMABUF;
+
+            if (uvc_request_bufs(dev, dev->nbufs) >= 0) {
+                return 0;
+            }
+            if (!buffer_pool_outputs(dev->index)) {
+                v4l2_unexport_bufs(&pipeline->v4l2_dev);
+            }
+        }
+
+        log_warning("%s: DMABUF not available, falling back to %s\n",
+            dev->device_type_name, v4l2_memory_type_name(V4L2_MEMORY_USERPTR));
+        dev->memory_type = V4L2_MEMORY_USERPTR;
+    }
+
+    return uvc_request_bufs(dev, dev->nbufs);
+}
+
+/* Map the capture buffers, or reuse the ones kept from the last session */
+static int v4l2_capture_alloc()
+{
+    if (pipeline->v4l2_dev.bufs_cached) {
+        log_info("%s: Reusing %u mapped buffers\n", pipeline->v4l2_dev.device_type_name, pipeline->v4l2_dev.nbufs);
+        pipeline->v4l2_dev.bufs_cached = false;
+        pipeline->v4l2_dev.qbuf_count = 0;
+        pipeline->v4l2_dev.dqbuf_count = 0;
+        return 0;
+    }
+
+    return (v4l2_request_bufs(pipeline->v4l2_dev.nbufs) < 0) ? -EINVAL : 0;
+}
+
+/* Queue every capture buffer and start streaming, interval 0 keeps the current rate */
+static int v4l2_capture_start(unsigned int interval)
 {
-    if (uvc_dev.fd) {
-        close(uvc_dev.fd);
-        uvc_dev.fd = -1;
+    if (buffer_pool_init(pipeline->v4l2_dev.nbufs) < 0) {
+        return -EINVAL;
+    }
+
+    if (v4l2_qbuf_mmap(&pipeline->v4l2_dev) < 0) {
+        return -EINVAL;
+    }
+
+    if (interval) {
+        v4l2_apply_frame_interval(&pipeline->v4l2_dev, interval);
+    }
+
+    /* Start V4L2 capturing now. */
+    if (v4l2_video_stream(STREAM_ON) < 0) {
+        return -EINVAL;
     }
-}
 
-static void fb_close()
-{
-    if (fb_dev.fd) {
-        close(fb_dev.fd);
-        fb_dev.fd = -1;
+    /* The capture thread owns the V4L2 device until STREAMOFF. */
+    if (capture_thread_start() < 0) {
+        v4l2_video_stream(STREAM_OFF);
+        return -EINVAL;
     }
+    return 0;
 }
 
-// https://stackoverflow.com/a/15683117
-static void v4l2_get_available_formats()
+static void v4l2_capture_stop()
 {
-    struct v4l2_fmtdesc fmtdesc;
-    struct v4l2_frmsizeenum frmsize;
-    unsigned int width;
-    unsigned int height;
-    CLEAR(fmtdesc);
-    fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    frame_stage_flush();
+    capture_thread_stop();
+    v4l2_video_stream(STREAM_OFF);
 
-    while (ioctl(v4l2_dev.fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0) {
-        //include JPEG format
-        if (fmtdesc.pixelformat == V4L2_PIX_FMT_JPEG || fmtdesc.pixelformat == V4L2_PIX_FMT_MJPEG || fmtdesc.pixelformat == V4L2_PIX_FMT_YUYV) {
-            frmsize.pixel_format = fmtdesc.pixelformat;
-            frmsize.index = 0;
-            while (ioctl(v4l2_dev.fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) >= 0) {
-                width = 0;
-                height = 0;
-                if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
-                    width = frmsize.discrete.width;
-                    height = frmsize.discrete.height;
-
-                } else if (frmsize.type == V4L2_FRMSIZE_TYPE_STEPWISE) {
-                    width = frmsize.stepwise.max_width;
-                    height = frmsize.stepwise.max_height;
+    /* STREAMOFF hands every buffer back, keep them mapped for the next session. */
+    pipeline->v4l2_dev.bufs_cached = (pipeline->v4l2_dev.mem != NULL);
 
-                }
-
-                if (width && height) {
-                    printf("%s: Getting highest frame size: %c%c%c%c %ux%u\n",
-                        v4l2_dev.device_type_name, pixfmtstr(fmtdesc.pixelformat), width, height);
-                }
-                frmsize.index++;
-            }
-        }
-        fmtdesc.index++;
-    }
+    free(pipeline->format_plan.scaled.start);
+    pipeline->format_plan.scaled.start = NULL;
 }
 
-/* ---------------------------------------------------------------------------
- * UVC streaming related
+/*
+ * Change the rate of the running capture. Drivers refusing S_PARM while
+ * streaming are restarted, frames held by the output side stay where
+ * they are and only the other buffers are queued to the camera again.
  */
+static int v4l2_capture_set_rate(unsigned int interval)
+{
+    struct v4l2_buffer vbuf;
+    unsigned int index;
+    int ret = v4l2_apply_frame_interval(&pipeline->v4l2_dev, interval);
 
-static void uvc_fb_fill_buffer(struct v4l2_buffer * buf)
-{
-    unsigned int rgba1;
-    unsigned int rgba2;
-    unsigned int rgba1_last;
-    unsigned int rgba2_last;
-    unsigned int yvyu;
-    unsigned int yvyu_last;
-    unsigned char r1;
-    unsigned char b1;
-    unsigned char g1;
-    unsigned char r2;
-    unsigned char b2;
-    unsigned char g2;
-    unsigned int size = fb_dev.fb_height * fb_dev.fb_width;
-    char * uvc_pixels = (char *) uvc_dev.mem[buf->index].start;
-    char * fb_pixels  = (char *) fb_dev.fb_memory;
-
-    buf->bytesused = size * 2;
-
-    switch(fb_dev.fb_bpp) {
-        case 16:
-            while(size) {
-                b1 = (*(fb_pixels) & 0x1f) << 3;
-                g1 = (((*(fb_pixels + 1) & 0x7) << 3) | (*(fb_pixels) & 0xE0) >> 5) << 2;
-                r1 = (*(fb_pixels + 1) & 0xF8);
-                b2 = (*(fb_pixels + 2) & 0x1f) << 3;
-                g2 = (((*(fb_pixels + 3) & 0x7) << 3) | (*(fb_pixels + 2) & 0xE0) >> 5) << 2;
-                r2 = (*(fb_pixels + 3) & 0xF8);
-                yvyu = rgb2yvyu(r1, g1, b1, r2, g2, b2);
-                memcpy(uvc_pixels, &yvyu, 4);
-                fb_pixels += 4;
-                uvc_pixels += 4;
-                size -= 2;
-            }
-            break;
+    if (ret == 0 || ret == -ENOTSUP) {
+        return 0;
+    }
 
-        case 24:
-            while(size) {
-                memcpy(&rgba1, fb_pixels, 3);
-                memcpy(&rgba2, fb_pixels + 3, 3);
-                if (rgba1 == rgba1_last && rgba2 == rgba2_last) {
-                    memcpy(uvc_pixels, &yvyu_last, 4);
-                } else {
-                    r1 = rgba1 & 0xFF;
-                    g1 = (rgba1 >> 8) & 0xFF;
-                    b1 = (rgba1 >> 16) & 0xFF;
-                    r2 = rgba2 & 0xFF;
-                    g2 = (rgba2 >> 8) & 0xFF;
-                    b2 = (rgba2 >> 16) & 0xFF;
-                    yvyu = rgb2yvyu(r1, g1, b1, r2, g2, b2);
-                    rgba1_last = rgba1;
-                    rgba2_last = rgba2;
-                    yvyu_last = yvyu;
-                    memcpy(uvc_pixels, &yvyu, 4);
-                }
-                fb_pixels += 6;
-                uvc_pixels += 4;
-                size -= 2;
-            }
-            break;
+    log_info("%s: Restarting capture to change the frame rate\n", pipeline->v4l2_dev.device_type_name);
+    capture_thread_stop();
+    v4l2_video_stream(STREAM_OFF);
+    v4l2_apply_frame_interval(&pipeline->v4l2_dev, interval);
 
-        case 32:
-            while(size) {
-                memcpy(&rgba1, fb_pixels, 4);
-                memcpy(&rgba2, fb_pixels + 4, 4);
-                if (rgba1 == rgba1_last && rgba2 == rgba2_last) {
-                    memcpy(uvc_pixels, &yvyu_last, 4);
-                } else {
-                    r1 = rgba1 & 0xFF;
-                    g1 = (rgba1 >> 8) & 0xFF;
-                    b1 = (rgba1 >> 16) & 0xFF;
-                    r2 = rgba2 & 0xFF;
-                    g2 = (rgba2 >> 8) & 0xFF;
-                    b2 = (rgba2 >> 16) & 0xFF;
-                    yvyu = rgb2yvyu(r1, g1, b1, r2, g2, b2);
-                    rgba1_last = rgba1;
-                    rgba2_last = rgba2;
-                    yvyu_last = yvyu;
-                    memcpy(uvc_pixels, &yvyu, 4);
-                }
-                fb_pixels += 8;
-                uvc_pixels += 4;
-                size -= 2;
-            }
-            break;
+    while (buffer_ring_pop(&pipeline->capture.ready, &index)) {
+        buffer_pool_pending_push(index);
     }
- }
+    while (buffer_ring_pop(&pipeline->capture.release, &index));
 
-static void uvc_fb_video_process()
-{
-    struct v4l2_buffer ubuf;
-    /*
-     * Return immediately if UVC video output device has not started
-     * streaming yet.
-     */
-    if (!uvc_dev.is_streaming) {
-        return;
-    }
-    /* Prepare a v4l2 buffer to be dequeued from UVC domain. */
-    CLEAR(ubuf);
-    ubuf.type   = uvc_dev.buffer_type;
-    ubuf.memory = uvc_dev.memory_type;
+    pipeline->v4l2_dev.qbuf_count = 0;
+    pipeline->v4l2_dev.dqbuf_count = 0;
 
-    if (ioctl(uvc_dev.fd, VIDIOC_DQBUF, &ubuf) < 0) {
-        printf("%s: Unable to dequeue buffer: %s (%d).\n",
-            uvc_dev.device_type_name, strerror(errno), errno);
-        return;
-    }
+    for (index = 0; index < pipeline->v4l2_dev.nbufs; index++) {
+        if (pipeline->buffer_pool.state[index] != BUFFER_STATE_CAPTURE &&
+            pipeline->buffer_pool.state[index] != BUFFER_STATE_FREE
+        ) {
+            continue;
+        }
 
-    uvc_fb_fill_buffer(&ubuf);
+        CLEAR(vbuf);
+        vbuf.type   = pipeline->v4l2_dev.buffer_type;
+        vbuf.memory = pipeline->v4l2_dev.memory_type;
+        vbuf.index  = index;
 
-    if (ioctl(uvc_dev.fd, VIDIOC_QBUF, &ubuf) < 0) {
-        printf("%s: Unable to queue buffer: %s (%d).\n",
-            uvc_dev.device_type_name, strerror(errno), errno);
-        return;
+        if (ioctl(pipeline->v4l2_dev.fd, VIDIOC_QBUF, &vbuf) < 0) {
+            log_error("%s: Unable to queue buffer: %s (%d).\n",
+                pipeline->v4l2_dev.device_type_name, strerror(errno), errno);
+            return -EINVAL;
+        }
+
+        pipeline->buffer_pool.state[index] = BUFFER_STATE_CAPTURE;
+        pipeline->v4l2_dev.qbuf_count++;
     }
 
-    uvc_dev.qbuf_count++;
+    if (v4l2_video_stream(STREAM_ON) < 0) {
+        return -EINVAL;
+    }
 
-    if (settings.show_fps) {
-        uvc_dev.buffers_processed++;
+    if (capture_thread_start() < 0) {
+        v4l2_video_stream(STREAM_OFF);
+        return -EINVAL;
     }
+    return 0;
 }
 
-static void uvc_v4l2_video_process()
+/*
+ * Warm standby: after a commit the sensor keeps capturing at a low rate
+ * and every frame but the newest goes straight back to the camera, so
+ * STREAMON finds a powered-up sensor and a frame ready to send.
+ */
+static void v4l2_standby_start()
 {
-    struct v4l2_buffer ubuf;
-    struct v4l2_buffer vbuf;
-    /*
-     * Do not dequeue buffers from UVC side until there are atleast
-     * 2 buffers available at UVC domain.
-     */
-    // dont know any detail,but in my case alway 1 buffer available
-    if (!uvc_shutdown_requested && uvc_dev.dqbuf_count >= uvc_dev.qbuf_count) {
+    if (!pipeline->settings.standby || pipeline->settings.source_device != DEVICE_TYPE_V4L2 ||
+        pipeline->capture.running || !pipeline->v4l2_dev.pix.pixelformat
+    ) {
         return;
     }
 
-    /* Prepare a v4l2 buffer to be dequeued from UVC domain. */
-    CLEAR(ubuf);
-    ubuf.type   = uvc_dev.buffer_type;
-    ubuf.memory = uvc_dev.memory_type;
-
-    /* Dequeue the spent buffer from UVC domain */
-    if (ioctl(uvc_dev.fd, VIDIOC_DQBUF, &ubuf) < 0) {
-        printf("%s: Unable to dequeue buffer: %s (%d).\n",
-            uvc_dev.device_type_name, strerror(errno), errno);
+    if (v4l2_capture_alloc() < 0) {
         return;
     }
 
-    uvc_dev.dqbuf_count++;
-
-    /*
-        * If the dequeued buffer was marked with state ERROR by the
-        * underlying UVC driver gadget, do not queue the same to V4l2
-        * and wait for a STREAMOFF event on UVC side corresponding to
-        * set_alt(0). So, now all buffers pending at UVC end will be
-        * dequeued one-by-one and we will enter a state where we once
-        * again wait for a set_alt(1) command from the USB host side.
-        */
-    if (ubuf.flags & V4L2_BUF_FLAG_ERROR) {
-        uvc_shutdown_requested = true;
-        printf("UVC: Possible USB shutdown requested from Host, seen during VIDIOC_DQBUF\n");
+    pipeline->processing.standby = true;
+    if (v4l2_capture_start(STANDBY_FRAME_INTERVAL) < 0) {
+        pipeline->processing.standby = false;
         return;
     }
+    log_info("%s: Standby capture started\n", pipeline->v4l2_dev.device_type_name);
+}
 
-    /* Queue the buffer to V4L2 domain */
-    CLEAR(vbuf);
-    vbuf.type   = v4l2_dev.buffer_type;
-    vbuf.memory = v4l2_dev.memory_type;
-    vbuf.index  = ubuf.index;
-
-    if (ioctl(v4l2_dev.fd, VIDIOC_QBUF, &vbuf) < 0) {
-        printf("%s: Unable to queue buffer: %s (%d).\n",
-            v4l2_dev.device_type_name, strerror(errno), errno);
+static void v4l2_standby_stop()
+{
+    if (!pipeline->processing.standby) {
         return;
     }
 
-    v4l2_dev.qbuf_count++;
+    v4l2_capture_stop();
+    pipeline->processing.standby = false;
+    log_info("%s: Standby capture stopped\n", pipeline->v4l2_dev.device_type_name);
+}
 
-    if (settings.show_fps) {
-        uvc_dev.buffers_processed++;
+/* The last host stopped streaming, drop to the standby rate */
+static void v4l2_standby_resume()
+{
+    pipeline->processing.standby = true;
+    if (v4l2_capture_set_rate(STANDBY_FRAME_INTERVAL) < 0) {
+        pipeline->processing.standby = false;
+        return;
     }
+    log_info("%s: Back to standby capture\n", pipeline->v4l2_dev.device_type_name);
 }
 
-static void uvc_handle_streamon_event()
+static void uvc_handle_streamon_event(struct v4l2_device * dev)
 {
-    if (settings.source_device == DEVICE_TYPE_V4L2) {
-        if (v4l2_request_bufs(v4l2_dev.nbufs) < 0) {
+    bool standby = pipeline->processing.standby;
+
+    if (pipeline->settings.source_device == DEVICE_TYPE_V4L2) {
+        dev->streamon_time = monotonic_ns();
+
+        /* Capture may already run for another output or in standby. */
+        if (!pipeline->capture.running && v4l2_capture_alloc() < 0) {
+            return;
+        }
+
+        if (uvc_v4l2_request_bufs(dev) < 0) {
+            return;
+        }
+
+        if (!pipeline->capture.running && v4l2_capture_start(0) < 0) {
             return;
         }
 
-        if (v4l2_qbuf_mmap(&v4l2_dev) < 0) {
+        buffer_pool_attach(dev->index, dev->nbufs);
+        if (!standby) {
             return;
         }
 
-        /* Start V4L2 capturing now. */
-        v4l2_video_stream(STREAM_ON);
+        /* Leave standby: the newest frame goes out now, then capture runs at the committed rate. */
+        pipeline->processing.standby = false;
+        v4l2_uvc_video_process();
+
+        v4l2_capture_set_rate(dev->commit.dwFrameInterval);
+        return;
     }
 
-    if (uvc_request_bufs(uvc_dev.nbufs) < 0) {
+    if (uvc_request_bufs(dev, dev->nbufs) < 0) {
         return;
     }
 
-    if (settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
+    if (pipeline->settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
         if (fb_mmap_open() < 0) {
             return;
         }
@@ -1260,29 +5479,41 @@ static void uvc_handle_streamon_event()
             return;
         }
 
-        uvc_video_stream(STREAM_ON);
-        settings.blink_on_startup = 0;
-        streaming_status_value(uvc_dev.is_streaming);
+        uvc_video_stream(dev, STREAM_ON);
+        pipeline->settings.blink_on_startup = 0;
+        streaming_status_value(dev->is_streaming);
     }
 }
 
-static void uvc_handle_streamoff_event()
+static void uvc_handle_streamoff_event(struct v4l2_device * dev)
 {
-    if (settings.source_device == DEVICE_TYPE_V4L2) {
-        v4l2_video_stream(STREAM_OFF);
-        v4l2_uninit_device();
-        v4l2_request_bufs(0);
+    /* The frame in flight may use a slot of this output. */
+    frame_stage_flush();
+    uvc_video_stream(dev, STREAM_OFF);
+    uvc_request_bufs(dev, 0);
+    uvc_uninit_device(dev);
+
+    if (pipeline->settings.source_device == DEVICE_TYPE_V4L2) {
+        buffer_pool_detach(dev->index);
+
+        /* Capture keeps running for the other outputs. */
+        if (buffer_pool_outputs(-1)) {
+            return;
+        }
+
+        /* Keep the sensor warm for the next STREAMON, unless shutting down. */
+        if (pipeline->settings.standby && pipeline->capture.running && !pipeline->processing.loop.stop) {
+            v4l2_standby_resume();
+        } else {
+            v4l2_capture_stop();
+        }
     }
 
-    if (settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
+    if (pipeline->settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
         fb_mmap_close();
-        uvc_uninit_device();
     }
 
-    uvc_video_stream(STREAM_OFF);
-    uvc_request_bufs(0);
-
-    streaming_status_value(uvc_dev.is_streaming);
+    streaming_status_value(dev->is_streaming);
 }
 
 /* ---------------------------------------------------------------------------
@@ -1290,7 +5521,7 @@ static void uvc_handle_streamoff_event()
  */
 static void dump_uvc_streaming_control(struct uvc_streaming_control * ctrl)
 {
-    printf("DUMP: uvc_streaming_control: format: %d, frame: %d, frame interval: %d\n",
+    log_debug("DUMP: uvc_streaming_control: format: %d, frame: %d, frame interval: %d\n",
         ctrl->bFormatIndex,
         ctrl->bFrameIndex,
         ctrl->dwFrameInterval
@@ -1303,18 +5534,18 @@ static int uvc_get_frame_format_index(int format_index, enum uvc_frame_format_ge
     int value;
     int i;
 
-    for (i = 0; i <= last_format_index; i++) {
-        if (format_index == -1 || format_index == (int) uvc_frame_format[i].bFormatIndex) {
+    for (i = 0; i <= pipeline->last_format_index; i++) {
+        if (format_index == -1 || format_index == (int) pipeline->uvc_frame_format[i].bFormatIndex) {
 
             switch (getter) {
                 case FORMAT_INDEX_MIN:
                 case FORMAT_INDEX_MAX:
-                    value = uvc_frame_format[i].bFormatIndex;
+                    value = pipeline->uvc_frame_format[i].bFormatIndex;
                     break;
 
                 case FRAME_INDEX_MIN:
                 case FRAME_INDEX_MAX:
-                    value = uvc_frame_format[i].bFrameIndex;
+                    value = pipeline->uvc_frame_format[i].bFrameIndex;
                     break;
             }
             if (index == -1) {
@@ -1346,20 +5577,20 @@ static int uvc_get_frame_format(struct uvc_frame_format ** frame_format,
     unsigned int iFormat, unsigned int iFrame)
 {
     int i;
-    for (i = 0; i <= last_format_index; i++) {
-        if (uvc_frame_format[i].bFormatIndex == iFormat &&
-            uvc_frame_format[i].bFrameIndex == iFrame
+    for (i = 0; i <= pipeline->last_format_index; i++) {
+        if (pipeline->uvc_frame_format[i].bFormatIndex == iFormat &&
+            pipeline->uvc_frame_format[i].bFrameIndex == iFrame
         ) {
-            *frame_format = &uvc_frame_format[i];
+            *frame_format = &pipeline->uvc_frame_format[i];
             return 0;
         }
     }
     return -1;
 }
 
-static void uvc_dump_frame_format(struct uvc_frame_format * frame_format, const char * title)
+static void uvc_dump_frame_format(enum log_level level, struct uvc_frame_format * frame_format, const char * title)
 {
-    printf("%s: format: %d, frame: %d, resolution: %dx%d, frame_interval: %d,  bitrate: [%d, %d]\n",
+    log_print(level, "%s: format: %d, frame: %d, resolution: %dx%d, frame_interval: %d,  bitrate: [%d, %d]\n",
         title,
         frame_format->bFormatIndex,
         frame_format->bFrameIndex,
@@ -1371,8 +5602,8 @@ static void uvc_dump_frame_format(struct uvc_frame_format * frame_format, const
     );
 }
 
-static void uvc_fill_streaming_control(struct uvc_streaming_control * ctrl,
-    enum stream_control_action action, int iformat, int iframe)
+static void uvc_fill_streaming_control(struct v4l2_device * dev, struct uvc_streaming_control * ctrl,
+    enum stream_control_action action, int iformat, int iframe, unsigned int interval)
 {
     int format_first;
     int format_last;
@@ -1382,22 +5613,24 @@ static void uvc_fill_streaming_control(struct uvc_streaming_control * ctrl,
     int format_frame_last;
     unsigned int frame_interval;
     unsigned int dwMaxPayloadTransferSize;
+    unsigned int other;
+    bool shared;
 
     switch (action) {
     case STREAM_CONTROL_INIT:
-        printf("UVC: Streaming control: action: INIT\n");
+        log_debug("UVC: Streaming control: action: INIT\n");
         break;
 
     case STREAM_CONTROL_MIN:
-        printf("UVC: Streaming control: action: GET MIN\n");
+        log_debug("UVC: Streaming control: action: GET MIN\n");
         break;
 
     case STREAM_CONTROL_MAX:
-        printf("UVC: Streaming control: action: GET MAX\n");
+        log_debug("UVC: Streaming control: action: GET MAX\n");
         break;
 
     case STREAM_CONTROL_SET:
-        printf("UVC: Streaming control: action: SET, format: %d, frame: %d\n", iformat, iframe);
+        log_debug("UVC: Streaming control: action: SET, format: %d, frame: %d\n", iformat, iframe);
         break;
 
     }
@@ -1425,20 +5658,41 @@ static void uvc_fill_streaming_control(struct uvc_streaming_control * ctrl,
         iframe = clamp(iframe, format_frame_first, format_frame_last);
     }
 
+    /* The camera can't be reconfigured under another streaming output, only its frames are offered. */
+    shared = action != STREAM_CONTROL_INIT && pipeline->settings.source_device == DEVICE_TYPE_V4L2 &&
+        buffer_pool_outputs(dev->index);
+    if (shared) {
+        for (other = 0; other == dev->index || !pipeline->buffer_pool.uvc[other].nbufs; other++);
+
+        if (action == STREAM_CONTROL_SET && (iformat != pipeline->uvc_devs[other].commit.bFormatIndex ||
+                iframe != pipeline->uvc_devs[other].commit.bFrameIndex)
+        ) {
+            log_warning("%s: Capture is shared with %s, format %d frame %d is answered with format %d frame %d\n",
+                dev->device_type_name, pipeline->uvc_devs[other].device_type_name, iformat, iframe,
+                pipeline->uvc_devs[other].commit.bFormatIndex, pipeline->uvc_devs[other].commit.bFrameIndex);
+        }
+        iformat = pipeline->uvc_devs[other].commit.bFormatIndex;
+        iframe = pipeline->uvc_devs[other].commit.bFrameIndex;
+    }
+
     struct uvc_frame_format * frame_format;
     uvc_get_frame_format(&frame_format, iformat, iframe);
 
-    uvc_dump_frame_format(frame_format, "FRAME");
+    uvc_dump_frame_format(LOG_LEVEL_DEBUG, frame_format, "FRAME");
 
-    if (frame_format->dwDefaultFrameInterval >= 100000) {
+    if (action == STREAM_CONTROL_SET && interval) {
+        /* Keep the interval the host asked for, the camera is set up to match on commit. */
+        frame_interval = interval;
+
+    } else if (frame_format->dwDefaultFrameInterval >= 100000) {
         frame_interval = frame_format->dwDefaultFrameInterval;
     } else {
         frame_interval = 400000;
     }
 
-    dwMaxPayloadTransferSize = streaming_maxpacket;
-    if (streaming_maxpacket > 1024 && streaming_maxpacket % 1024 != 0) {
-        dwMaxPayloadTransferSize -= (streaming_maxpacket / 1024) * 128;
+    dwMaxPayloadTransferSize = pipeline->streaming_maxpacket;
+    if (pipeline->streaming_maxpacket > 1024 && pipeline->streaming_maxpacket % 1024 != 0) {
+        dwMaxPayloadTransferSize -= (pipeline->streaming_maxpacket / 1024) * 128;
     }
 
     memset(ctrl, 0, sizeof * ctrl);
@@ -1455,104 +5709,106 @@ static void uvc_fill_streaming_control(struct uvc_streaming_control * ctrl,
 
     dump_uvc_streaming_control(ctrl);
 
-    if (uvc_dev.control == UVC_VS_COMMIT_CONTROL && action == STREAM_CONTROL_SET) {
-        if (settings.source_device == DEVICE_TYPE_V4L2) {
-            //in my case ,force use V4L2_PIX_FMT_JPEG format
-            v4l2_apply_format(&v4l2_dev, V4L2_PIX_FMT_JPEG, frame_format->wWidth, frame_format->wHeight);
-        }
-        v4l2_apply_format(&uvc_dev, frame_format->video_format, frame_format->wWidth, frame_format->wHeight);
+    if (dev->control != UVC_VS_COMMIT_CONTROL || action != STREAM_CONTROL_SET) {
+        return;
+    }
+
+    /* Same format and frame as the streaming output, it gets the same frames. */
+    if (shared) {
+        v4l2_apply_format(dev, frame_format->video_format, frame_format->wWidth, frame_format->wHeight);
+        return;
     }
+
+    v4l2_standby_stop();
+    format_plan_commit(frame_format->video_format, frame_format->wWidth,
+        frame_format->wHeight, frame_interval);
+    v4l2_apply_format(dev, frame_format->video_format, frame_format->wWidth, frame_format->wHeight);
+    v4l2_standby_start();
 }
 
-static void uvc_interface_control(unsigned int interface,
+static void uvc_interface_control(struct v4l2_device * dev, unsigned int interface,
     uint8_t req, uint8_t cs, uint8_t len, struct uvc_request_data * resp)
 {
-    int i;
-    bool found = false;
+    int i = control_lookup(interface, cs);
+    struct control_state * ctrl;
     const char * request_code_name = uvc_request_code_name(req);
     const char * interface_name = (interface == UVC_VC_INPUT_TERMINAL) ? "INPUT_TERMINAL" : "PROCESSING_UNIT";
 
-    for (i = 0; i < control_mapping_size; i++) {
-        if (control_mapping[i].type == interface && control_mapping[i].uvc == cs) {
-            found = true;
-            break;
-        }
-    }
-
-    if (!found) {
-        printf("UVC: %s - %s - %02x - UNSUPPORTED\n", interface_name, request_code_name, cs);
+    if (i < 0) {
+        log_debug("UVC: %s - %s - %02x - UNSUPPORTED\n", interface_name, request_code_name, cs);
         resp->length = -EL2HLT;
-        uvc_dev.request_error_code = REQEC_INVALID_CONTROL;
+        dev->request_error_code = REQEC_INVALID_CONTROL;
         return;
     }
 
-    if (!control_mapping[i].enabled) {
-        printf("UVC: %s - %s - %s - DISABLED\n", interface_name, request_code_name,
+    ctrl = &pipeline->controls[i];
+    if (!ctrl->enabled) {
+        log_debug("UVC: %s - %s - %s - DISABLED\n", interface_name, request_code_name,
             control_mapping[i].uvc_name);
         resp->length = -EL2HLT;
-        uvc_dev.request_error_code = REQEC_INVALID_CONTROL;
+        dev->request_error_code = REQEC_INVALID_CONTROL;
         return;
     }
 
-    printf("UVC: %s - %s - %s\n", interface_name, request_code_name, control_mapping[i].uvc_name);
+    log_debug("UVC: %s - %s - %s\n", interface_name, request_code_name, control_mapping[i].uvc_name);
 
     switch (req) {
     case UVC_SET_CUR:
         resp->data[0] = 0x0;
         resp->length = len;
-        uvc_dev.control_interface = interface;
-        uvc_dev.control_type = cs;
-        uvc_dev.request_error_code = REQEC_NO_ERROR;
+        dev->control_interface = interface;
+        dev->control_type = cs;
+        dev->request_error_code = REQEC_NO_ERROR;
         break;
 
     case UVC_GET_MIN:
         resp->length = 4;
-        memcpy(&resp->data[0], &control_mapping[i].minimum, resp->length);
-        uvc_dev.request_error_code = REQEC_NO_ERROR;
+        memcpy(&resp->data[0], &ctrl->minimum, resp->length);
+        dev->request_error_code = REQEC_NO_ERROR;
         break;
 
     case UVC_GET_MAX:
         resp->length = 4;
-        memcpy(&resp->data[0], &control_mapping[i].maximum, resp->length);
-        uvc_dev.request_error_code = REQEC_NO_ERROR;
+        memcpy(&resp->data[0], &ctrl->maximum, resp->length);
+        dev->request_error_code = REQEC_NO_ERROR;
         break;
 
     case UVC_GET_CUR:
         resp->length = 4;
-        memcpy(&resp->data[0], &control_mapping[i].value, resp->length);
-        uvc_dev.request_error_code = REQEC_NO_ERROR;
+        memcpy(&resp->data[0], &ctrl->value, resp->length);
+        dev->request_error_code = REQEC_NO_ERROR;
         break;
 
     case UVC_GET_INFO:
         resp->data[0] = (uint8_t)(UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET);
         resp->length = 1;
-        uvc_dev.request_error_code = REQEC_NO_ERROR;
+        dev->request_error_code = REQEC_NO_ERROR;
         break;
 
     case UVC_GET_DEF:
         resp->length = 4;
-        memcpy(&resp->data[0], &control_mapping[i].default_value, resp->length);
-        uvc_dev.request_error_code = REQEC_NO_ERROR;
+        memcpy(&resp->data[0], &ctrl->default_value, resp->length);
+        dev->request_error_code = REQEC_NO_ERROR;
         break;
 
     case UVC_GET_RES:
         resp->length = 4;
-        memcpy(&resp->data[0], &control_mapping[i].step, resp->length);
-        uvc_dev.request_error_code = REQEC_NO_ERROR;
+        memcpy(&resp->data[0], &ctrl->step, resp->length);
+        dev->request_error_code = REQEC_NO_ERROR;
         break;
 
     default:
         resp->length = -EL2HLT;
-        uvc_dev.request_error_code = REQEC_INVALID_REQUEST;
+        dev->request_error_code = REQEC_INVALID_REQUEST;
         break;
 
     }
     return;
 }
 
-static void uvc_events_process_streaming(uint8_t req, uint8_t cs, struct uvc_request_data * resp)
+static void uvc_events_process_streaming(struct v4l2_device * dev, uint8_t req, uint8_t cs, struct uvc_request_data * resp)
 {
-    printf("UVC: Streaming request CS: %s, REQ: %s\n", uvc_vs_interface_control_name(cs),
+    log_debug("UVC: Streaming request CS: %s, REQ: %s\n", uvc_vs_interface_control_name(cs),
         uvc_request_code_name(req));
 
     if (cs != UVC_VS_PROBE_CONTROL && cs != UVC_VS_COMMIT_CONTROL) {
@@ -1560,19 +5816,19 @@ static void uvc_events_process_streaming(uint8_t req, uint8_t cs, struct uvc_req
     }
 
     struct uvc_streaming_control * ctrl = (struct uvc_streaming_control *) &resp->data;
-    struct uvc_streaming_control * target = (cs == UVC_VS_PROBE_CONTROL) ? &(uvc_dev.probe) : &(uvc_dev.commit);
+    struct uvc_streaming_control * target = (cs == UVC_VS_PROBE_CONTROL) ? &(dev->probe) : &(dev->commit);
 
     int ctrl_length = sizeof * ctrl;
     resp->length = ctrl_length;
 
     switch (req) {
     case UVC_SET_CUR:
-        uvc_dev.control = cs;
+        dev->control = cs;
         resp->length = ctrl_length;
         break;
 
     case UVC_GET_MAX:
-        uvc_fill_streaming_control(ctrl, STREAM_CONTROL_MAX, 0, 0);
+        uvc_fill_streaming_control(dev, ctrl, STREAM_CONTROL_MAX, 0, 0, 0);
         break;
 
     case UVC_GET_CUR:
@@ -1581,7 +5837,7 @@ static void uvc_events_process_streaming(uint8_t req, uint8_t cs, struct uvc_req
 
     case UVC_GET_MIN:
     case UVC_GET_DEF:
-        uvc_fill_streaming_control(ctrl, STREAM_CONTROL_MIN, 0, 0);
+        uvc_fill_streaming_control(dev, ctrl, STREAM_CONTROL_MIN, 0, 0, 0);
         break;
 
     case UVC_GET_RES:
@@ -1601,7 +5857,7 @@ static void uvc_events_process_streaming(uint8_t req, uint8_t cs, struct uvc_req
     }
 }
 
-static void uvc_events_process_class(struct usb_ctrlrequest * ctrl, struct uvc_request_data * resp)
+static void uvc_events_process_class(struct v4l2_device * dev, struct usb_ctrlrequest * ctrl, struct uvc_request_data * resp)
 {
     uint8_t type = ctrl->wIndex & 0xff;
     uint8_t interface = ctrl->wIndex >> 8;
@@ -1617,17 +5873,17 @@ static void uvc_events_process_class(struct usb_ctrlrequest * ctrl, struct uvc_r
         switch (interface) {
             case 0:
                 if (control == UVC_VC_REQUEST_ERROR_CODE_CONTROL) {
-                    resp->data[0] = uvc_dev.request_error_code;
+                    resp->data[0] = dev->request_error_code;
                     resp->length = 1;
                 }
                 break;
 
             case 1:
-                uvc_interface_control(UVC_VC_INPUT_TERMINAL, ctrl->bRequest, control, length, resp);
+                uvc_interface_control(dev, UVC_VC_INPUT_TERMINAL, ctrl->bRequest, control, length, resp);
                 break;
 
             case 2:
-                uvc_interface_control(UVC_VC_PROCESSING_UNIT, ctrl->bRequest, control, length, resp);
+                uvc_interface_control(dev, UVC_VC_PROCESSING_UNIT, ctrl->bRequest, control, length, resp);
                 break;
 
             default:
@@ -1636,7 +5892,7 @@ static void uvc_events_process_class(struct usb_ctrlrequest * ctrl, struct uvc_r
         break;
 
     case UVC_INTF_STREAMING:
-        uvc_events_process_streaming(ctrl->bRequest, control, resp);
+        uvc_events_process_streaming(dev, ctrl->bRequest, control, resp);
         break;
 
     default:
@@ -1644,72 +5900,66 @@ static void uvc_events_process_class(struct usb_ctrlrequest * ctrl, struct uvc_r
     }
 }
 
-static void uvc_events_process_setup(struct usb_ctrlrequest * ctrl, struct uvc_request_data * resp)
+static void uvc_events_process_setup(struct v4l2_device * dev, struct usb_ctrlrequest * ctrl, struct uvc_request_data * resp)
 {
-    uvc_dev.control = 0;
+    dev->control = 0;
     if ((ctrl->bRequestType & USB_TYPE_MASK) == USB_TYPE_CLASS) {
-        uvc_events_process_class(ctrl, resp);
+        uvc_events_process_class(dev, ctrl, resp);
     }
 
-    if (ioctl(uvc_dev.fd, UVCIOC_SEND_RESPONSE, resp) < 0) {
-        printf("UVCIOC_SEND_RESPONSE failed: %s (%d)\n", strerror(errno), errno);
+    if (ioctl(dev->fd, UVCIOC_SEND_RESPONSE, resp) < 0) {
+        log_error("UVCIOC_SEND_RESPONSE failed: %s (%d)\n", strerror(errno), errno);
     }
 }
 
-static void uvc_events_process_data_control(struct uvc_request_data * data, struct uvc_streaming_control * target)
+static void uvc_events_process_data_control(struct v4l2_device * dev, struct uvc_request_data * data, struct uvc_streaming_control * target)
 {
     struct uvc_streaming_control * ctrl = (struct uvc_streaming_control *) &data->data;
     unsigned int iformat = (unsigned int) ctrl->bFormatIndex;
     unsigned int iframe = (unsigned int) ctrl->bFrameIndex;
 
-    uvc_fill_streaming_control(target, STREAM_CONTROL_SET, iformat, iframe);
+    uvc_fill_streaming_control(dev, target, STREAM_CONTROL_SET, iformat, iframe, ctrl->dwFrameInterval);
 }
 
-static void uvc_events_process_data(struct uvc_request_data * data)
+static void uvc_events_process_data(struct v4l2_device * dev, struct uvc_request_data * data)
 {
     int i;
-    printf("UVC: Control %s, length: %d\n", uvc_vs_interface_control_name(uvc_dev.control), data->length);
+    log_debug("UVC: Control %s, length: %d\n", uvc_vs_interface_control_name(dev->control), data->length);
 
-    switch (uvc_dev.control) {
+    switch (dev->control) {
     case UVC_VS_PROBE_CONTROL:
-        uvc_events_process_data_control(data, &(uvc_dev.probe));
+        uvc_events_process_data_control(dev, data, &(dev->probe));
         break;
 
     case UVC_VS_COMMIT_CONTROL:
-        uvc_events_process_data_control(data, &(uvc_dev.commit));
+        uvc_events_process_data_control(dev, data, &(dev->commit));
         break;
 
     case UVC_VS_CONTROL_UNDEFINED:
-        if (data->length > 0 && data->length <= 4) {
-            for (i = 0; i < control_mapping_size; i++) {
-                if (control_mapping[i].type == uvc_dev.control_interface &&
-                    control_mapping[i].uvc == uvc_dev.control_type &&
-                    control_mapping[i].enabled
-                ) {
-                    control_mapping[i].value = 0x00000000;
-                    control_mapping[i].length = data->length;
-                    memcpy(&control_mapping[i].value, data->data, data->length);
-                    v4l2_set_ctrl(control_mapping[i]);
-                }
-            }
+        i = control_lookup(dev->control_interface, dev->control_type);
+        if (data->length > 0 && data->length <= 4 && i >= 0 && pipeline->controls[i].enabled) {
+            pipeline->controls[i].value = 0x00000000;
+            pipeline->controls[i].length = data->length;
+            memcpy(&pipeline->controls[i].value, data->data, data->length);
+            control_worker_queue(i);
         }
         break;
 
     default:
-        printf("UVC: Setting unknown control, length = %d\n", data->length);
+        log_info("UVC: Setting unknown control, length = %d\n", data->length);
         break;
     }
 }
 
-static void uvc_events_process()
+static void uvc_events_process(struct v4l2_device * dev)
 {
     struct v4l2_event v4l2_event;
     struct uvc_event * uvc_event = (void *) &v4l2_event.u.data;
     struct uvc_request_data resp;
 
-    if (ioctl(uvc_dev.fd, VIDIOC_DQEVENT, &v4l2_event) < 0) {
-        printf("%s: VIDIOC_DQEVENT failed: %s (%d)\n",
-            uvc_dev.device_type_name, strerror(errno), errno);
+    if (ioctl(dev->fd, VIDIOC_DQEVENT, &v4l2_event) < 0) {
+        log_error("%s: VIDIOC_DQEVENT failed: %s (%d)\n",
+            dev->device_type_name, strerror(errno), errno);
         return;
     }
 
@@ -1718,28 +5968,28 @@ static void uvc_events_process()
 
     switch (v4l2_event.type) {
     case UVC_EVENT_CONNECT:
-        printf("%s: UVC_EVENT_CONNECT\n", uvc_dev.device_type_name);
+        log_info("%s: UVC_EVENT_CONNECT\n", dev->device_type_name);
         break;
 
     case UVC_EVENT_DISCONNECT:
-        printf("%s: UVC_EVENT_DISCONNECT\n", uvc_dev.device_type_name);
-        uvc_shutdown_requested = true;
+        log_info("%s: UVC_EVENT_DISCONNECT\n", dev->device_type_name);
+        dev->uvc_shutdown_requested = true;
         break;
 
     case UVC_EVENT_SETUP:
-        uvc_events_process_setup(&uvc_event->req, &resp);
+        uvc_events_process_setup(dev, &uvc_event->req, &resp);
         break;
 
     case UVC_EVENT_DATA:
-        uvc_events_process_data(&uvc_event->data);
+        uvc_events_process_data(dev, &uvc_event->data);
         break;
 
     case UVC_EVENT_STREAMON:
-        uvc_handle_streamon_event();
+        uvc_handle_streamon_event(dev);
         break;
 
     case UVC_EVENT_STREAMOFF:
-        uvc_handle_streamoff_event();
+        uvc_handle_streamoff_event(dev);
         break;
 
     default:
@@ -1747,33 +5997,41 @@ static void uvc_events_process()
     }
 }
 
-static void uvc_events(int action)
+static void uvc_events(struct v4l2_device * dev, int action)
 {
     struct v4l2_event_subscription sub;
     CLEAR(sub);
 
     sub.type = UVC_EVENT_CONNECT;
-    ioctl(uvc_dev.fd, action, &sub);
+    ioctl(dev->fd, action, &sub);
     sub.type = UVC_EVENT_DISCONNECT;
-    ioctl(uvc_dev.fd, action, &sub);
+    ioctl(dev->fd, action, &sub);
     sub.type = UVC_EVENT_SETUP;
-    ioctl(uvc_dev.fd, action, &sub);
+    ioctl(dev->fd, action, &sub);
     sub.type = UVC_EVENT_DATA;
-    ioctl(uvc_dev.fd, action, &sub);
+    ioctl(dev->fd, action, &sub);
     sub.type = UVC_EVENT_STREAMON;
-    ioctl(uvc_dev.fd, action, &sub);
+    ioctl(dev->fd, action, &sub);
     sub.type = UVC_EVENT_STREAMOFF;
-    ioctl(uvc_dev.fd, action, &sub);
+    ioctl(dev->fd, action, &sub);
 }
 
 static void uvc_events_subscribe()
 {
-    uvc_events(VIDIOC_SUBSCRIBE_EVENT);
+    unsigned int out;
+
+    for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+        uvc_events(&pipeline->uvc_devs[out], VIDIOC_SUBSCRIBE_EVENT);
+    }
 }
 
 static void uvc_events_unsubscribe()
 {
-    uvc_events(VIDIOC_UNSUBSCRIBE_EVENT);
+    unsigned int out;
+
+    for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+        uvc_events(&pipeline->uvc_devs[out], VIDIOC_UNSUBSCRIBE_EVENT);
+    }
 }
 
 
@@ -1781,232 +6039,479 @@ static void uvc_events_unsubscribe()
  * main
  */
 
-static void processing_loop_v4l2_uvc()
+static void processing_update_events()
 {
-    struct timeval tv;
-    struct timeval video_tv;
-    double last_time_blink = 0;
-    bool blink_state = false;
-    int activity;
-    fd_set fdsv, fdsu;
-    int nfds;
+    uint32_t uvc_events;
+    unsigned int interval = 0;
+    unsigned int out;
 
-    printf("PROCESSING LOOP: V4L2 -> UVC\n");
-
-    while (!terminate) {
-        FD_ZERO(&fdsv);
-        FD_ZERO(&fdsu);
+    /*
+     * Data events are only requested while the queues are streaming,
+     * a stopped vb2 queue reports EPOLLERR and would keep waking us up.
+     */
+    for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+        uvc_events = EPOLLPRI;
+        if (pipeline->uvc_devs[out].is_streaming) {
+            /* A framebuffer frame in the frame stage is queued when it finished. */
+            if (pipeline->settings.source_device == DEVICE_TYPE_V4L2 ||
+                (pipeline->processing.fb_frame_due && !pipeline->frame_stage.busy)
+            ) {
+                uvc_events |= EPOLLOUT;
+            }
+        }
+        event_loop_update(&pipeline->processing.loop, &pipeline->processing.uvc[out], uvc_events);
+    }
 
-        /* We want both setup and data events on UVC interface.. */
-        FD_SET(uvc_dev.fd, &fdsu);
+    if (pipeline->settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
+        /* Pace the framebuffer only while the host is streaming. */
+        if (pipeline->processing.output_streaming != (bool) uvc_dev.is_streaming) {
+            pipeline->processing.output_streaming = uvc_dev.is_streaming;
+            event_timer_arm(&pipeline->processing.fb_timer,
+                (pipeline->processing.output_streaming) ? pipeline->processing.fb_interval : 0, pipeline->processing.fb_interval);
+        }
+        return;
+    }
 
-        fd_set efds = fdsu;
-        fd_set dfds = fdsu;
+    if (pipeline->processing.capture_streaming != (bool) pipeline->v4l2_dev.is_streaming) {
+        pipeline->processing.capture_streaming = pipeline->v4l2_dev.is_streaming;
+        event_timer_arm(&pipeline->processing.watchdog_timer,
+            (pipeline->processing.capture_streaming) ? 1000000000ULL : 0, 0);
+
+        /* Frames are due at the fastest committed host rate, repeats are armed per frame. */
+        for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+            if (pipeline->uvc_devs[out].commit.dwFrameInterval &&
+                (!interval || pipeline->uvc_devs[out].commit.dwFrameInterval < interval)
+            ) {
+                interval = pipeline->uvc_devs[out].commit.dwFrameInterval;
+            }
+        }
+        pipeline->processing.frame_interval = (interval) ? interval * 100ULL : 1000000000ULL / 30;
+        if (pipeline->settings.frame_repeat && !pipeline->processing.capture_streaming) {
+            event_timer_arm(&pipeline->processing.repeat_timer, 0, 0);
+        }
+    }
+}
 
-        /* yield CPU to other processes and avoid spinlock when camera is not being used
-         * fix from - https://github.com/kinweilee/v4l2-mmal-uvc/blob/master/v4l2-mmal-uvc.c
-         * rcarmo - https://github.com/peterbay/uvc-gadget/pull/6
-         */
-        nanosleep ((const struct timespec[]) { {0, 1000000L} }, NULL);
+static void processing_controls_handler(struct event_source * source, uint32_t events)
+{
+    (void)(source);
 
-        /* Timeout. */
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
+    if (events & EPOLLPRI) {
+        v4l2_dequeue_events();
+    }
+}
 
-        /* don't block vdev device if streaming is off */
-        if (v4l2_dev.is_streaming) {
-            /* ..but only data events on V4L2 interface */
-            FD_SET(v4l2_dev.fd, &fdsv);
+static void processing_uvc_handler(struct event_source * source, uint32_t events)
+{
+    struct v4l2_device * dev = source->data;
 
-            nfds = max(v4l2_dev.fd, uvc_dev.fd);
-            activity = select(nfds + 1, &fdsv, &dfds, &efds, &tv);
+    if (events & EPOLLPRI) {
+        uvc_events_process(dev);
+    }
 
-            if (activity == 0) {
-                printf("PROCESSING: Select timeout\n");
-                break;
+    if ((events & EPOLLOUT) && dev->is_streaming) {
+        if (pipeline->settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
+            if (!pipeline->frame_stage.busy) {
+                uvc_fb_video_process();
+                pipeline->processing.fb_frame_due = false;
             }
 
-        } else {
-            activity = select(uvc_dev.fd + 1, NULL, &dfds, &efds, NULL);
+        } else if (pipeline->v4l2_dev.is_streaming) {
+            uvc_v4l2_video_process(dev);
+        }
+    }
+
+    processing_update_events();
+}
+
+static void processing_wakeup_handler(struct event_source * source, uint32_t events)
+{
+    event_loop_wakeup_handler(source, events);
+
+    /* The frame stage finished a frame. */
+    if (frame_stage_collect()) {
+        processing_frame_done();
+        processing_update_events();
+    }
+
+    if (pipeline->settings.source_device != DEVICE_TYPE_V4L2 || !pipeline->v4l2_dev.is_streaming) {
+        return;
+    }
+
+    /* Same as a capture timeout, without waiting for the watchdog. */
+    if (atomic_load(&pipeline->capture.failed)) {
+        log_error("PROCESSING: Capture error\n");
+        pipeline->processing.loop.stop = true;
+        return;
+    }
+
+    /* Buffers handed over by the capture thread. */
+    v4l2_uvc_video_process();
+
+    /* Capture is alive, postpone the watchdog. */
+    event_timer_arm(&pipeline->processing.watchdog_timer, 1000000000ULL, 0);
+
+    processing_update_events();
+}
+
+static void processing_watchdog_handler(struct event_source * source, uint32_t events)
+{
+    (void)(events);
+    event_timer_read(source);
+
+    if (pipeline->v4l2_dev.is_streaming) {
+        log_error("PROCESSING: Capture timeout\n");
+        pipeline->processing.loop.stop = true;
+    }
+}
+
+static void processing_repeat_timer_handler(struct event_source * source, uint32_t events)
+{
+    (void)(events);
+    event_timer_read(source);
+
+    if (!pipeline->v4l2_dev.is_streaming) {
+        return;
+    }
+
+    /* The camera missed the deadline, fill the gap and wait one more host frame period. */
+    uvc_v4l2_repeat_frame();
+    event_timer_arm(source, pipeline->processing.frame_interval, 0);
+
+    processing_update_events();
+}
+
+static void processing_fb_timer_handler(struct event_source * source, uint32_t events)
+{
+    uint64_t expirations;
+
+    (void)(events);
+    expirations = event_timer_read(source);
+
+    /* Every extra expiration is a frame period that passed without a frame. */
+    if (expirations > 1) {
+        deadline_miss("FB", "frame timer",
+            (expirations - 1) * pipeline->processing.fb_interval);
+    }
+
+    pipeline->processing.fb_frame_due = true;
+    processing_update_events();
+}
+
+/* Current value of the counters shown by -x */
+static void stats_mark_take(struct stats_mark * mark)
+{
+    struct stats_histogram * total = &pipeline->stats.latency[STATS_STAGE_TOTAL];
+    unsigned int out;
+
+    mark->frames_captured   = pipeline->stats.frames_captured;
+    mark->stale_dropped     = pipeline->stats.stale_dropped;
+    mark->identical_skipped = pipeline->stats.identical_skipped;
+    mark->latency_frames    = total->frames;
+    mark->latency_total     = total->total;
+    mark->frames_repeated   = 0;
+
+    for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+        mark->frames_repeated += pipeline->stats.outputs[out].repeated;
+    }
+}
+
+static void processing_fps_timer_handler(struct event_source * source, uint32_t events)
+{
+    struct stats_mark * last = &pipeline->stats.fps_mark;
+    struct stats_mark now;
+    unsigned int latency_avg;
+    unsigned int latency_max;
+    unsigned int stage;
+    unsigned int out;
+
+    (void)(events);
+    event_timer_read(source);
+
+    if (pipeline->settings.source_device == DEVICE_TYPE_V4L2 && !pipeline->v4l2_dev.is_streaming) {
+        return;
+    }
+
+    /* The FPS line shows what the statistics counted since the last one. */
+    stats_mark_take(&now);
+
+    if (pipeline->settings.source_device == DEVICE_TYPE_FRAMEBUFFER && uvc_dev.buffers_processed) {
+        log_info("FPS: %d, identical frames skipped: %u, tiles converted: %u%%\n",
+            uvc_dev.buffers_processed, (unsigned int) (now.identical_skipped - last->identical_skipped),
+            (unsigned int) (atomic_exchange(&pipeline->fb_dev.fb_tiles_converted, 0) * 100ULL /
+            ((unsigned long long) pipeline->fb_dev.fb_tiles_x * pipeline->fb_dev.fb_tiles_y * uvc_dev.buffers_processed)));
+
+    } else if (now.latency_frames > last->latency_frames) {
+        /* in tenths of a millisecond */
+        latency_avg = (now.latency_total - last->latency_total) / (now.latency_frames - last->latency_frames) / 100000;
+        latency_max = pipeline->stats.latency[STATS_STAGE_TOTAL].window_max / 100000;
+
+        log_info("FPS: %d, captured: %u, repeated: %u, stale frames dropped: %u, "
+            "latency avg: %u.%u ms, max: %u.%u ms\n",
+            uvc_dev.buffers_processed, (unsigned int) (now.frames_captured - last->frames_captured),
+            (unsigned int) (now.frames_repeated - last->frames_repeated),
+            (unsigned int) (now.stale_dropped - last->stale_dropped), latency_avg / 10, latency_avg % 10,
+            latency_max / 10, latency_max % 10);
+
+    } else {
+        log_info("FPS: %d\n", uvc_dev.buffers_processed);
+    }
+    uvc_dev.buffers_processed = 0;
+
+    for (out = 1; out < pipeline->settings.uvc_ndevs; out++) {
+        log_info("FPS: %s: %d\n", pipeline->uvc_devs[out].device_type_name, pipeline->uvc_devs[out].buffers_processed);
+        pipeline->uvc_devs[out].buffers_processed = 0;
+    }
+
+    *last = now;
+    for (stage = 0; stage < STATS_STAGES; stage++) {
+        pipeline->stats.latency[stage].window_max = 0;
+    }
+}
+
+static void processing_blink_timer_handler(struct event_source * source, uint32_t events)
+{
+    (void)(events);
+    event_timer_read(source);
+
+    if (pipeline->settings.blink_on_startup == 0) {
+        event_timer_arm(source, 0, 0);
+        return;
+    }
+
+    pipeline->processing.blink_state = !(pipeline->processing.blink_state);
+    streaming_status_value(pipeline->processing.blink_state);
+    if (!pipeline->processing.blink_state) {
+        pipeline->settings.blink_on_startup -= 1;
+    }
+}
+
+static int processing_init()
+{
+    uint64_t blink_interval = 100000000ULL;
+    unsigned int out;
+    int ret;
+
+    /* Nothing is open yet, processing_close() also runs after a partial init. */
+    pipeline->processing.watchdog_timer.fd = -1;
+    pipeline->processing.repeat_timer.fd   = -1;
+    pipeline->processing.fb_timer.fd       = -1;
+    pipeline->processing.fps_timer.fd      = -1;
+    pipeline->processing.blink_timer.fd    = -1;
+    pipeline->stats.socket.fd              = -1;
+
+    ret = event_loop_init(&pipeline->processing.loop);
+    if (ret < 0) {
+        return ret;
+    }
+    pipeline->terminate_fd = pipeline->processing.loop.wakeup.fd;
+    pipeline->processing.loop.wakeup.handler = processing_wakeup_handler;
+
+    ret = stats_open();
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+        pipeline->processing.uvc[out].name    = pipeline->uvc_devs[out].device_type_name;
+        pipeline->processing.uvc[out].fd      = pipeline->uvc_devs[out].fd;
+        pipeline->processing.uvc[out].handler = processing_uvc_handler;
+        pipeline->processing.uvc[out].data    = &pipeline->uvc_devs[out];
 
+        ret = event_loop_add(&pipeline->processing.loop, &pipeline->processing.uvc[out], EPOLLPRI);
+        if (ret < 0) {
+            return ret;
         }
+    }
 
-        if (activity == -1) {
-            printf("PROCESSING: Select error %d, %s\n", errno, strerror(errno));
-            if (EINTR == errno) {
-                continue;
-            }
-            break;
-        }
+    if (pipeline->settings.source_device == DEVICE_TYPE_V4L2) {
+        /* Only V4L2 events are asked for, the capture thread owns the buffers of this fd. */
+        pipeline->processing.controls.name    = "CONTROLS";
+        pipeline->processing.controls.fd      = pipeline->v4l2_dev.fd;
+        pipeline->processing.controls.handler = processing_controls_handler;
 
-        gettimeofday(&video_tv, 0);
-        double now = (video_tv.tv_sec + (video_tv.tv_usec * 1e-6)) * 1000;
+        ret = event_loop_add(&pipeline->processing.loop, &pipeline->processing.controls, EPOLLPRI);
+        if (ret < 0) {
+            return ret;
+        }
 
-        if (FD_ISSET(uvc_dev.fd, &efds)) {
-            uvc_events_process();
+        if (event_timer_open(&pipeline->processing.watchdog_timer, "WATCHDOG",
+                processing_watchdog_handler, NULL) < 0 ||
+            event_loop_add(&pipeline->processing.loop, &pipeline->processing.watchdog_timer, EPOLLIN) < 0
+        ) {
+            return -EINVAL;
         }
 
-        if (v4l2_dev.is_streaming) {
-            if (FD_ISSET(uvc_dev.fd, &dfds)) {
-                uvc_v4l2_video_process();
+        if (pipeline->settings.frame_repeat) {
+            if (event_timer_open(&pipeline->processing.repeat_timer, "REPEAT",
+                    processing_repeat_timer_handler, NULL) < 0 ||
+                event_loop_add(&pipeline->processing.loop, &pipeline->processing.repeat_timer, EPOLLIN) < 0
+            ) {
+                return -EINVAL;
             }
+        }
 
-            if (FD_ISSET(v4l2_dev.fd, &fdsv)) {
-                v4l2_uvc_video_process();
-            }
+    } else {
+        pipeline->processing.fb_interval = 1000000000ULL / pipeline->settings.fb_framerate;
 
-            if (settings.show_fps) {
-                if (now - uvc_dev.last_time_video_process >= 1000) {
-                    printf("FPS: %d\n", uvc_dev.buffers_processed);
-                    uvc_dev.buffers_processed = 0;
-                    uvc_dev.last_time_video_process = now;
-                }
-            }
+        if (event_timer_open(&pipeline->processing.fb_timer, "FB", processing_fb_timer_handler, NULL) < 0 ||
+            event_loop_add(&pipeline->processing.loop, &pipeline->processing.fb_timer, EPOLLIN) < 0
+        ) {
+            return -EINVAL;
         }
-        
-        if (settings.blink_on_startup > 0) {
-            if (now - last_time_blink >= 100) {
-                blink_state = !(blink_state);
-                streaming_status_value(blink_state);
-                last_time_blink = now;
-                if (!blink_state) {
-                    settings.blink_on_startup -= 1;
-                }
-            }
+    }
+
+    if (pipeline->settings.show_fps) {
+        if (event_timer_open(&pipeline->processing.fps_timer, "FPS", processing_fps_timer_handler, NULL) < 0 ||
+            event_loop_add(&pipeline->processing.loop, &pipeline->processing.fps_timer, EPOLLIN) < 0 ||
+            event_timer_arm(&pipeline->processing.fps_timer, 1000000000ULL, 1000000000ULL) < 0
+        ) {
+            return -EINVAL;
+        }
+    }
+
+    if (pipeline->settings.blink_on_startup > 0) {
+        if (event_timer_open(&pipeline->processing.blink_timer, "BLINK", processing_blink_timer_handler, NULL) < 0 ||
+            event_loop_add(&pipeline->processing.loop, &pipeline->processing.blink_timer, EPOLLIN) < 0 ||
+            event_timer_arm(&pipeline->processing.blink_timer, blink_interval, blink_interval) < 0
+        ) {
+            return -EINVAL;
         }
     }
+    return 0;
 }
 
-static void processing_loop_fb_uvc() 
+static void processing_close()
 {
-    struct timeval video_tv;
-    int activity;
-    double next_frame_time = 0;
-    double last_time_blink = 0;
-    bool blink_state = false;
-    double now;
-    fd_set fdsu;
-
-    int frame_interval = (1000 / settings.fb_framerate);
-
-    printf("PROCESSING LOOP: FB -> UVC\n");
-
-    while (!terminate) {
-        FD_ZERO(&fdsu);
-        FD_SET(uvc_dev.fd, &fdsu);
+    pipeline->terminate_fd = -1;
+
+    stats_close();
+    event_timer_close(&pipeline->processing.watchdog_timer);
+    event_timer_close(&pipeline->processing.repeat_timer);
+    event_timer_close(&pipeline->processing.fb_timer);
+    event_timer_close(&pipeline->processing.fps_timer);
+    event_timer_close(&pipeline->processing.blink_timer);
+    event_loop_close(&pipeline->processing.loop);
+}
 
-        fd_set efds = fdsu;
-        fd_set dfds = fdsu;
+static void processing_loop()
+{
+    int activity;
 
-        nanosleep ((const struct timespec[]) { {0, 1000000L} }, NULL);
+    if (pipeline->settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
+        log_info("PROCESSING LOOP: FB -> UVC\n");
+    } else {
+        log_info("PROCESSING LOOP: V4L2 -> UVC\n");
+    }
 
-        activity = select(uvc_dev.fd + 1, NULL, &dfds, &efds, NULL);
+    while (!terminate && !pipeline->processing.loop.stop) {
+        activity = event_loop_dispatch(&pipeline->processing.loop, -1);
 
         if (activity == -1) {
-            printf("PROCESSING: Select error %d, %s\n", errno, strerror(errno));
             if (EINTR == errno) {
                 continue;
             }
+            log_error("PROCESSING: Event loop error %d, %s\n", errno, strerror(errno));
             break;
         }
-
-        if (activity == 0) {
-            printf("PROCESSING: Select timeout\n");
-            break;
-        }
-
-        if (FD_ISSET(uvc_dev.fd, &efds)) {
-            uvc_events_process();
-        }
-
-        gettimeofday(&video_tv, 0);
-        now = (video_tv.tv_sec + (video_tv.tv_usec * 1e-6)) * 1000;
-
-        if (FD_ISSET(uvc_dev.fd, &dfds)) {
-            if (now >= next_frame_time) {
-                uvc_fb_video_process();
-                next_frame_time = now + frame_interval;
-            }
-        }
-
-        if (settings.show_fps) {
-            if (now - uvc_dev.last_time_video_process >= 1000) {
-                printf("FPS: %d\n", uvc_dev.buffers_processed);
-                uvc_dev.buffers_processed = 0;
-                uvc_dev.last_time_video_process = now;
-            }
-        }
-
-        if (settings.blink_on_startup > 0) {
-            if (now - last_time_blink >= 100) {
-                blink_state = !(blink_state);
-                streaming_status_value(blink_state);
-                last_time_blink = now;
-                if (!blink_state) {
-                    settings.blink_on_startup -= 1;
-                }
-            }
-        }
     }
 }
 
 static int init()
 {
+    unsigned int out;
     int ret;
 
-    memset(&v4l2_dev, 0, sizeof(v4l2_dev));
-    memset(&uvc_dev, 0, sizeof(uvc_dev));
+    memset(&pipeline->v4l2_dev, 0, sizeof(pipeline->v4l2_dev));
+    memset(pipeline->uvc_devs, 0, sizeof(pipeline->uvc_devs));
 
     streaming_status_enable();
 
-    /* Open the UVC device. */
-    ret = uvc_open(settings.uvc_devname, settings.nbufs);
-    if (ret < 0) {
-        goto err;
+    /* Open the UVC devices, every one of them is fed from the same capture. */
+    for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+        ret = uvc_open(&pipeline->uvc_devs[out], out, pipeline->settings.uvc_devnames[out], pipeline->settings.uvc_nbufs);
+        if (ret < 0) {
+            goto err;
+        }
     }
 
-    if (settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
+    if (pipeline->settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
         /* Open the Frame Buffer device. */
-        ret = fb_open(settings.fb_devname);
+        ret = fb_open(pipeline->settings.fb_devname);
         if (ret < 0) {
             goto err;
         }
 
+        rgb2yuyv_select_kernels();
+
     } else {
         /* Open the V4L2 device. */
-        ret = v4l2_open(settings.v4l2_devname, settings.nbufs);
+        ret = v4l2_open(pipeline->settings.v4l2_devname, pipeline->settings.nbufs);
         if (ret < 0) {
            goto err;
         }
 
         v4l2_get_available_formats();
         v4l2_get_controls();
+
+        /* Control writes can block on the sensor bus, keep them off the streaming loop. */
+        control_worker_start();
+    }
+
+    /* Framebuffer conversion and JPEG encoding split frames across these threads. */
+    ret = worker_pool_start(&pipeline->workers, "WORKERS", pipeline->settings.worker_threads, pipeline->settings.worker_cpus);
+    if (ret < 0) {
+        goto err;
+    }
+
+    jpeg_init(pipeline->settings.jpeg_quality);
+
+    /* Conversion and encoding run here, the pipeline thread keeps answering UVC requests. */
+    ret = frame_stage_start();
+    if (ret < 0) {
+        goto err;
     }
 
     /* Init UVC events. */
-    uvc_fill_streaming_control(&(uvc_dev.probe), STREAM_CONTROL_INIT, 0, 0);
-    uvc_fill_streaming_control(&(uvc_dev.commit), STREAM_CONTROL_INIT, 0, 0);
+    for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+        uvc_fill_streaming_control(&pipeline->uvc_devs[out], &(pipeline->uvc_devs[out].probe), STREAM_CONTROL_INIT, 0, 0, 0);
+        uvc_fill_streaming_control(&pipeline->uvc_devs[out], &(pipeline->uvc_devs[out].commit), STREAM_CONTROL_INIT, 0, 0, 0);
+    }
 
     uvc_events_subscribe();
 
-    if (settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
-        processing_loop_fb_uvc();
-    } else {
-        processing_loop_v4l2_uvc();
-    } 
- 
+    if (processing_init() < 0) {
+        processing_close();
+        uvc_events_unsubscribe();
+        goto err;
+    }
+
+    processing_loop();
+
     uvc_events_unsubscribe();
 
-    printf("\n*** UVC GADGET SHUTDOWN ***\n");
+    if (pipeline->processing.deadline_misses) {
+        log_warning("PROCESSING: %u deadline misses while streaming\n", pipeline->processing.deadline_misses);
+    }
+
+    log_info("\n*** UVC GADGET SHUTDOWN ***\n");
 
-    uvc_handle_streamoff_event();
+    for (out = 0; out < pipeline->settings.uvc_ndevs; out++) {
+        uvc_handle_streamoff_event(&pipeline->uvc_devs[out]);
+    }
+    v4l2_release_bufs();
+    processing_close();
 
 err:
+    frame_stage_stop();
+    worker_pool_stop(&pipeline->workers);
+    control_worker_stop();
+    jpeg_close();
     v4l2_close();
     fb_close();
     uvc_close();
 
-    printf("*** UVC GADGET EXIT ***\n");
+    log_info("*** UVC GADGET EXIT ***\n");
     return 1;
 }
 
@@ -2040,11 +6545,11 @@ static void set_uvc_format_index(enum usb_device_speed usb_speed, int video_form
     unsigned int bFormatIndex)
 {
     int i;
-    for (i = 0; i <= last_format_index; i++) {
-        if (uvc_frame_format[i].usb_speed == usb_speed &&
-            uvc_frame_format[i].video_format == video_format
+    for (i = 0; i <= pipeline->last_format_index; i++) {
+        if (pipeline->uvc_frame_format[i].usb_speed == usb_speed &&
+            pipeline->uvc_frame_format[i].video_format == video_format
         ) {
-            uvc_frame_format[i].bFormatIndex = bFormatIndex;
+            pipeline->uvc_frame_format[i].bFormatIndex = bFormatIndex;
         }
     }
 }
@@ -2052,28 +6557,28 @@ static void set_uvc_format_index(enum usb_device_speed usb_speed, int video_form
 static void set_uvc_format_value(const char * key_word, unsigned int index, int value)
 {
     if (!strncmp(key_word, "dwDefaultFrameInterval", 22)) {
-        uvc_frame_format[index].dwDefaultFrameInterval = value;
+        pipeline->uvc_frame_format[index].dwDefaultFrameInterval = value;
 
     } else if (!strncmp(key_word, "dwMaxVideoFrameBufferSize", 25)) {
-        uvc_frame_format[index].dwMaxVideoFrameBufferSize = value;
+        pipeline->uvc_frame_format[index].dwMaxVideoFrameBufferSize = value;
 
     } else if (!strncmp(key_word, "dwMaxBitRate", 12)) {
-        uvc_frame_format[index].dwMaxBitRate = value;
+        pipeline->uvc_frame_format[index].dwMaxBitRate = value;
 
     } else if (!strncmp(key_word, "dwMinBitRate", 12)) {
-        uvc_frame_format[index].dwMinBitRate = value;
+        pipeline->uvc_frame_format[index].dwMinBitRate = value;
 
     } else if (!strncmp(key_word, "wHeight", 7)) {
-        uvc_frame_format[index].wHeight = value;
+        pipeline->uvc_frame_format[index].wHeight = value;
 
     } else if (!strncmp(key_word, "wWidth", 6)) {
-        uvc_frame_format[index].wWidth = value;
+        pipeline->uvc_frame_format[index].wWidth = value;
 
     } else if (!strncmp(key_word, "bmCapabilities", 14)) {
-        uvc_frame_format[index].bmCapabilities = value;
+        pipeline->uvc_frame_format[index].bmCapabilities = value;
 
     } else if (!strncmp(key_word, "bFrameIndex", 11)) {
-        uvc_frame_format[index].bFrameIndex = value;
+        pipeline->uvc_frame_format[index].bFrameIndex = value;
 
     }
 }
@@ -2127,13 +6632,13 @@ static void configfs_fill_formats(const char * path, const char * part)
 
         usb_speed = configfs_usb_speed(array[0]);
         if (usb_speed == USB_SPEED_UNKNOWN) {
-            printf("CONFIGFS: Unsupported USB speed: (%s) %s\n", array[0], path);
+            log_warning("CONFIGFS: Unsupported USB speed: (%s) %s\n", array[0], path);
             goto free;
         }
 
         video_format = configfs_video_format(array[2]);
         if (video_format == 0) {
-            printf("CONFIGFS: Unsupported format: (%s) %s\n", array[2], path);
+            log_warning("CONFIGFS: Unsupported format: (%s) %s\n", array[2], path);
             goto free;
         }
 
@@ -2152,26 +6657,26 @@ static void configfs_fill_formats(const char * path, const char * part)
         }
 
         if (
-            uvc_frame_format[last_format_index].usb_speed != usb_speed ||
-            uvc_frame_format[last_format_index].video_format != video_format ||
-            strncmp(uvc_frame_format[last_format_index].format_name, format_name, strlen(format_name))
+            pipeline->uvc_frame_format[pipeline->last_format_index].usb_speed != usb_speed ||
+            pipeline->uvc_frame_format[pipeline->last_format_index].video_format != video_format ||
+            strncmp(pipeline->uvc_frame_format[pipeline->last_format_index].format_name, format_name, strlen(format_name))
         ) {
-            if (uvc_frame_format[last_format_index].defined) {
-                last_format_index++;
+            if (pipeline->uvc_frame_format[pipeline->last_format_index].defined) {
+                pipeline->last_format_index++;
                 
                 /* too much defined formats */
-                if (last_format_index > 29) {
+                if (pipeline->last_format_index >= UVC_FRAME_FORMAT_MAX) {
                     goto free;
                 }
             }
 
-            uvc_frame_format[last_format_index].usb_speed = usb_speed;
-            uvc_frame_format[last_format_index].video_format = video_format;
-            uvc_frame_format[last_format_index].format_name = strdup(format_name);
-            uvc_frame_format[last_format_index].defined = true;
+            pipeline->uvc_frame_format[pipeline->last_format_index].usb_speed = usb_speed;
+            pipeline->uvc_frame_format[pipeline->last_format_index].video_format = video_format;
+            pipeline->uvc_frame_format[pipeline->last_format_index].format_name = strdup(format_name);
+            pipeline->uvc_frame_format[pipeline->last_format_index].defined = true;
         }
 
-        set_uvc_format_value(array[index - 1], last_format_index, value);
+        set_uvc_format_value(array[index - 1], pipeline->last_format_index, value);
     }
 
 free:
@@ -2189,13 +6694,13 @@ static void configfs_fill_streaming_params(const char* path, const char * part)
      */
 
     if (!strncmp(part, "maxburst", 8)) {
-        streaming_maxburst = clamp(value, 0, 15);
+        pipeline->streaming_maxburst = clamp(value, 0, 15);
 
     } else if (!strncmp(part, "maxpacket", 9)) {
-        streaming_maxpacket = clamp(value, 1, 3072);
+        pipeline->streaming_maxpacket = clamp(value, 1, 3072);
 
     } else if (!strncmp(part, "interval", 8)) {
-        streaming_interval = clamp(value, 1, 16);
+        pipeline->streaming_interval = clamp(value, 1, 16);
 
     }
 }
@@ -2205,8 +6710,16 @@ static int configfs_path_check(const char* fpath, const struct stat * sb, int tf
     int uvc = find_text_pos(fpath, "/uvc");
     int streaming = find_text_pos(fpath, "streaming/class/");
     int streaming_params = find_text_pos(fpath, "/streaming_");
+    char function[64];
     (void)(tflag); /* avoid warning: unused parameter 'tflag' */
 
+    if (pipeline->settings.uvc_function) {
+        snprintf(function, sizeof(function), "/%s/", pipeline->settings.uvc_function);
+        if (!strstr(fpath, function)) {
+            return 0;
+        }
+    }
+
     if (!S_ISDIR(sb->st_mode)) {
         if (streaming && uvc) {
             configfs_fill_formats(fpath, fpath + streaming + 16);
@@ -2224,23 +6737,26 @@ static int configfs_get_uvc_settings()
     int i;
     const char * configfs_path = "/sys/kernel/config/usb_gadget";
 
-    printf("CONFIGFS: Initial path: %s\n", configfs_path);
+    log_info("CONFIGFS: Initial path: %s\n", configfs_path);
+    if (pipeline->settings.uvc_function) {
+        log_info("CONFIGFS: UVC function: %s\n", pipeline->settings.uvc_function);
+    }
 
     if(ftw(configfs_path, configfs_path_check, 20) == -1) {
         return -1;
     }
 
-    if (!uvc_frame_format[0].defined) {
+    if (!pipeline->uvc_frame_format[0].defined) {
         return -1;
     }
 
-    for (i = 0; i <= last_format_index; i++) {
-        uvc_dump_frame_format(&uvc_frame_format[i], "CONFIGFS: UVC");
+    for (i = 0; i <= pipeline->last_format_index; i++) {
+        uvc_dump_frame_format(LOG_LEVEL_INFO, &pipeline->uvc_frame_format[i], "CONFIGFS: UVC");
     }
 
-    printf("CONFIGFS: STREAMING maxburst:  %d\n", streaming_maxburst);
-    printf("CONFIGFS: STREAMING maxpacket: %d\n", streaming_maxpacket);
-    printf("CONFIGFS: STREAMING interval:  %d\n", streaming_interval);
+    log_info("CONFIGFS: STREAMING maxburst:  %d\n", pipeline->streaming_maxburst);
+    log_info("CONFIGFS: STREAMING maxpacket: %d\n", pipeline->streaming_maxpacket);
+    log_info("CONFIGFS: STREAMING interval:  %d\n", pipeline->streaming_interval);
 
     return 0;
 }
@@ -2249,80 +6765,187 @@ static void usage(const char * argv0)
 {
     fprintf(stderr, "Usage: %s [options]\n", argv0);
     fprintf(stderr, "Available options are\n");
+    fprintf(stderr, " -a cpus     CPU list for conversion and encoding threads (e.g. 1,2,3 or 1-3)\n");
     fprintf(stderr, " -b value    Blink X times on startup (b/w 1 and 20 with led0 or GPIO pin if defined)\n");
+    fprintf(stderr, " -c WxH+X+Y  Stream only this area of the framebuffer (e.g. 640x480+100+50)\n");
+    fprintf(stderr, " -d          Share V4L2 buffers with UVC device as DMABUF (zero-copy)\n");
+    fprintf(stderr, " -e          Repeat the last frame when the camera is slower than the host frame rate\n");
     fprintf(stderr, " -f device   Framebuffer device\n");
+    fprintf(stderr, " -g          Stream framebuffer as grayscale (luma only)\n");
     fprintf(stderr, " -h          Print this help screen and exit\n");
+    fprintf(stderr, " -i function Read UVC formats only from this configfs function (e.g. uvc.usb0)\n");
+    fprintf(stderr, " -j value    JPEG quality of MJPEG frames encoded from YUYV or framebuffer (b/w 1 and 100)\n");
+    fprintf(stderr, " -k value    Real-time priority of the streaming threads (b/w 1 and 99, SCHED_FIFO, rr:value for SCHED_RR)\n");
     fprintf(stderr, " -l          Use onboard led0 for streaming status indication\n");
+    fprintf(stderr, " -m          Lock memory and pre-fault frame buffers (no page faults while streaming)\n");
     fprintf(stderr, " -n value    Number of Video buffers (b/w 2 and 32)\n");
+    fprintf(stderr, " -o cpus     CPU list for the pipeline thread and its capture thread (e.g. 2 or 2-3)\n");
     fprintf(stderr, " -p value    GPIO pin number for streaming status indication\n");
+    fprintf(stderr, " -q value    Number of UVC Video buffers (b/w 2 and 32, defaults to -n value)\n");
     fprintf(stderr, " -r value    Framerate for framebuffer (b/w 1 and 30)\n");
-    fprintf(stderr, " -u device   UVC Video Output device\n");
+    fprintf(stderr, " -s          Send only the newest captured frame, drop stale ones (lowest latency)\n");
+    fprintf(stderr, " -t value    Number of conversion and encoding threads (b/w 1 and %d, defaults to CPU count)\n",
+        WORKER_POOL_MAX);
+    fprintf(stderr, " -u device   UVC Video Output device (repeat for up to %d devices fed by one camera)\n",
+        UVC_OUTPUT_MAX);
     fprintf(stderr, " -v device   V4L2 Video Capture device\n");
+    fprintf(stderr, " -w          Keep the camera capturing at a low rate between streams (warm standby)\n");
     fprintf(stderr, " -x          show fps information\n");
+    fprintf(stderr, " -L level    Log level: error, warning, info (default) or debug\n");
+    fprintf(stderr, " -S path     Unix socket serving pipeline statistics to every client\n");
+    fprintf(stderr, " -P          Start the options of another pipeline (up to %d pipelines)\n", PIPELINE_MAX);
 }
 
 static void show_settings()
 {
-    printf("SETTINGS: Number of buffers requested: %d\n", settings.nbufs);
-    printf("SETTINGS: Show FPS: %s\n", (settings.show_fps) ? "ENABLED" : "DISABLED");
-    if (settings.streaming_status_pin) {
-        printf("SETTINGS: GPIO pin for streaming status: %s\n", settings.streaming_status_pin);
+    unsigned int i;
+
+    log_info("SETTINGS: Pipeline: %d\n", pipeline->index);
+    log_info("SETTINGS: Pipeline CPUs: %s\n", (pipeline->settings.pipeline_cpus) ? pipeline->settings.pipeline_cpus : "any");
+    log_info("SETTINGS: UVC function: %s\n", (pipeline->settings.uvc_function) ? pipeline->settings.uvc_function : "any");
+    log_info("SETTINGS: Number of buffers requested: %d\n", pipeline->settings.nbufs);
+    log_info("SETTINGS: Number of UVC buffers requested: %d\n", pipeline->settings.uvc_nbufs);
+    log_info("SETTINGS: Show FPS: %s\n", (pipeline->settings.show_fps) ? "ENABLED" : "DISABLED");
+    log_info("SETTINGS: DMABUF zero-copy: %s\n", (pipeline->settings.dmabuf) ? "ENABLED" : "DISABLED");
+    log_info("SETTINGS: Latest frame only: %s\n", (pipeline->settings.latest_frame) ? "ENABLED" : "DISABLED");
+    log_info("SETTINGS: Frame repetition: %s\n", (pipeline->settings.frame_repeat) ? "ENABLED" : "DISABLED");
+    log_info("SETTINGS: Warm standby: %s\n", (pipeline->settings.standby) ? "ENABLED" : "DISABLED");
+    log_info("SETTINGS: Worker threads: %d\n", pipeline->settings.worker_threads);
+    log_info("SETTINGS: Worker CPUs: %s\n", (pipeline->settings.worker_cpus) ? pipeline->settings.worker_cpus : "any");
+    log_info("SETTINGS: JPEG quality: %d\n", pipeline->settings.jpeg_quality);
+    if (pipeline->settings.rt_priority) {
+        log_info("SETTINGS: Real-time priority: %s %d\n",
+            (pipeline->settings.rt_policy == SCHED_RR) ? "SCHED_RR" : "SCHED_FIFO", pipeline->settings.rt_priority);
     } else {
-        printf("SETTINGS: GPIO pin for streaming status: not set\n");
+        log_info("SETTINGS: Real-time priority: not set\n");
     }
-    printf("SETTINGS: Onboard led0 used for streaming status: %s\n",
-        (settings.streaming_status_onboard_enabled) ? "ENABLED" : "DISABLED"
+    log_info("SETTINGS: Memory locking: %s\n", (pipeline->settings.mlock) ? "ENABLED" : "DISABLED");
+    log_info("SETTINGS: Log level: %s\n", log_level_names[log_level]);
+    log_info("SETTINGS: Statistics socket: %s\n",
+        (pipeline->settings.stats_socket) ? pipeline->settings.stats_socket : "not set");
+    if (pipeline->settings.streaming_status_pin) {
+        log_info("SETTINGS: GPIO pin for streaming status: %s\n", pipeline->settings.streaming_status_pin);
+    } else {
+        log_info("SETTINGS: GPIO pin for streaming status: not set\n");
+    }
+    log_info("SETTINGS: Onboard led0 used for streaming status: %s\n",
+        (pipeline->settings.streaming_status_onboard_enabled) ? "ENABLED" : "DISABLED"
     );
-    printf("SETTINGS: Blink on startup: %d times\n", settings.blink_on_startup);
+    log_info("SETTINGS: Blink on startup: %d times\n", pipeline->settings.blink_on_startup);
 
-    printf("SETTINGS: UVC device name: %s\n", settings.uvc_devname);
-    if (settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
-        printf("SETTINGS: FB device name: %s\n", settings.fb_devname);
-        printf("SETTINGS: Framerate for frame buffer: %d\n", settings.fb_framerate);
+    for (i = 0; i < pipeline->settings.uvc_ndevs; i++) {
+        log_info("SETTINGS: UVC device name: %s\n", pipeline->settings.uvc_devnames[i]);
+    }
+    if (pipeline->settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
+        log_info("SETTINGS: FB device name: %s\n", pipeline->settings.fb_devname);
+        log_info("SETTINGS: Framerate for frame buffer: %d\n", pipeline->settings.fb_framerate);
+        log_info("SETTINGS: Grayscale: %s\n", (pipeline->settings.fb_grayscale) ? "ENABLED" : "DISABLED");
+        if (pipeline->settings.fb_crop_width) {
+            log_info("SETTINGS: Crop rectangle: %dx%d+%d+%d\n", pipeline->settings.fb_crop_width,
+                pipeline->settings.fb_crop_height, pipeline->settings.fb_crop_x, pipeline->settings.fb_crop_y);
+        } else {
+            log_info("SETTINGS: Crop rectangle: not set\n");
+        }
 
     } else {
-        printf("SETTINGS: V4L2 device name: %s\n", settings.v4l2_devname);
+        log_info("SETTINGS: V4L2 device name: %s\n", pipeline->settings.v4l2_devname);
     }
 }
 
-int main(int argc, char * argv[])
+/* ---------------------------------------------------------------------------
+ * Pipelines
+ */
+
+/* Parse the options of the current pipeline, then read its UVC formats from configfs */
+static int pipeline_setup(int argc, char * argv[])
 {
+    unsigned int i;
     int ret;
     int opt;
 
-    struct sigaction action;
-    CLEAR(action);
-    action.sa_handler = term;
-    sigaction(SIGTERM, &action, NULL);
-    sigaction(SIGINT, &action, NULL);
-
-    ret = configfs_get_uvc_settings();
-    if (ret < 0) {
-        printf("ERROR: configfs settings for uvc gadget not found!\n");
-        return 1;
-    }
+    /* Restart the scan, every pipeline has its own slice of argv. */
+    optind = 0;
 
-    while ((opt = getopt(argc, argv, "hlb:f:n:p:r:u:v:x")) != -1) {
+    while ((opt = getopt(argc, argv, "deghlmswa:b:c:f:i:j:k:n:o:p:q:r:t:u:v:xL:S:")) != -1) {
         switch (opt) {
+        case 'a':
+            pipeline->settings.worker_cpus = optarg;
+            break;
+
         case 'b':
             if (atoi(optarg) < 1 || atoi(optarg) > 20) {
                 fprintf(stderr, "ERROR: Blink x times on startup\n");
                 goto err;
             }
-            settings.blink_on_startup = atoi(optarg);
+            pipeline->settings.blink_on_startup = atoi(optarg);
+            break;
+
+        case 'c':
+            pipeline->settings.fb_crop_x = 0;
+            pipeline->settings.fb_crop_y = 0;
+            if (sscanf(optarg, "%ux%u+%u+%u", &pipeline->settings.fb_crop_width, &pipeline->settings.fb_crop_height,
+                    &pipeline->settings.fb_crop_x, &pipeline->settings.fb_crop_y) < 2 ||
+                pipeline->settings.fb_crop_width < 2 || pipeline->settings.fb_crop_height < 1 || pipeline->settings.fb_crop_width & 1
+            ) {
+                fprintf(stderr, "ERROR: Crop rectangle must be WxH+X+Y with even width\n");
+                goto err;
+            }
+            break;
+
+        case 'd':
+            pipeline->settings.dmabuf = true;
+            break;
+
+        case 'e':
+            pipeline->settings.frame_repeat = true;
             break;
 
         case 'f':
-            settings.fb_devname = optarg;
-            settings.source_device = DEVICE_TYPE_FRAMEBUFFER;
+            pipeline->settings.fb_devname = optarg;
+            pipeline->settings.source_device = DEVICE_TYPE_FRAMEBUFFER;
+            break;
+
+        case 'g':
+            pipeline->settings.fb_grayscale = true;
             break;
 
         case 'h':
             usage(argv[0]);
-            return 1;
+            return -1;
+
+        case 'i':
+            pipeline->settings.uvc_function = optarg;
+            break;
+
+        case 'j':
+            if (atoi(optarg) < 1 || atoi(optarg) > 100) {
+                fprintf(stderr, "ERROR: JPEG quality value out of range\n");
+                goto err;
+            }
+            pipeline->settings.jpeg_quality = atoi(optarg);
+            break;
+
+        case 'k':
+            pipeline->settings.rt_policy = SCHED_FIFO;
+            if (!strncmp(optarg, "rr:", 3)) {
+                pipeline->settings.rt_policy = SCHED_RR;
+                optarg += 3;
+            } else if (!strncmp(optarg, "fifo:", 5)) {
+                optarg += 5;
+            }
+            if (atoi(optarg) < 1 || atoi(optarg) > 99) {
+                fprintf(stderr, "ERROR: Real-time priority value out of range\n");
+                goto err;
+            }
+            pipeline->settings.rt_priority = atoi(optarg);
+            break;
 
         case 'l':
-            settings.streaming_status_onboard = true;
+            pipeline->settings.streaming_status_onboard = true;
+            break;
+
+        case 'm':
+            pipeline->settings.mlock = true;
             break;
 
         case 'n':
@@ -2330,11 +6953,23 @@ int main(int argc, char * argv[])
                 fprintf(stderr, "ERROR: Number of Video buffers value out of range\n");
                 goto err;
             }
-            settings.nbufs = atoi(optarg);
+            pipeline->settings.nbufs = atoi(optarg);
+            break;
+
+        case 'o':
+            pipeline->settings.pipeline_cpus = optarg;
             break;
 
         case 'p':
-            settings.streaming_status_pin = optarg;
+            pipeline->settings.streaming_status_pin = optarg;
+            break;
+
+        case 'q':
+            if (atoi(optarg) < 2 || atoi(optarg) > 32) {
+                fprintf(stderr, "ERROR: Number of UVC Video buffers value out of range\n");
+                goto err;
+            }
+            pipeline->settings.uvc_nbufs = atoi(optarg);
             break;
 
         case 'r':
@@ -2342,31 +6977,271 @@ int main(int argc, char * argv[])
                 fprintf(stderr, "ERROR: Framerate value out of range\n");
                 goto err;
             }
-            settings.fb_framerate = atoi(optarg);
+            pipeline->settings.fb_framerate = atoi(optarg);
+            break;
+
+        case 's':
+            pipeline->settings.latest_frame = true;
+            break;
+
+        case 't':
+            if (atoi(optarg) < 1 || atoi(optarg) > WORKER_POOL_MAX) {
+                fprintf(stderr, "ERROR: Number of worker threads value out of range\n");
+                goto err;
+            }
+            pipeline->settings.worker_threads = atoi(optarg);
             break;
 
         case 'u':
-            settings.uvc_devname = optarg;
+            if (pipeline->settings.uvc_ndevs == UVC_OUTPUT_MAX) {
+                fprintf(stderr, "ERROR: Too many UVC devices (max %d)\n", UVC_OUTPUT_MAX);
+                goto err;
+            }
+            pipeline->settings.uvc_devnames[pipeline->settings.uvc_ndevs++] = optarg;
             break;
 
         case 'v':
-            settings.v4l2_devname = optarg;
+            pipeline->settings.v4l2_devname = optarg;
+            break;
+
+        case 'w':
+            pipeline->settings.standby = true;
             break;
 
         case 'x':
-            settings.show_fps = true;
+            pipeline->settings.show_fps = true;
+            break;
+
+        case 'L':
+            for (i = 0; i < ARRAY_SIZE(log_level_names); i++) {
+                if (!strcmp(optarg, log_level_names[i])) {
+                    break;
+                }
+            }
+            if (i == ARRAY_SIZE(log_level_names)) {
+                fprintf(stderr, "ERROR: Log level must be error, warning, info or debug\n");
+                goto err;
+            }
+            /* There is one log for the whole process. */
+            log_level = i;
+            break;
+
+        case 'S':
+            /* The socket of each pipeline replaces a stale one at its path, the paths must differ. */
+            for (i = 0; i < pipeline->index; i++) {
+                if (pipelines[i]->settings.stats_socket && !strcmp(pipelines[i]->settings.stats_socket, optarg)) {
+                    fprintf(stderr, "ERROR: Statistics socket %s is already used by pipeline %u\n", optarg, i);
+                    goto err;
+                }
+            }
+            pipeline->settings.stats_socket = optarg;
             break;
 
         default:
-            printf("ERROR: Invalid option '-%c'\n", opt);
+            log_error("ERROR: Invalid option '-%c'\n", opt);
             goto err;
         }
     }
 
+    if (!pipeline->settings.uvc_nbufs) {
+        pipeline->settings.uvc_nbufs = pipeline->settings.nbufs;
+    }
+
+    if (pipeline->settings.frame_repeat && pipeline->settings.source_device == DEVICE_TYPE_V4L2) {
+        pipeline->settings.nbufs = max(pipeline->settings.nbufs, FRAME_REPEAT_MIN_BUFS);
+        pipeline->settings.uvc_nbufs = max(pipeline->settings.uvc_nbufs, FRAME_REPEAT_MIN_BUFS);
+    }
+
+    if (!pipeline->settings.uvc_ndevs) {
+        pipeline->settings.uvc_ndevs = 1;
+
+    } else if (pipeline->settings.uvc_ndevs > 1 && pipeline->settings.source_device != DEVICE_TYPE_V4L2) {
+        fprintf(stderr, "ERROR: Several UVC devices can only be fed from a V4L2 device\n");
+        goto err;
+    }
+
+    if (!pipeline->settings.worker_threads) {
+        pipeline->settings.worker_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (pipeline->settings.worker_threads < 1) {
+            pipeline->settings.worker_threads = 1;
+        } else if (pipeline->settings.worker_threads > WORKER_POOL_MAX) {
+            pipeline->settings.worker_threads = WORKER_POOL_MAX;
+        }
+    }
+
+    ret = configfs_get_uvc_settings();
+    if (ret < 0) {
+        log_error("ERROR: configfs settings for uvc gadget not found!\n");
+        return -1;
+    }
+
     show_settings();
-    return init();
+    return 0;
 
 err:
     usage(argv[0]);
+    return -1;
+}
+
+static struct pipeline * pipeline_create()
+{
+    struct pipeline * new;
+
+    if (npipelines == PIPELINE_MAX) {
+        fprintf(stderr, "ERROR: Too many pipelines (max %d)\n", PIPELINE_MAX);
+        return NULL;
+    }
+
+    new = calloc(1, sizeof(*new));
+    if (!new) {
+        log_error("PIPELINE: Unable to allocate pipeline: %s (%d).\n", strerror(errno), errno);
+        return NULL;
+    }
+
+    new->index = npipelines;
+    new->terminate_fd = -1;
+    new->settings = settings_defaults;
+    new->streaming_maxpacket = 1023;
+    new->streaming_interval = 1;
+
+    pipelines[npipelines++] = new;
+    return new;
+}
+
+/*
+ * Lock the process memory and raise the pipeline thread to a real-time
+ * policy. The capture thread and the frame stage started from this thread
+ * later take the same policy, see thread_attr_init().
+ */
+static void pipeline_realtime_setup()
+{
+    struct sched_param param;
+    int flags = MCL_CURRENT | MCL_FUTURE;
+    int ret;
+
+    if (pipeline->settings.mlock) {
+#ifdef MCL_ONFAULT
+        /* Thread stacks are locked as they grow, frame buffers are pre-faulted. */
+        flags |= MCL_ONFAULT;
+#endif
+        if (mlockall(flags) < 0) {
+            log_error("PIPELINE %d: Unable to lock memory: %s (%d).\n", pipeline->index, strerror(errno), errno);
+        } else {
+            log_info("PIPELINE %d: Memory locked\n", pipeline->index);
+        }
+    }
+
+    if (pipeline->settings.rt_priority) {
+        CLEAR(param);
+        param.sched_priority = pipeline->settings.rt_priority;
+
+        ret = pthread_setschedparam(pthread_self(), pipeline->settings.rt_policy, &param);
+        if (ret != 0) {
+            log_error("PIPELINE %d: Unable to set real-time priority: %s (%d).\n", pipeline->index, strerror(ret), ret);
+        } else {
+            log_info("PIPELINE %d: Real-time priority %d\n", pipeline->index, pipeline->settings.rt_priority);
+        }
+    }
+}
+
+static void * pipeline_thread_main(void * arg)
+{
+    pipeline = arg;
+    pipeline_realtime_setup();
+    init();
+    return NULL;
+}
+
+/* Start the pipeline thread, pinned to the CPUs given with -o */
+static int pipeline_start(struct pipeline * pipe)
+{
+    int cpus[CPU_SETSIZE];
+    int ncpus;
+    cpu_set_t cpuset;
+    pthread_attr_t attr;
+    int i;
+    int ret;
+
+    pthread_attr_init(&attr);
+
+    if (pipe->settings.pipeline_cpus) {
+        ncpus = worker_parse_cpus(pipe->settings.pipeline_cpus, cpus, CPU_SETSIZE);
+        if (ncpus <= 0) {
+            log_error("PIPELINE %d: Invalid CPU list: %s\n", pipe->index, pipe->settings.pipeline_cpus);
+            pthread_attr_destroy(&attr);
+            return -EINVAL;
+        }
+
+        CPU_ZERO(&cpuset);
+        for (i = 0; i < ncpus; i++) {
+            CPU_SET(cpus[i], &cpuset);
+        }
+        /* Capture and worker threads inherit this mask unless -a is given. */
+        pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+    }
+
+    ret = pthread_create(&pipe->thread, &attr, pipeline_thread_main, pipe);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        log_error("PIPELINE %d: Unable to start pipeline thread: %s (%d).\n", pipe->index, strerror(ret), ret);
+        return -ret;
+    }
+
+    log_info("PIPELINE %d: Started\n", pipe->index);
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+    unsigned int started = 0;
+    unsigned int i;
+    int start = 1;
+    int end;
+
+    struct sigaction action;
+    CLEAR(action);
+    action.sa_handler = term;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    /* Every -P starts the options of the next pipeline. */
+    for (end = 1; end <= argc; end++) {
+        if (end < argc && strcmp(argv[end], "-P")) {
+            continue;
+        }
+
+        pipeline = pipeline_create();
+        if (!pipeline) {
+            return 1;
+        }
+
+        /* The pipeline sees its own options after the program name. */
+        argv[start - 1] = argv[0];
+        if (pipeline_setup(end - start + 1, &argv[start - 1]) < 0) {
+            return 1;
+        }
+        start = end + 1;
+    }
+    pipeline = NULL;
+
+    /* From here on messages are written by the logging thread. */
+    log_start();
+
+    for (i = 0; i < npipelines; i++) {
+        if (pipeline_start(pipelines[i]) < 0) {
+            term(0);
+            break;
+        }
+        started++;
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(pipelines[i]->thread, NULL);
+    }
+    log_stop();
+
+    for (i = 0; i < npipelines; i++) {
+        free(pipelines[i]);
+    }
     return 1;
 }
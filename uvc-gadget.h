@@ -16,6 +16,7 @@
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 #define max(a, b) (((a) > (b)) ? (a) : (b))
+#define min(a, b) (((a) < (b)) ? (a) : (b))
 
 #define clamp(val, min, max)                        \
     ({                                              \
@@ -31,6 +32,99 @@
 #define ARRAY_SIZE(a) ((sizeof(a) / sizeof(a[0])))
 #define pixfmtstr(x) (x) & 0xff, ((x) >> 8) & 0xff, ((x) >> 16) & 0xff, ((x) >> 24) & 0xff
 
+/* ---------------------------------------------------------------------------
+ * Logging
+ */
+
+enum log_level {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+};
+
+/* Messages above this level are compiled out, e.g. make LOG_LEVEL_MAX=2 */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_LEVEL_DEBUG
+#endif
+
+/* The arguments are only evaluated when the message is logged. */
+#define log_print(level, ...)                                                   \
+    do {                                                                        \
+        if ((level) <= LOG_LEVEL_MAX && (level) <= log_level) {                 \
+            log_write(__VA_ARGS__);                                             \
+        }                                                                       \
+    } while (0)
+
+#define log_error(...)      log_print(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warning(...)    log_print(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_info(...)       log_print(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...)      log_print(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#define LOG_RING_SIZE 256       /* records, a power of two */
+#define LOG_RECORD_SIZE 240     /* longer messages are cut */
+#define LOG_ARGS_MAX 16         /* messages with more arguments are formatted by the caller */
+#define LOG_SPEC_MAX 32         /* longest conversion specification, e.g. %-08llu */
+#define LOG_BATCH_SIZE 8192     /* bytes written to stdout at once */
+#define LOG_THREAD_NICE 10
+
+/* Length modifier of a conversion, tells which type the argument was passed as */
+enum log_arg_size {
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_SIZE,
+    LOG_ARG_INTMAX,
+    LOG_ARG_PTRDIFF,
+};
+
+/* One argument of a message, strings are copied into the record text */
+union log_arg {
+    long long i;
+    unsigned long long u;
+    double d;
+    const void * p;
+    unsigned int offset;
+};
+
+/*
+ * One message, the sequence tells producers and the drain thread who owns
+ * it. The caller stores the format and its arguments and the drain thread
+ * formats them, text holds the copied strings. Without a format the caller
+ * formatted the message into text.
+ */
+struct log_record {
+    atomic_uint sequence;
+    const char * format;
+    union log_arg args[LOG_ARGS_MAX];
+    unsigned int length;
+    char text[LOG_RECORD_SIZE];
+};
+
+/*
+ * Bounded lock-free ring of log records. Any thread claims a record with
+ * a compare-and-swap on head and never waits, a full ring drops the
+ * message. A low priority thread writes the records to stdout in batches
+ * and sleeps on an eventfd while the ring is empty.
+ */
+struct logger {
+    struct log_record records[LOG_RING_SIZE];
+    atomic_uint head;
+    unsigned int tail;
+    atomic_uint dropped;
+    atomic_uint writers;        /* producers between the running check and publishing */
+    atomic_bool sleeping;       /* the drain thread waits, the next record wakes it */
+    atomic_bool running;
+    atomic_bool stop;
+    int wakeup_fd;
+    pthread_t thread;
+};
+
+static const char * const log_level_names[] = { "error", "warning", "info", "debug" };
+
+static struct logger logger;
+static enum log_level log_level = LOG_LEVEL_INFO;
+
 enum gpio {
     GPIO_EXPORT = 0,
     GPIO_DIRECTION,
@@ -111,6 +205,16 @@ struct buffer {
     struct v4l2_buffer buf;
     void * start;
     size_t length;
+    int dmabuf_fd;
+
+    /*
+     * Framebuffer tile hashes this buffer was last filled from. The YUYV
+     * staging frame counts its changes, an encoded buffer remembers the
+     * count it was encoded from.
+     */
+    uint64_t generation;
+    uint64_t * tile_hash;
+    bool tile_hash_valid;
 };
 
 /* ---------------------------------------------------------------------------
@@ -138,9 +242,7 @@ struct uvc_frame_format {
     unsigned int dwFrameInterval;
 };
 
-int last_format_index = 0;
-
-struct uvc_frame_format uvc_frame_format[30];
+#define UVC_FRAME_FORMAT_MAX 30
 
 enum uvc_frame_format_getter {
     FORMAT_INDEX_MIN,
@@ -149,15 +251,50 @@ enum uvc_frame_format_getter {
     FRAME_INDEX_MAX,
 };
 
-unsigned int streaming_maxburst = 0;
-unsigned int streaming_maxpacket = 1023;
-unsigned int streaming_interval = 1;
+/* ---------------------------------------------------------------------------
+ * Event loop
+ */
+
+#define EVENT_LOOP_MAX_EVENTS 8
+
+struct event_source;
+struct pipeline;
+
+typedef void (*event_handler)(struct event_source * source, uint32_t events);
+
+/* File descriptor (device, timerfd or eventfd) watched by the event loop */
+struct event_source {
+    const char * name;
+    int fd;
+    uint32_t events;
+    bool registered;
+    event_handler handler;
+    void * data;
+};
+
+/* epoll based reactor, woken up through eventfd from other contexts */
+struct event_loop {
+    int epoll_fd;
+    atomic_bool stop;
+    struct event_source wakeup;
+};
 
 /* ---------------------------------------------------------------------------
- * V4L2 and UVC device instances
+ * Capture / output thread handoff
  */
 
-bool uvc_shutdown_requested = false;
+#define BUFFER_RING_SIZE 64
+
+/* Single-producer/single-consumer lock-free ring of buffer indices */
+struct buffer_ring {
+    atomic_uint head __attribute__((aligned(64)));
+    atomic_uint tail __attribute__((aligned(64)));
+    unsigned int slots[BUFFER_RING_SIZE];
+};
+
+/* ---------------------------------------------------------------------------
+ * V4L2 and UVC device instances
+ */
 
 /* device type */
 enum device_type {
@@ -175,12 +312,22 @@ struct v4l2_device {
     int fd;
     int is_streaming;
 
+    /* current format */
+    struct v4l2_pix_format pix;
+
     /* v4l2 buffer specific */
     struct buffer * mem;
     unsigned int nbufs;
     unsigned int buffer_type;
     unsigned int memory_type;
 
+    /* capture buffers stay mapped across streaming sessions until the format changes */
+    bool bufs_cached;
+
+    /* uvc output number and time of its last STREAMON */
+    unsigned int index;
+    uint64_t streamon_time;
+
     /* v4l2 buffer queue and dequeue counters */
     unsigned long long int qbuf_count;
     unsigned long long int dqbuf_count;
@@ -206,65 +353,358 @@ struct v4l2_device {
     unsigned int fb_height;
     unsigned int fb_bpp;
     unsigned int fb_line_length;
+    unsigned int fb_xres;
+    unsigned int fb_yres;
+    unsigned int fb_xoffset;
+    unsigned int fb_yoffset;
+    unsigned int fb_crop_x;
+    unsigned int fb_crop_y;
     void * fb_memory;
+    unsigned int fb_tiles_x;
+    unsigned int fb_tiles_y;
+    atomic_uint fb_tiles_converted;
+    struct buffer fb_yuyv;
 
-    double last_time_video_process;
     int buffers_processed;
 };
 
-static struct v4l2_device v4l2_dev;
-static struct v4l2_device uvc_dev;
-static struct v4l2_device fb_dev;
+#define UVC_OUTPUT_MAX 4
+
+/* The first UVC output of the current pipeline, the only one in framebuffer mode */
+#define uvc_dev (pipeline->uvc_devs[0])
 
 struct uvc_settings {
-    char * uvc_devname;
+    char * uvc_devnames[UVC_OUTPUT_MAX];
+    unsigned int uvc_ndevs;
     char * v4l2_devname;
     char * fb_devname;
     enum device_type source_device;
     unsigned int nbufs;
+    unsigned int uvc_nbufs;
+    bool dmabuf;
+    bool latest_frame;
+    bool frame_repeat;
+    bool standby;
     bool show_fps;
     bool fb_grayscale;
     unsigned int fb_framerate;
+    unsigned int worker_threads;
+    char * worker_cpus;
+    unsigned int jpeg_quality;
+    unsigned int fb_crop_width;
+    unsigned int fb_crop_height;
+    unsigned int fb_crop_x;
+    unsigned int fb_crop_y;
     bool streaming_status_onboard;
     bool streaming_status_onboard_enabled;
     char * streaming_status_pin;
     bool streaming_status_enabled;
     unsigned int blink_on_startup;
+    char * pipeline_cpus;
+    char * uvc_function;
+    int rt_policy;
+    unsigned int rt_priority;
+    bool mlock;
+    char * stats_socket;
 };
 
-struct uvc_settings settings = {
-    .uvc_devname = "/dev/video1",
+static const struct uvc_settings settings_defaults = {
+    .uvc_devnames = { "/dev/video1" },
+    .uvc_ndevs = 0,
     .v4l2_devname = "/dev/video0",
     .source_device = DEVICE_TYPE_V4L2,
     .nbufs = 2,
+    .uvc_nbufs = 0,
+    .dmabuf = false,
+    .latest_frame = false,
+    .frame_repeat = false,
+    .standby = false,
     .fb_framerate = 25,
     .fb_grayscale = false,
+    .worker_threads = 0,
+    .jpeg_quality = 80,
     .show_fps = false,
     .streaming_status_onboard = false,
     .streaming_status_onboard_enabled = false,
     .streaming_status_enabled = false,
-    .blink_on_startup = 0
+    .blink_on_startup = 0,
+    .rt_policy = SCHED_FIFO,
+    .rt_priority = 0,
+    .mlock = false
+};
+
+#define DEADLINE_LOG_MAX 10
+
+/* Event sources of the processing loop, shared by V4L2 and FB source modes */
+struct processing {
+    struct event_loop loop;
+    struct event_source uvc[UVC_OUTPUT_MAX];
+    struct event_source fps_timer;
+    struct event_source blink_timer;
+    struct event_source fb_timer;
+    struct event_source watchdog_timer;
+    struct event_source repeat_timer;
+    struct event_source controls;
+    uint64_t fb_interval;
+    uint64_t frame_interval;
+    bool capture_streaming;
+    bool output_streaming;
+    bool fb_frame_due;
+    bool blink_state;
+    bool standby;
+
+    /* missed streaming deadlines, logged at most DEADLINE_LOG_MAX times per second */
+    uint64_t deadline_window;
+    unsigned int deadline_logged;
+    unsigned int deadline_suppressed;
+    unsigned int deadline_misses;
 };
 
+/* Capture rate of the warm standby mode, in 100 ns units (5 fps) */
+#define STANDBY_FRAME_INTERVAL 2000000
+
+/* Capture thread, owns the V4L2 capture device between STREAMON and STREAMOFF */
+struct capture {
+    pthread_t thread;
+    bool running;
+    atomic_bool failed;         /* the capture queue reported an error, the thread has stopped */
+    struct event_loop loop;
+    struct event_source v4l2;
+    struct buffer_ring ready;   /* capture -> output: filled capture buffers */
+    struct buffer_ring release; /* output -> capture: buffers to requeue */
+};
+
+/* ---------------------------------------------------------------------------
+ * Buffer pool
+ */
+
+#define BUFFER_POOL_SIZE 32
+
+/* map value of a UVC slot in flight that no longer holds a capture buffer */
+#define BUFFER_POOL_DETACHED -2
+
+/* -e holds the newest frame in a capture buffer and a UVC slot, two more keep streaming */
+#define FRAME_REPEAT_MIN_BUFS 3
+
+/* Ownership of a capture buffer */
+enum buffer_state {
+    BUFFER_STATE_FREE,      /* owned by nobody, on its way back to the camera */
+    BUFFER_STATE_CAPTURE,   /* queued on the capture device */
+    BUFFER_STATE_READY,     /* filled, waiting for a free UVC slot */
+    BUFFER_STATE_UVC,       /* in flight to USB */
+};
+
+#define BUFFER_STATE_BIT(state) (1U << (state))
+
+static const char * const buffer_state_names[] = { "free", "capture", "ready", "uvc" };
+
+/*
+ * Buffer slots of one UVC output. The mapping table tells which capture
+ * buffer each slot currently holds.
+ */
+struct uvc_slots {
+    unsigned int nbufs;         /* 0 while the output is not streaming */
+    int map[BUFFER_POOL_SIZE];
+    int last[BUFFER_POOL_SIZE];
+
+    /* capture, pickup and queue times of the frame in flight on each slot, in ns */
+    uint64_t timestamp[BUFFER_POOL_SIZE];
+    uint64_t dequeued[BUFFER_POOL_SIZE];
+    uint64_t queued[BUFFER_POOL_SIZE];
+
+    /*
+     * Frame repetition: a slot stays mapped while referenced by the UVC
+     * queue or by the repeat hold on the newest completed frame.
+     */
+    struct v4l2_buffer buf[BUFFER_POOL_SIZE];
+    unsigned int refs[BUFFER_POOL_SIZE];
+    unsigned long long frame[BUFFER_POOL_SIZE];
+    bool repeated[BUFFER_POOL_SIZE];
+    int repeat_slot;
+};
+
+/*
+ * Capture buffers and UVC buffer slots are allocated independently. A
+ * capture buffer can be queued to every streaming UVC output at once and
+ * goes back to the camera when the last of them releases it.
+ */
+struct buffer_pool {
+    unsigned int capture_nbufs;
+    enum buffer_state state[BUFFER_POOL_SIZE];
+    unsigned int capture_refs[BUFFER_POOL_SIZE];
+    uint64_t dequeued[BUFFER_POOL_SIZE];    /* monotonic time the capture thread got each buffer */
+    unsigned int pending[BUFFER_POOL_SIZE];
+    unsigned int npending;
+
+    struct uvc_slots uvc[UVC_OUTPUT_MAX];
+    unsigned long long frame_sequence;
+};
+
+/* Latency histogram buckets are powers of two from 64 us up to 2 s */
+#define STATS_BUCKETS 16
+#define STATS_BUCKET_SHIFT 6
+#define STATS_SNAPSHOT_SIZE 4096
+#define STATS_SOCKET_BACKLOG 4
+
+/* Stages of a frame, each one measured on its own histogram */
+enum stats_stage {
+    STATS_STAGE_CAPTURE,        /* capture timestamp to dequeue by the capture thread */
+    STATS_STAGE_PROCESS,        /* dequeue to UVC queue, waiting and conversion */
+    STATS_STAGE_TRANSFER,       /* UVC queue to completion */
+    STATS_STAGE_TOTAL,          /* capture timestamp to completion */
+    STATS_STAGES,
+};
+
+static const char * const stats_stage_names[STATS_STAGES] = {
+    "capture", "process", "transfer", "total",
+};
+
+struct stats_histogram {
+    uint64_t frames;
+    uint64_t total;
+    uint64_t max;
+    uint64_t window_max;        /* since the last FPS output */
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+struct stats_output {
+    uint64_t frames;
+    uint64_t repeated;
+    uint64_t skipped;           /* frames this output was too busy to take */
+    uint64_t bytes;
+    unsigned int queued_max;
+
+    /* completions of the last full second */
+    uint64_t window_start;
+    uint64_t window_frames;
+    uint64_t window_bytes;
+    uint64_t frame_rate;
+    uint64_t byte_rate;
+};
+
+/* Counters at the last FPS output, -x shows what changed since */
+struct stats_mark {
+    uint64_t frames_captured;
+    uint64_t frames_repeated;
+    uint64_t stale_dropped;
+    uint64_t identical_skipped;
+    uint64_t latency_frames;
+    uint64_t latency_total;
+};
+
+/*
+ * Pipeline telemetry, only touched by the pipeline thread. A client
+ * connecting to the stats socket gets a text snapshot of it, and -x
+ * prints it every second.
+ */
+struct stats {
+    struct event_source socket;
+    bool bound;                 /* the socket file at -S was created by this pipeline */
+    uint64_t started;
+    uint64_t frames_captured;
+    uint64_t stale_dropped;
+    uint64_t identical_skipped; /* framebuffer frames queued again as they were */
+    unsigned int pending_max;
+    struct stats_histogram latency[STATS_STAGES];
+    struct stats_output outputs[UVC_OUTPUT_MAX];
+    struct stats_mark fps_mark;
+};
+
+/*
+ * Row converters from the framebuffer layout to YUYV, selected once at
+ * startup from the best instruction set the CPU supports.
+ */
+typedef void (*rgb2yuyv_kernel)(const uint8_t * src, uint8_t * dst, unsigned int pairs);
+
+struct rgb2yuyv_kernels {
+    const char * name;
+    rgb2yuyv_kernel bpp16;
+    rgb2yuyv_kernel bpp24;
+    rgb2yuyv_kernel bpp32;
+};
+
+/* Damage tracking granularity for the framebuffer source, in pixels */
+#define FB_TILE_WIDTH 64
+#define FB_TILE_HEIGHT 16
+
+#define WORKER_POOL_MAX 8
+
+typedef void (*worker_job)(unsigned int part, unsigned int nparts, void * data);
+
+/*
+ * Persistent helper threads splitting one job into parts. The calling
+ * thread always runs part 0, so a pool of N parts has N - 1 threads.
+ */
+struct worker_pool;
+
+struct worker_thread {
+    pthread_t thread;
+    struct worker_pool * pool;
+    unsigned int part;
+};
+
+struct worker_pool {
+    struct pipeline * pipeline;
+    struct worker_thread threads[WORKER_POOL_MAX];
+    unsigned int nparts;
+    unsigned int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned int generation;
+    unsigned int remaining;
+    bool stop;
+    worker_job job;
+    void * data;
+};
+
+typedef void (*frame_stage_job)(void * data);
+
+/*
+ * Scaling, encoding and framebuffer conversion run on this thread, one
+ * frame at a time, so the worker pool never blocks the pipeline thread.
+ * The pipeline thread is woken up to queue the finished payload.
+ */
+struct frame_stage {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    bool running;
+    bool stop;
+    frame_stage_job job;        /* set until the job finished */
+    bool done;                  /* finished, the result is not collected yet */
+    bool busy;                  /* pipeline thread only: submitted and not collected */
+
+    /* V4L2 source: one capture buffer converted into a slot of every output, -1 for none */
+    unsigned int index;
+    int slot[UVC_OUTPUT_MAX];
+    int size[UVC_OUTPUT_MAX];
+    unsigned int busy_outputs;
+
+    /* framebuffer source: the UVC buffer being filled, when its fill started and whether it was identical */
+    struct v4l2_buffer ubuf;
+    uint64_t start;
+    bool identical;
+};
+
+/* One framebuffer frame converted by the worker pool */
+struct fb_fill_job {
+    struct buffer * ubuf;
+    const uint8_t * origin;
+    unsigned int part_converted[WORKER_POOL_MAX];
+};
+
+/* UVC control of a camera unit and the V4L2 control it maps to */
 struct control_mapping_pair {
     unsigned int type;
     unsigned int uvc;
     const char * uvc_name;
     unsigned int v4l2;
     const char * v4l2_name;
-    bool enabled;
-    unsigned int control_type;
-    unsigned int value;
-    unsigned int length;
-    unsigned int minimum;
-    unsigned int maximum;
-    unsigned int step;
-    unsigned int default_value;
-    int v4l2_minimum;
-    int v4l2_maximum;
 };
 
-struct control_mapping_pair control_mapping[] = {
+static const struct control_mapping_pair control_mapping[] = {
 	{
         .type = UVC_VC_PROCESSING_UNIT,
 		.uvc = UVC_PU_BACKLIGHT_COMPENSATION_CONTROL,
@@ -484,7 +924,55 @@ struct control_mapping_pair control_mapping[] = {
 	}
 };
 
-int control_mapping_size = sizeof(control_mapping) / sizeof(* control_mapping);
+int control_mapping_size = ARRAY_SIZE(control_mapping);
+
+/*
+ * Camera state of a mapped control in UVC units, indexed like
+ * control_mapping[]. The names stay in the shared table, so a control
+ * request only reads one small entry. Filled by v4l2_get_controls() and
+ * kept current by V4L2_EVENT_CTRL, setting a control needs no query.
+ */
+struct control_state {
+    bool enabled;
+    bool secondary;                 /* V4L2_CID_BLUE_BALANCE is set with V4L2_CID_RED_BALANCE */
+    unsigned int flags;
+    unsigned int secondary_flags;
+    unsigned int control_type;
+    unsigned int value;
+    unsigned int length;
+    unsigned int minimum;
+    unsigned int maximum;
+    unsigned int step;
+    unsigned int default_value;
+    int v4l2_minimum;
+    int v4l2_maximum;
+};
+
+/* Controls are looked up directly by UVC unit type and control selector */
+#define CONTROL_UNIT_TYPES 8
+#define CONTROL_SELECTORS 32
+
+/* every mapped control, and the blue balance that follows the red one */
+#define CONTROL_BATCH_MAX (ARRAY_SIZE(control_mapping) + 1)
+
+/*
+ * Control values set by the host, applied to the camera by a background
+ * thread. Only the last value of each control is kept, the values queued
+ * while a batch is applied go out together in the next one.
+ */
+struct control_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool running;
+    bool stop;
+    bool pending[ARRAY_SIZE(control_mapping)];
+    bool secondary[ARRAY_SIZE(control_mapping)];
+    int v4l2_value[ARRAY_SIZE(control_mapping)];
+    unsigned int uvc_value[ARRAY_SIZE(control_mapping)];
+    unsigned int npending;
+    unsigned int coalesced;
+};
 
 /*
  * RGB to YUYV conversion 
@@ -596,3 +1084,228 @@ unsigned int mult_18[256] = {128, 146, 164, 182, 200, 218, 236, 254, 272, 290, 3
         ((uint8_t)((r2 >> 2) + (g2 >> 1) + (b2 >> 3) + 16) << 16) +                      \
         ((uint8_t)(((-mult_38[r12] - mult_74[g12] + mult_112[b12]) >> 8) + 128) << 24);  \
     })
+
+/* ---------------------------------------------------------------------------
+ * JPEG encoder
+ */
+
+#define JPEG_HEADER_MAX 1024
+
+/*
+ * A frame too large for its buffer is encoded again at half the quality,
+ * down to the minimum. After this many frames that use at most 3/4 of the
+ * buffer the quality steps back towards -j.
+ */
+#define JPEG_QUALITY_MIN 10
+#define JPEG_QUALITY_STEP 10
+#define JPEG_QUALITY_RESTORE_FRAMES 30
+
+struct jpeg_huffman {
+    uint16_t code[256];
+    uint8_t size[256];
+};
+
+/* Bit writer of one slice, stuffs a zero byte after every 0xFF */
+struct jpeg_bits {
+    uint8_t * out;
+    uint8_t * end;
+    uint64_t acc;
+    unsigned int nbits;
+    bool overflow;
+};
+
+/*
+ * Baseline JPEG encoder for YUYV frames, sampled 4:2:2 like the source.
+ * Every MCU row is one restart interval, so groups of rows are encoded
+ * in parallel into separate slices and joined with RSTn markers.
+ */
+struct jpeg_encoder {
+    bool active;
+    unsigned int quality;       /* in use, below -j after frames that didn't fit */
+    unsigned int fitted;        /* frames with room to spare since the quality changed */
+    uint8_t qt_luma[64];
+    uint8_t qt_chroma[64];
+    float fdtbl_luma[64];
+    float fdtbl_chroma[64];
+    struct jpeg_huffman dc_luma;
+    struct jpeg_huffman ac_luma;
+    struct jpeg_huffman dc_chroma;
+    struct jpeg_huffman ac_chroma;
+    uint8_t * slice[WORKER_POOL_MAX];
+    size_t slice_capacity;
+};
+
+/* One frame encoded by the worker pool */
+struct jpeg_job {
+    const uint8_t * src;
+    unsigned int stride;
+    unsigned int width;
+    unsigned int height;
+    size_t slice_size[WORKER_POOL_MAX];
+    bool slice_overflow[WORKER_POOL_MAX];
+};
+
+/* Natural order index of every zigzag position */
+static const uint8_t jpeg_zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+/* ITU-T T.81 Annex K quantization tables, natural order */
+static const uint8_t jpeg_std_qt_luma[64] = {
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+};
+
+static const uint8_t jpeg_std_qt_chroma[64] = {
+    17,  18,  24,  47,  99,  99,  99,  99,
+    18,  21,  26,  66,  99,  99,  99,  99,
+    24,  26,  56,  99,  99,  99,  99,  99,
+    47,  66,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99
+};
+
+/* ITU-T T.81 Annex K Huffman tables, code counts per length and symbols */
+static const uint8_t jpeg_dc_luma_bits[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+static const uint8_t jpeg_dc_chroma_bits[16] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+static const uint8_t jpeg_dc_vals[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+static const uint8_t jpeg_ac_luma_bits[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+static const uint8_t jpeg_ac_luma_vals[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+static const uint8_t jpeg_ac_chroma_bits[16] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+static const uint8_t jpeg_ac_chroma_vals[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+/* ---------------------------------------------------------------------------
+ * Format negotiation
+ */
+
+#define FORMAT_TABLE_SIZE 128
+
+/* One frame size of a capture pixel format */
+struct capture_format {
+    unsigned int pixelformat;
+    unsigned int width;         /* maximum size for stepwise ranges */
+    unsigned int height;
+    bool stepwise;
+    unsigned int min_width;
+    unsigned int min_height;
+    unsigned int step_width;
+    unsigned int step_height;
+    unsigned int interval;      /* fastest frame interval in 100 ns units, 0 if unknown */
+};
+
+/* What the capture device can deliver, enumerated once at startup */
+struct format_table {
+    struct capture_format entries[FORMAT_TABLE_SIZE];
+    unsigned int count;
+};
+
+/*
+ * Capture format picked for the committed UVC format and the stages
+ * inserted between them. When any stage runs the UVC buffers own their
+ * memory and the capture buffer goes back to the camera right away.
+ */
+struct format_plan {
+    unsigned int pixelformat;
+    unsigned int width;
+    unsigned int height;
+    bool scale;                 /* YUYV frames are resized to the UVC frame size */
+    bool convert;               /* frames are scaled and/or encoded into UVC buffers */
+    struct buffer scaled;       /* staging frame when scaling feeds the encoder */
+};
+
+/* One YUYV frame resized by the worker pool */
+struct yuyv_scale_job {
+    const uint8_t * src;
+    unsigned int src_stride;
+    unsigned int src_width;
+    unsigned int src_height;
+    uint8_t * dst;
+    unsigned int dst_width;
+    unsigned int dst_height;
+};
+
+/* ---------------------------------------------------------------------------
+ * Pipelines
+ */
+
+#define PIPELINE_MAX 4
+
+/*
+ * State of one source to UVC pipeline. Every pipeline runs in its own
+ * thread, which together with its capture and worker threads reaches it
+ * through the thread-local pipeline pointer.
+ */
+struct pipeline {
+    unsigned int index;
+    pthread_t thread;
+    int terminate_fd;
+
+    struct uvc_settings settings;
+    struct v4l2_device v4l2_dev;
+    struct v4l2_device uvc_devs[UVC_OUTPUT_MAX];
+    struct v4l2_device fb_dev;
+
+    /* UVC formats and streaming parameters read from configfs */
+    struct uvc_frame_format uvc_frame_format[UVC_FRAME_FORMAT_MAX];
+    int last_format_index;
+    unsigned int streaming_maxburst;
+    unsigned int streaming_maxpacket;
+    unsigned int streaming_interval;
+
+    struct control_state controls[ARRAY_SIZE(control_mapping)];
+    uint8_t control_lookup[CONTROL_UNIT_TYPES][CONTROL_SELECTORS];  /* control index + 1, 0 if unmapped */
+    struct control_worker control_worker;
+    struct format_table capture_formats;
+    struct format_plan format_plan;
+
+    struct processing processing;
+    struct capture capture;
+    struct buffer_pool buffer_pool;
+    struct stats stats;
+    struct worker_pool workers;
+    struct frame_stage frame_stage;
+    struct rgb2yuyv_kernels rgb2yuyv;
+    struct jpeg_encoder jpeg;
+};
+
+static __thread struct pipeline * pipeline;
+
+static struct pipeline * pipelines[PIPELINE_MAX];
+static unsigned int npipelines;